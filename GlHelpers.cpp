@@ -1,6 +1,7 @@
 #include "GlHelpers.h"
 #include "Structures/SceneAndViewSettings.h"
 #include <boost/stacktrace.hpp>
+#include <xmmintrin.h>
 
 const std::map<unsigned int, GLenum> orderedSeverity = {
 	{GL_DEBUG_SEVERITY_NOTIFICATION,1},
@@ -9,6 +10,53 @@ const std::map<unsigned int, GLenum> orderedSeverity = {
 	{GL_DEBUG_SEVERITY_HIGH,4 }
 };
 
+namespace
+{
+	// Writes the first three lanes
+	inline void storeVector3(float* output, __m128 value)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64*>(output), value);
+		_mm_store_ss(output + 2, _mm_movehl_ps(value, value));
+	}
+
+	// rows holds the 3x4 affine matrix row by row. Each lane of a register holds a different vector
+	void transformBatch(const float* rows, const aiVector3D* input, float* output, std::size_t outputStride, std::size_t count)
+	{
+		__m128 m[12];
+		for (int k = 0; k < 12; k++)
+		{
+			m[k] = _mm_set1_ps(rows[k]);
+		}
+		std::size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const aiVector3D* v = input + i;
+			__m128 x = _mm_setr_ps((float)v[0].x, (float)v[1].x, (float)v[2].x, (float)v[3].x);
+			__m128 y = _mm_setr_ps((float)v[0].y, (float)v[1].y, (float)v[2].y, (float)v[3].y);
+			__m128 z = _mm_setr_ps((float)v[0].z, (float)v[1].z, (float)v[2].z, (float)v[3].z);
+			__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[1], y)), _mm_add_ps(_mm_mul_ps(m[2], z), m[3]));
+			__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], x), _mm_mul_ps(m[5], y)), _mm_add_ps(_mm_mul_ps(m[6], z), m[7]));
+			__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], x), _mm_mul_ps(m[9], y)), _mm_add_ps(_mm_mul_ps(m[10], z), m[11]));
+			__m128 rw = _mm_setzero_ps();
+			// Back to one vector per register
+			_MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+			float* out = output + i * outputStride;
+			storeVector3(out, rx);
+			storeVector3(out + outputStride, ry);
+			storeVector3(out + 2 * outputStride, rz);
+			storeVector3(out + 3 * outputStride, rw);
+		}
+		for (; i < count; i++)
+		{
+			float x = (float)input[i].x, y = (float)input[i].y, z = (float)input[i].z;
+			float* out = output + i * outputStride;
+			out[0] = rows[0] * x + rows[1] * y + rows[2] * z + rows[3];
+			out[1] = rows[4] * x + rows[5] * y + rows[6] * z + rows[7];
+			out[2] = rows[8] * x + rows[9] * y + rows[10] * z + rows[11];
+		}
+	}
+}
+
 namespace GlHelpers {
 	void GLAPIENTRY
 		MessageCallback(GLenum source,
@@ -134,4 +182,24 @@ namespace GlHelpers {
 	{
 		return glm::vec4(vec.r, vec.g, vec.b, vec.a);
 	}
+
+	void transformPoints(const aiMatrix4x4& matrix, const aiVector3D* input, float* output, std::size_t outputStride, std::size_t count)
+	{
+		const float rows[12] = {
+			(float)matrix.a1, (float)matrix.a2, (float)matrix.a3, (float)matrix.a4,
+			(float)matrix.b1, (float)matrix.b2, (float)matrix.b3, (float)matrix.b4,
+			(float)matrix.c1, (float)matrix.c2, (float)matrix.c3, (float)matrix.c4
+		};
+		transformBatch(rows, input, output, outputStride, count);
+	}
+
+	void transformDirections(const aiMatrix3x3& matrix, const aiVector3D* input, float* output, std::size_t outputStride, std::size_t count)
+	{
+		const float rows[12] = {
+			(float)matrix.a1, (float)matrix.a2, (float)matrix.a3, 0.f,
+			(float)matrix.b1, (float)matrix.b2, (float)matrix.b3, 0.f,
+			(float)matrix.c1, (float)matrix.c2, (float)matrix.c3, 0.f
+		};
+		transformBatch(rows, input, output, outputStride, count);
+	}
 };
\ No newline at end of file
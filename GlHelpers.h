@@ -5,6 +5,8 @@
 #include <assimp/vector3.h>
 #include <assimp/vector2.h>
 #include <assimp/color4.h>
+#include <assimp/matrix3x3.h>
+#include <assimp/matrix4x4.h>
 #include <fstream>
 #define GLSL_VERSION 430
 
@@ -67,6 +69,10 @@ namespace GlHelpers {
 	glm::vec3 aiToGlm(aiVector3D vec);
 	glm::vec2 aiToGlm(aiVector2D vec);
 	glm::vec4 aiToGlm(aiColor4D vec);
+	// Transforms the points by the matrix, four at a time with SSE. Consecutive results are outputStride floats apart
+	void transformPoints(const aiMatrix4x4& matrix, const aiVector3D* input, float* output, std::size_t outputStride, std::size_t count);
+	// Transforms the directions without translation, e.g. normals by the inverse transpose of the model matrix
+	void transformDirections(const aiMatrix3x3& matrix, const aiVector3D* input, float* output, std::size_t outputStride, std::size_t count);
 	template<typename O, typename I>
 	O structConvert(I in)
 	{
@@ -28,6 +28,88 @@ std::condition_variable renderWait;
 bool wholeAppPowerSave = false;
 int main(int argc, const char** argv)
 {
+	bool forceFlat = false;
+	bool debug = false;
+	// Headless render mode
+	std::filesystem::path renderScene;
+	std::filesystem::path renderOut = "render.png";
+	unsigned int renderIterations = (unsigned int)SceneAndViewSettings::maxIterations;
+	bool renderQuilt = false;
+	unsigned int renderWidth = 0;
+	unsigned int renderHeight = 0;
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			bool hasValue = i + 1 < argc;
+			if (arg == "flat")
+			{
+				forceFlat = true;
+			}
+			else if (arg == "d")
+			{
+				debug = true;
+			}
+			else if (arg == "--render" && hasValue)
+			{
+				renderScene = argv[++i];
+			}
+			else if (arg == "--spp" && hasValue)
+			{
+				renderIterations = std::stoul(argv[++i]);
+			}
+			else if (arg == "--out" && hasValue)
+			{
+				renderOut = argv[++i];
+			}
+			else if (arg == "--quilt")
+			{
+				renderQuilt = true;
+			}
+			else if (arg == "--size" && hasValue)
+			{
+				std::string size = argv[++i];
+				renderWidth = std::stoul(size.substr(0, size.find('x')));
+				renderHeight = std::stoul(size.substr(size.find('x') + 1));
+			}
+			else if (arg == "--quilt-tiles" && hasValue)
+			{
+				std::string tiles = argv[++i];
+				SceneAndViewSettings::quiltColumns = std::stoul(tiles.substr(0, tiles.find('x')));
+				SceneAndViewSettings::quiltRows = std::stoul(tiles.substr(tiles.find('x') + 1));
+			}
+		}
+	}
+	catch (const std::logic_error&)
+	{
+		std::cerr << "Invalid number in the arguments" << std::endl;
+		return 1;
+	}
+	if (!renderScene.empty())
+	{
+		if (renderOut.extension() != ".png" && renderOut.extension() != ".hdr")
+		{
+			std::cerr << "Only .png and .hdr images can be written" << std::endl;
+			return 1;
+		}
+		if (renderWidth == 0 || renderHeight == 0)
+		{
+			renderWidth = renderQuilt ? 4096 : WINDOW_W * 2;
+			renderHeight = renderQuilt ? 4096 : WINDOW_H * 1.5;
+		}
+		if (renderQuilt && (SceneAndViewSettings::quiltColumns == 0 || SceneAndViewSettings::quiltRows == 0
+			|| renderWidth < SceneAndViewSettings::quiltColumns || renderHeight < SceneAndViewSettings::quiltRows))
+		{
+			std::cerr << "The quilt needs at least one pixel for each of its tiles" << std::endl;
+			return 1;
+		}
+		SceneAndViewSettings::scene.path = renderScene;
+		SceneAndViewSettings::GlobalScreenType = SceneAndViewSettings::ScreenType::Flat;
+		ProjectWindow headless(renderWidth, renderHeight);
+		return headless.renderHeadless(renderOut, renderIterations, renderQuilt);
+	}
+
 	float performanceFrequency = SDL_GetPerformanceFrequency();
 	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0)
 	{
@@ -45,22 +127,6 @@ int main(int argc, const char** argv)
 
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 
-	bool forceFlat = false;
-	bool debug = false;
-	if (argc > 1)
-	{
-		for (int i = 1; i < argc; i++)
-		{
-			if (std::string("flat") == argv[i])
-			{
-				forceFlat = true;
-			}
-			else if (std::string("d") == argv[i])
-			{
-				debug = true;
-			}
-		}
-	}
 	if (!debug)
 	{
 #ifdef WIN32
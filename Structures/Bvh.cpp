@@ -6,25 +6,23 @@
 #include "Box3.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <numeric>
 #include <xmmintrin.h>
 
 namespace
 {
-	struct TempNode : BVHNode
-	{
-		GLuint visitOrder = InvalidMask;
-		GLuint parent = InvalidMask;
-
-		GLuint left;
-		GLuint right;
-
-		glm::vec3 bboxCenter;
-
-		float primArea = 0.0f;
-
-		float surfaceAreaLeft = 0.0f;
-		float surfaceAreaRight = 0.0f;
-	};
+	const float TraversalCost = 1.0f;
+	const float IntersectionCost = 1.0f;
+	const GLuint MaxLeafSize = 8;
+	const unsigned int MaxBinCount = 64;
+	// Smaller subtrees are not worth spawning a task
+	const GLuint ParallelBuildThreshold = 4096;
+	// Scenes with more primitives get 63-bit Morton codes instead of 30-bit ones
+	const GLuint MortonNarrowCodeLimit = 1u << 20;
+	// Spatial splits are tried only when the children of the object split overlap by more than this part of the root surface
+	const float SpatialSplitOverlap = 1e-5f;
 
 	inline float bboxSurfaceArea(const glm::vec3& bboxMin, const glm::vec3& bboxMax)
 	{
@@ -55,7 +53,60 @@ namespace
 		return glm::vec3(temp[0], temp[1], temp[2]);
 	}
 
-	Box3 calculateBounds(std::vector<TempNode>& nodes, GLuint begin, GLuint end)
+	/**
+	* Read-only view of the scratch arrays together with the ID-to-array mapping.
+	* Node IDs below primCount are leaf positions, the others are internal nodes.
+	* primCount is the number of leaf references, which is higher than the triangle count after spatial splits.
+	*/
+	struct NodeAccess
+	{
+		BVHScratch& scratch;
+		GLuint primCount;
+
+		bool isLeaf(GLuint nodeId) const
+		{
+			return nodeId < primCount;
+		}
+
+		glm::vec3 min(GLuint nodeId) const
+		{
+			return glm::vec3(isLeaf(nodeId) ? scratch.primMin[scratch.order[nodeId]] : scratch.nodeMin[nodeId - primCount]);
+		}
+
+		glm::vec3 max(GLuint nodeId) const
+		{
+			return glm::vec3(isLeaf(nodeId) ? scratch.primMax[scratch.order[nodeId]] : scratch.nodeMax[nodeId - primCount]);
+		}
+
+		const glm::vec3& center(GLuint position) const
+		{
+			return scratch.primCenter[scratch.order[position]];
+		}
+
+		// Leaves and the internal nodes collapsed into multi-triangle leaves
+		bool isCollapsed(GLuint nodeId) const
+		{
+			return isLeaf(nodeId) || scratch.collapsed[nodeId - primCount];
+		}
+
+		// First leaf position and leaf count of the subtree. The leaves of a subtree are always contiguous
+		std::pair<GLuint, GLuint> leafRange(GLuint nodeId) const
+		{
+			if (isLeaf(nodeId))
+			{
+				return { nodeId, 1 };
+			}
+			return { scratch.subtreeFirst[nodeId - primCount], scratch.subtreeSize[nodeId - primCount] };
+		}
+
+		GLuint triangle(GLuint position) const
+		{
+			GLuint reference = scratch.order[position];
+			return scratch.referenceTriangle.empty() ? reference : scratch.referenceTriangle[reference];
+		}
+	};
+
+	Box3 calculateBounds(const NodeAccess& nodes, GLuint begin, GLuint end)
 	{
 		Box3 bounds;
 		if (begin == end)
@@ -69,8 +120,9 @@ namespace
 			__m128 bboxMax = _mm_set1_ps(-FLT_MAX);
 			for (GLuint i = begin; i < end; ++i)
 			{
-				__m128 nodeBoundsMin = _mm_loadu_ps(&nodes[i].bboxMin.x);
-				__m128 nodeBoundsMax = _mm_loadu_ps(&nodes[i].bboxMax.x);
+				GLuint prim = nodes.scratch.order[i];
+				__m128 nodeBoundsMin = _mm_loadu_ps(&nodes.scratch.primMin[prim].x);
+				__m128 nodeBoundsMax = _mm_loadu_ps(&nodes.scratch.primMax[prim].x);
 				bboxMin = _mm_min_ps(bboxMin, nodeBoundsMin);
 				bboxMax = _mm_max_ps(bboxMax, nodeBoundsMax);
 			}
@@ -80,12 +132,152 @@ namespace
 		return bounds;
 	}
 
-	GLuint split(std::vector<TempNode>& nodes, GLuint begin, GLuint end, const Box3& nodeBounds, const unsigned int sahThreshold)
+	struct Bin
+	{
+		Box3 bounds;
+		GLuint count;
+	};
+
+	struct ObjectSplit
+	{
+		// -1 when all the centroids are at the same place
+		int axis = -1;
+		GLuint bin = 0;
+		GLuint binCount = 0;
+		float binOrigin = 0.0f;
+		float binScale = 0.0f;
+		// Sum of the child surface areas weighted by their primitive counts
+		float cost = FLT_MAX;
+		Box3 leftBounds;
+		Box3 rightBounds;
+	};
+
+	// Evaluates SAH at the bin boundaries for the primitives (or references) listed in [first, last)
+	ObjectSplit findBinnedSplit(const BVHScratch& scratch, const GLuint* first, const GLuint* last, unsigned int binCount)
+	{
+		ObjectSplit best;
+		best.binCount = binCount = std::clamp(binCount, 2u, MaxBinCount);
+
+		// Bins are spread over the centroids, not over the whole node
+		Box3 centroidBounds;
+		centroidBounds.expandInit();
+		for (const GLuint* prim = first; prim != last; ++prim)
+		{
+			centroidBounds.expand(scratch.primCenter[*prim]);
+		}
+		glm::vec3 extents = centroidBounds.dimensions();
+
+		std::array<Bin, MaxBinCount> bins;
+		std::array<Box3, MaxBinCount> boundsRight;
+		std::array<GLuint, MaxBinCount> countRight;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (extents[axis] <= 0.0f)
+			{
+				continue;
+			}
+			float binScale = binCount / extents[axis];
+			float binOrigin = centroidBounds.m_min[axis];
+
+			for (GLuint b = 0; b < binCount; ++b)
+			{
+				bins[b].bounds.expandInit();
+				bins[b].count = 0;
+			}
+			for (const GLuint* prim = first; prim != last; ++prim)
+			{
+				GLuint b = std::min(binCount - 1, (GLuint)((scratch.primCenter[*prim][axis] - binOrigin) * binScale));
+				bins[b].bounds.expand(glm::vec3(scratch.primMin[*prim]));
+				bins[b].bounds.expand(glm::vec3(scratch.primMax[*prim]));
+				bins[b].count++;
+			}
+
+			// Sweep from the right to get the right side of every bin boundary
+			Box3 accumulatedBounds;
+			accumulatedBounds.expandInit();
+			GLuint accumulatedRight = 0;
+			for (GLuint b = binCount - 1; b > 0; --b)
+			{
+				accumulatedBounds.expand(bins[b].bounds);
+				accumulatedRight += bins[b].count;
+				countRight[b] = accumulatedRight;
+				boundsRight[b] = accumulatedBounds;
+			}
+
+			// Sweep from the left and evaluate the boundaries
+			Box3 boundsLeft;
+			boundsLeft.expandInit();
+			GLuint accumulatedLeft = 0;
+			for (GLuint b = 1; b < binCount; ++b)
+			{
+				boundsLeft.expand(bins[b - 1].bounds);
+				accumulatedLeft += bins[b - 1].count;
+				if (accumulatedLeft == 0 || countRight[b] == 0)
+				{
+					continue;
+				}
+
+				float cost = bboxSurfaceArea(boundsLeft) * (float)accumulatedLeft + bboxSurfaceArea(boundsRight[b]) * (float)countRight[b];
+				if (cost < best.cost)
+				{
+					best.cost = cost;
+					best.axis = axis;
+					best.bin = b;
+					best.binOrigin = binOrigin;
+					best.binScale = binScale;
+					best.leftBounds = boundsLeft;
+					best.rightBounds = boundsRight[b];
+				}
+			}
+		}
+		return best;
+	}
+
+	// Moves the primitives left of the split to the front. Returns the first one on the right side
+	GLuint* partitionBinned(const BVHScratch& scratch, GLuint* first, GLuint* last, const ObjectSplit& split)
+	{
+		return std::partition(first, last,
+			[&](GLuint prim)
+			{
+				return std::min(split.binCount - 1, (GLuint)((scratch.primCenter[prim][split.axis] - split.binOrigin) * split.binScale)) < split.bin;
+			});
+	}
+
+	GLuint binnedSplit(const NodeAccess& nodes, GLuint begin, GLuint end, unsigned int binCount)
+	{
+		GLuint* first = nodes.scratch.order.data() + begin;
+		GLuint* last = nodes.scratch.order.data() + end;
+		ObjectSplit split = findBinnedSplit(nodes.scratch, first, last, binCount);
+		if (split.axis < 0)
+		{
+			// All the centroids are at the same place so any split is as good as other
+			return begin + (end - begin) / 2;
+		}
+		return begin + (GLuint)(partitionBinned(nodes.scratch, first, last, split) - first);
+	}
+
+	void sortByAxis(const NodeAccess& nodes, GLuint begin, GLuint end, int axis)
+	{
+		const auto& centers = nodes.scratch.primCenter;
+		std::sort(nodes.scratch.order.begin() + begin, nodes.scratch.order.begin() + end,
+			[&](GLuint a, GLuint b)
+			{
+				return centers[a][axis] < centers[b][axis];
+			});
+	}
+
+	GLuint split(const NodeAccess& nodes, GLuint begin, GLuint end, const Box3& nodeBounds, const BVHBuilder& settings)
 	{
 		GLuint count = end - begin;
 		GLuint bestSplit = begin;
+		BVHScratch& scratch = nodes.scratch;
 
-		if (count <= sahThreshold)
+		if (count <= settings.sahThreshold && settings.splitMethod == BVHBuilder::SplitMethod::BinnedSAH)
+		{
+			return binnedSplit(nodes, begin, end, settings.binCount);
+		}
+		else if (count <= settings.sahThreshold)
 		{
 			// Use Surface Area Heuristic
 			GLuint bestAxis = 0;
@@ -94,12 +286,7 @@ namespace
 
 			for (GLuint axis = 0; axis < 3; ++axis)
 			{
-				// TODO: just sort into N buckets
-				std::sort(nodes.begin() + begin, nodes.begin() + end,
-					[&](const TempNode& a, const TempNode& b)
-					{
-						return a.bboxCenter[axis] < b.bboxCenter[axis];
-					});
+				sortByAxis(nodes, begin, end, axis);
 
 				Box3 boundsLeft;
 				boundsLeft.expandInit();
@@ -111,24 +298,24 @@ namespace
 				{
 					GLuint indexRight = count - indexLeft - 1;
 
-					boundsLeft.expand(nodes[begin + indexLeft].bboxMin);
-					boundsLeft.expand(nodes[begin + indexLeft].bboxMax);
+					boundsLeft.expand(nodes.min(begin + indexLeft));
+					boundsLeft.expand(nodes.max(begin + indexLeft));
 
-					boundsRight.expand(nodes[begin + indexRight].bboxMin);
-					boundsRight.expand(nodes[begin + indexRight].bboxMax);
+					boundsRight.expand(nodes.min(begin + indexRight));
+					boundsRight.expand(nodes.max(begin + indexRight));
 
 					float surfaceAreaLeft = bboxSurfaceArea(boundsLeft);
 					float surfaceAreaRight = bboxSurfaceArea(boundsRight);
 
-					nodes[begin + indexLeft].surfaceAreaLeft = surfaceAreaLeft;
-					nodes[begin + indexRight].surfaceAreaRight = surfaceAreaRight;
+					scratch.sweepAreaLeft[begin + indexLeft] = surfaceAreaLeft;
+					scratch.sweepAreaRight[begin + indexRight] = surfaceAreaRight;
 				}
 
 				float bestCost = FLT_MAX;
 				for (GLuint mid = begin + 1; mid < end; ++mid)
 				{
-					float surfaceAreaLeft = nodes[mid - 1].surfaceAreaLeft;
-					float surfaceAreaRight = nodes[mid].surfaceAreaRight;
+					float surfaceAreaLeft = scratch.sweepAreaLeft[mid - 1];
+					float surfaceAreaRight = scratch.sweepAreaRight[mid];
 
 					GLuint countLeft = mid - begin;
 					GLuint countRight = end - mid;
@@ -152,11 +339,7 @@ namespace
 				}
 			}
 
-			std::sort(nodes.begin() + begin, nodes.begin() + end,
-				[&](const TempNode& a, const TempNode& b)
-				{
-					return a.bboxCenter[bestAxis] < b.bboxCenter[bestAxis];
-				});
+			sortByAxis(nodes, begin, end, bestAxis);
 
 			return globalBestSplit;
 		}
@@ -166,16 +349,12 @@ namespace
 			glm::vec3 extents = nodeBounds.dimensions();
 			int majorAxis = (int)std::distance(&extents.x, std::max_element(&extents.x, &extents.z));
 
-			std::sort(nodes.begin() + begin, nodes.begin() + end,
-				[&](const TempNode& a, const TempNode& b)
-				{
-					return a.bboxCenter[majorAxis] < b.bboxCenter[majorAxis];
-				});
+			sortByAxis(nodes, begin, end, majorAxis);
 
 			float splitPos = (nodeBounds.m_min[majorAxis] + nodeBounds.m_max[majorAxis]) * 0.5f;
 			for (uint32_t mid = begin + 1; mid < end; ++mid)
 			{
-				if (nodes[mid].bboxCenter[majorAxis] >= splitPos)
+				if (nodes.center(mid)[majorAxis] >= splitPos)
 				{
 					return mid;
 				}
@@ -185,7 +364,134 @@ namespace
 		};
 	}
 
-	GLuint buildNodeHierarchy(std::vector<TempNode>& nodes, GLuint begin, GLuint end, const unsigned int sahThreshold)
+	// Spreads the lower 10 bits so there are two zero bits between each of them
+	inline uint64_t expandBits10(uint32_t v)
+	{
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	// Spreads the lower 21 bits so there are two zero bits between each of them
+	inline uint64_t expandBits21(uint64_t v)
+	{
+		v &= 0x1FFFFF;
+		v = (v | v << 32) & 0x1F00000000FFFFull;
+		v = (v | v << 16) & 0x1F0000FF0000FFull;
+		v = (v | v << 8) & 0x100F00F00F00F00Full;
+		v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+		v = (v | v << 2) & 0x1249249249249249ull;
+		return v;
+	}
+
+	/**
+	* Sorts the leaf positions along a Z-order curve and stores the sorted codes into scratch.mortonCodes.
+	* Codes have 30 bits for smaller scenes and 63 bits for the big ones.
+	*/
+	void sortByMortonCodes(BVHScratch& scratch, GLuint primCount, ThreadPool* pool)
+	{
+		Box3 centroidBounds;
+		centroidBounds.expandInit();
+		for (GLuint i = 0; i < primCount; ++i)
+		{
+			centroidBounds.expand(scratch.primCenter[i]);
+		}
+		glm::vec3 extents = centroidBounds.dimensions();
+		float maxExtent = std::max(extents.x, std::max(extents.y, extents.z));
+
+		const bool wideCodes = primCount > MortonNarrowCodeLimit;
+		const unsigned int bitsPerAxis = wideCodes ? 21 : 10;
+		const float quantization = maxExtent > 0.0f ? ((1u << bitsPerAxis) - 1) / maxExtent : 0.0f;
+
+		auto& codes = scratch.mortonCodes;
+		auto& order = scratch.order;
+		codes.resize(primCount);
+		auto computeCode = [&](std::size_t i)
+		{
+			glm::vec3 q = (scratch.primCenter[order[i]] - centroidBounds.m_min) * quantization;
+			if (wideCodes)
+			{
+				codes[i] = expandBits21((uint64_t)q.x) << 2 | expandBits21((uint64_t)q.y) << 1 | expandBits21((uint64_t)q.z);
+			}
+			else
+			{
+				codes[i] = expandBits10((uint32_t)q.x) << 2 | expandBits10((uint32_t)q.y) << 1 | expandBits10((uint32_t)q.z);
+			}
+		};
+		if (pool != nullptr)
+		{
+			pool->parallelFor(0, primCount, ParallelBuildThreshold, computeCode);
+		}
+		else
+		{
+			for (GLuint i = 0; i < primCount; ++i)
+			{
+				computeCode(i);
+			}
+		}
+
+		// LSD radix sort with 8-bit digits, only over the bits the codes really have
+		auto& codesTemp = scratch.mortonCodesTemp;
+		auto& orderTemp = scratch.orderTemp;
+		codesTemp.resize(primCount);
+		orderTemp.resize(primCount);
+		const unsigned int bits = bitsPerAxis * 3;
+		for (unsigned int shift = 0; shift < bits; shift += 8)
+		{
+			std::array<GLuint, 257> offsets = {};
+			for (GLuint i = 0; i < primCount; ++i)
+			{
+				offsets[((codes[i] >> shift) & 0xFF) + 1]++;
+			}
+			for (unsigned int d = 1; d < offsets.size(); ++d)
+			{
+				offsets[d] += offsets[d - 1];
+			}
+			for (GLuint i = 0; i < primCount; ++i)
+			{
+				GLuint target = offsets[(codes[i] >> shift) & 0xFF]++;
+				codesTemp[target] = codes[i];
+				orderTemp[target] = order[i];
+			}
+			codes.swap(codesTemp);
+			order.swap(orderTemp);
+		}
+	}
+
+	// Splits at the highest bit in which the Morton codes of the range differ
+	GLuint mortonSplit(const std::vector<uint64_t>& codes, GLuint begin, GLuint end)
+	{
+		uint64_t differentBits = codes[begin] ^ codes[end - 1];
+		if (differentBits == 0)
+		{
+			return begin + (end - begin) / 2;
+		}
+		uint64_t splitBit = uint64_t(1) << (63 - std::countl_zero(differentBits));
+		auto midIt = std::partition_point(codes.begin() + begin, codes.begin() + end,
+			[splitBit](uint64_t code)
+			{
+				return (code & splitBit) == 0;
+			});
+		return (GLuint)std::distance(codes.begin(), midIt);
+	}
+
+	struct BuildContext
+	{
+		NodeAccess nodes;
+		const BVHBuilder& settings;
+		ThreadPool* pool;
+		// Large nodes are split by Morton codes when set
+		bool mortonSplits;
+	};
+
+	/**
+	* Internal nodes get their IDs in pre-order, starting at primCount.
+	* The subtree of a range with N leaves always occupies N - 1 consecutive IDs starting at nodeId,
+	* so the resulting IDs do not depend on the order in which the subtrees are finished.
+	*/
+	GLuint buildNodeHierarchy(BuildContext& context, GLuint begin, GLuint end, GLuint nodeId)
 	{
 		GLuint count = end - begin;
 
@@ -194,174 +500,1247 @@ namespace
 			return begin;
 		}
 
-		Box3 bounds = calculateBounds(nodes, begin, end);
+		const NodeAccess& nodes = context.nodes;
+		BVHScratch& scratch = nodes.scratch;
+		// Morton splits do not need the bounds in advance. They are made up from the children afterwards
+		const bool isMortonSplit = context.mortonSplits && count > context.settings.sahThreshold;
+		Box3 bounds;
+		GLuint mid;
+		if (isMortonSplit)
+		{
+			mid = mortonSplit(scratch.mortonCodes, begin, end);
+		}
+		else
+		{
+			bounds = calculateBounds(nodes, begin, end);
+			mid = split(nodes, begin, end, bounds, context.settings);
+		}
+
+		GLuint left, right;
+		GLuint leftId = nodeId + 1;
+		GLuint rightId = nodeId + (mid - begin);
+		if (context.pool != nullptr && count > ParallelBuildThreshold)
+		{
+			auto leftTask = context.pool->submit([&context, begin, mid, leftId] {
+				return buildNodeHierarchy(context, begin, mid, leftId);
+				});
+			right = buildNodeHierarchy(context, mid, end, rightId);
+			left = context.pool->wait(leftTask);
+		}
+		else
+		{
+			left = buildNodeHierarchy(context, begin, mid, leftId);
+			right = buildNodeHierarchy(context, mid, end, rightId);
+		}
+
+		float surfaceAreaLeft = bboxSurfaceArea(nodes.min(left), nodes.max(left));
+		float surfaceAreaRight = bboxSurfaceArea(nodes.min(right), nodes.max(right));
+
+		if (surfaceAreaRight > surfaceAreaLeft)
+		{
+			std::swap(left, right);
+		}
 
-		GLuint mid = split(nodes, begin, end, bounds, sahThreshold);
+		if (isMortonSplit)
+		{
+			bounds.m_min = glm::min(nodes.min(left), nodes.min(right));
+			bounds.m_max = glm::max(nodes.max(left), nodes.max(right));
+		}
 
-		GLuint nodeId = (GLuint)nodes.size();
-		nodes.push_back(TempNode());
+		GLuint internalIndex = nodeId - nodes.primCount;
+		scratch.nodeMin[internalIndex] = glm::vec4(bounds.m_min, 0.0f);
+		scratch.nodeMax[internalIndex] = glm::vec4(bounds.m_max, 0.0f);
+		scratch.left[internalIndex] = left;
+		scratch.right[internalIndex] = right;
 
-		TempNode node;
+		return nodeId;
+	}
 
-		node.left = buildNodeHierarchy(nodes, begin, mid, sahThreshold);
-		node.right = buildNodeHierarchy(nodes, mid, end, sahThreshold);
+	inline bool isValid(const Box3& box)
+	{
+		return box.m_min.x <= box.m_max.x && box.m_min.y <= box.m_max.y && box.m_min.z <= box.m_max.z;
+	}
 
-		float surfaceAreaLeft = bboxSurfaceArea(nodes[node.left].bboxMin, nodes[node.left].bboxMax);
-		float surfaceAreaRight = bboxSurfaceArea(nodes[node.right].bboxMin, nodes[node.right].bboxMax);
+	// Surface area weighted by the primitive count. Empty sides cost nothing
+	inline float sideCost(const Box3& box, GLuint count)
+	{
+		return count ? bboxSurfaceArea(box) * (float)count : 0.0f;
+	}
 
-		if (surfaceAreaRight > surfaceAreaLeft)
+	inline Box3 boxUnion(Box3 a, const Box3& b)
+	{
+		a.expand(b);
+		return a;
+	}
+
+	// Bounds of the part of the triangle between the planes low and high on the axis, limited to the given box
+	Box3 clipTriangle(const std::array<glm::vec3, 3>& vertices, int axis, float low, float high, const Box3& limit)
+	{
+		Box3 bounds;
+		bounds.expandInit();
+		for (int i = 0; i < 3; ++i)
 		{
-			std::swap(node.left, node.right);
+			const glm::vec3& from = vertices[i];
+			const glm::vec3& to = vertices[(i + 1) % 3];
+			if (from[axis] >= low && from[axis] <= high)
+			{
+				bounds.expand(from);
+			}
+			for (float plane : { low, high })
+			{
+				if ((from[axis] < plane) != (to[axis] < plane))
+				{
+					glm::vec3 intersection = glm::mix(from, to, (plane - from[axis]) / (to[axis] - from[axis]));
+					intersection[axis] = plane;
+					bounds.expand(intersection);
+				}
+			}
 		}
+		bounds.m_min = glm::max(bounds.m_min, limit.m_min);
+		bounds.m_max = glm::min(bounds.m_max, limit.m_max);
+		return bounds;
+	}
 
-		setBounds(node, bounds.m_min, bounds.m_max);
-		node.bboxCenter = bounds.center();
-		node.triangleIndex = BVHNode::InvalidMask;
+	struct SpatialSplit
+	{
+		int axis = -1;
+		float position = 0.0f;
+		float cost = FLT_MAX;
+	};
 
-		nodes[node.left].parent = nodeId;
-		nodes[node.right].parent = nodeId;
+	struct SpatialBin
+	{
+		Box3 bounds;
+		GLuint entries;
+		GLuint exits;
+	};
 
-		nodes[nodeId] = node;
+	/**
+	* Split BVH (Stich et al. 2009). Besides the object splits it considers splitting the node by a plane,
+	* which clips the triangles crossing it into two references. The references have their own bounds
+	* in the scratch prim arrays and map to the triangles through referenceTriangle.
+	* The build runs on the calling thread because the reference count is not known in advance.
+	*/
+	struct SpatialSplitBuilder
+	{
+		BVHScratch& scratch;
+		std::span<const FastTriangleFirstHalf> trianglesFirst;
+		std::span<const FastTriangleSecondHalf> trianglesSecond;
+		const BVHBuilder& settings;
+		// No more references are created when this is reached
+		GLuint referenceLimit;
+		// Spatial splits are tried only when the children of the object split overlap more than this
+		float minOverlapArea;
+
+		// Internal nodes are numbered in the order they are created. Their IDs get shifted when the leaf count is known
+		static const GLuint InternalFlag = BVHNode::LeafMask;
+
+		Box3 referenceBounds(GLuint reference) const
+		{
+			return Box3{ glm::vec3(scratch.primMin[reference]), glm::vec3(scratch.primMax[reference]) };
+		}
 
-		return nodeId;
-	}
+		std::array<glm::vec3, 3> triangleVertices(GLuint reference) const
+		{
+			GLuint triangle = scratch.referenceTriangle[reference];
+			return toFast(trianglesFirst[triangle], trianglesSecond[triangle]).toClassic();
+		}
+
+		void setReferenceBounds(GLuint reference, const Box3& bounds)
+		{
+			scratch.primMin[reference] = glm::vec4(bounds.m_min, 0.0f);
+			scratch.primMax[reference] = glm::vec4(bounds.m_max, 0.0f);
+			scratch.primCenter[reference] = bounds.center();
+		}
+
+		GLuint addReference(GLuint triangle, const Box3& bounds)
+		{
+			GLuint reference = (GLuint)scratch.primMin.size();
+			scratch.primMin.emplace_back();
+			scratch.primMax.emplace_back();
+			scratch.primCenter.emplace_back();
+			scratch.referenceTriangle.push_back(triangle);
+			setReferenceBounds(reference, bounds);
+			return reference;
+		}
+
+		SpatialSplit findSpatialSplit(const std::vector<GLuint>& references, const Box3& nodeBounds) const
+		{
+			const GLuint binCount = std::clamp(settings.binCount, 2u, MaxBinCount);
+			glm::vec3 extents = nodeBounds.dimensions();
+			SpatialSplit best;
+
+			std::array<SpatialBin, MaxBinCount> bins;
+			std::array<Box3, MaxBinCount> boundsRight;
+			std::array<GLuint, MaxBinCount> countRight;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				if (extents[axis] <= 0.0f)
+				{
+					continue;
+				}
+				float binWidth = extents[axis] / binCount;
+				float binOrigin = nodeBounds.m_min[axis];
+				for (GLuint b = 0; b < binCount; ++b)
+				{
+					bins[b].bounds.expandInit();
+					bins[b].entries = 0;
+					bins[b].exits = 0;
+				}
+
+				for (GLuint reference : references)
+				{
+					Box3 bounds = referenceBounds(reference);
+					GLuint firstBin = std::min(binCount - 1, (GLuint)std::max(0.0f, (bounds.m_min[axis] - binOrigin) / binWidth));
+					GLuint lastBin = std::clamp((GLuint)std::max(0.0f, (bounds.m_max[axis] - binOrigin) / binWidth), firstBin, binCount - 1);
+					if (firstBin == lastBin)
+					{
+						bins[firstBin].bounds.expand(bounds);
+					}
+					else
+					{
+						auto vertices = triangleVertices(reference);
+						for (GLuint b = firstBin; b <= lastBin; ++b)
+						{
+							float low = b == firstBin ? -FLT_MAX : binOrigin + b * binWidth;
+							float high = b == lastBin ? FLT_MAX : binOrigin + (b + 1) * binWidth;
+							Box3 clipped = clipTriangle(vertices, axis, low, high, bounds);
+							if (isValid(clipped))
+							{
+								bins[b].bounds.expand(clipped);
+							}
+						}
+					}
+					bins[firstBin].entries++;
+					bins[lastBin].exits++;
+				}
+
+				Box3 accumulatedBounds;
+				accumulatedBounds.expandInit();
+				GLuint accumulatedRight = 0;
+				for (GLuint b = binCount - 1; b > 0; --b)
+				{
+					accumulatedBounds.expand(bins[b].bounds);
+					accumulatedRight += bins[b].exits;
+					countRight[b] = accumulatedRight;
+					boundsRight[b] = accumulatedBounds;
+				}
+
+				Box3 boundsLeft;
+				boundsLeft.expandInit();
+				GLuint accumulatedLeft = 0;
+				for (GLuint b = 1; b < binCount; ++b)
+				{
+					boundsLeft.expand(bins[b - 1].bounds);
+					accumulatedLeft += bins[b - 1].entries;
+					if (accumulatedLeft == 0 || countRight[b] == 0)
+					{
+						continue;
+					}
+					float cost = sideCost(boundsLeft, accumulatedLeft) + sideCost(boundsRight[b], countRight[b]);
+					if (cost < best.cost)
+					{
+						best.cost = cost;
+						best.axis = axis;
+						best.position = binOrigin + b * binWidth;
+					}
+				}
+			}
+			return best;
+		}
 
-	void setDepthFirstVisitOrder(std::vector<TempNode>& nodes, GLuint nodeId, GLuint nextId, GLuint& order)
+		/**
+		* Distributes the references by the plane. A reference crossing it is split in two, or kept whole on one side
+		* when that is cheaper ("reference unsplitting"). Returns false when one side would stay empty.
+		*/
+		bool splitSpatially(const std::vector<GLuint>& references, const SpatialSplit& split,
+			std::vector<GLuint>& left, std::vector<GLuint>& right)
+		{
+			const int axis = split.axis;
+			Box3 boundsLeft, boundsRight;
+			boundsLeft.expandInit();
+			boundsRight.expandInit();
+			std::vector<GLuint> crossing;
+			for (GLuint reference : references)
+			{
+				Box3 bounds = referenceBounds(reference);
+				if (bounds.m_max[axis] <= split.position)
+				{
+					left.push_back(reference);
+					boundsLeft.expand(bounds);
+				}
+				else if (bounds.m_min[axis] >= split.position)
+				{
+					right.push_back(reference);
+					boundsRight.expand(bounds);
+				}
+				else
+				{
+					crossing.push_back(reference);
+				}
+			}
+
+			for (GLuint reference : crossing)
+			{
+				Box3 bounds = referenceBounds(reference);
+				auto vertices = triangleVertices(reference);
+				Box3 leftPart = clipTriangle(vertices, axis, -FLT_MAX, split.position, bounds);
+				Box3 rightPart = clipTriangle(vertices, axis, split.position, FLT_MAX, bounds);
+				GLuint countLeft = (GLuint)left.size();
+				GLuint countRight = (GLuint)right.size();
+
+				float splitCost = sideCost(boxUnion(boundsLeft, leftPart), countLeft + 1) + sideCost(boxUnion(boundsRight, rightPart), countRight + 1);
+				float leftCost = sideCost(boxUnion(boundsLeft, bounds), countLeft + 1) + sideCost(boundsRight, countRight);
+				float rightCost = sideCost(boundsLeft, countLeft) + sideCost(boxUnion(boundsRight, bounds), countRight + 1);
+				bool canSplit = isValid(leftPart) && isValid(rightPart) && scratch.primMin.size() < referenceLimit;
+
+				if (canSplit && splitCost < leftCost && splitCost < rightCost)
+				{
+					setReferenceBounds(reference, leftPart);
+					left.push_back(reference);
+					boundsLeft.expand(leftPart);
+					right.push_back(addReference(scratch.referenceTriangle[reference], rightPart));
+					boundsRight.expand(rightPart);
+				}
+				else if (leftCost <= rightCost)
+				{
+					left.push_back(reference);
+					boundsLeft.expand(bounds);
+				}
+				else
+				{
+					right.push_back(reference);
+					boundsRight.expand(bounds);
+				}
+			}
+			// Nothing was split if a side stayed empty, so the references are unchanged
+			return !left.empty() && !right.empty();
+		}
+
+		void splitByObjects(std::vector<GLuint>& references, const ObjectSplit& split, std::vector<GLuint>& left, std::vector<GLuint>& right) const
+		{
+			GLuint* first = references.data();
+			GLuint* last = first + references.size();
+			GLuint* mid = split.axis < 0 ? first + references.size() / 2 : partitionBinned(scratch, first, last, split);
+			left.assign(first, mid);
+			right.assign(mid, last);
+		}
+
+		// Median of the centroids on the largest axis, for the nodes above the SAH threshold
+		void splitByMedian(std::vector<GLuint>& references, const Box3& nodeBounds, std::vector<GLuint>& left, std::vector<GLuint>& right) const
+		{
+			glm::vec3 extents = nodeBounds.dimensions();
+			int majorAxis = (int)std::distance(&extents.x, std::max_element(&extents.x, &extents.z));
+			auto mid = references.begin() + references.size() / 2;
+			std::nth_element(references.begin(), mid, references.end(),
+				[&](GLuint a, GLuint b)
+				{
+					return scratch.primCenter[a][majorAxis] < scratch.primCenter[b][majorAxis];
+				});
+			left.assign(references.begin(), mid);
+			right.assign(mid, references.end());
+		}
+
+		// Returns the leaf position or the flagged internal node index
+		GLuint build(std::vector<GLuint>& references, Box3& nodeBounds)
+		{
+			nodeBounds.expandInit();
+			for (GLuint reference : references)
+			{
+				nodeBounds.expand(referenceBounds(reference));
+			}
+			if (references.size() == 1)
+			{
+				scratch.order.push_back(references[0]);
+				return (GLuint)scratch.order.size() - 1;
+			}
+
+			std::vector<GLuint> left, right;
+			if (references.size() > settings.sahThreshold)
+			{
+				splitByMedian(references, nodeBounds, left, right);
+			}
+			else
+			{
+				ObjectSplit objectSplit = findBinnedSplit(scratch, references.data(), references.data() + references.size(), settings.binCount);
+				bool spatial = false;
+				if (scratch.primMin.size() < referenceLimit)
+				{
+					Box3 overlap{ glm::max(objectSplit.leftBounds.m_min, objectSplit.rightBounds.m_min), glm::min(objectSplit.leftBounds.m_max, objectSplit.rightBounds.m_max) };
+					if (objectSplit.axis < 0 || (isValid(overlap) && bboxSurfaceArea(overlap) > minOverlapArea))
+					{
+						SpatialSplit spatialSplit = findSpatialSplit(references, nodeBounds);
+						spatial = spatialSplit.cost < objectSplit.cost && splitSpatially(references, spatialSplit, left, right);
+					}
+				}
+				if (!spatial)
+				{
+					left.clear();
+					right.clear();
+					splitByObjects(references, objectSplit, left, right);
+				}
+			}
+			// The reference lists of the parents are not needed anymore
+			std::vector<GLuint>().swap(references);
+
+			GLuint internalIndex = (GLuint)scratch.nodeMin.size();
+			scratch.nodeMin.emplace_back(nodeBounds.m_min, 0.0f);
+			scratch.nodeMax.emplace_back(nodeBounds.m_max, 0.0f);
+			scratch.left.emplace_back();
+			scratch.right.emplace_back();
+
+			Box3 boundsLeft, boundsRight;
+			GLuint leftId = build(left, boundsLeft);
+			GLuint rightId = build(right, boundsRight);
+			if (bboxSurfaceArea(boundsRight) > bboxSurfaceArea(boundsLeft))
+			{
+				std::swap(leftId, rightId);
+			}
+			scratch.left[internalIndex] = leftId;
+			scratch.right[internalIndex] = rightId;
+			return InternalFlag | internalIndex;
+		}
+
+		// Builds the hierarchy into the scratch arrays. Returns the root node ID
+		GLuint build(GLuint primCount)
+		{
+			scratch.order.clear();
+			scratch.nodeMin.clear();
+			scratch.nodeMax.clear();
+			scratch.left.clear();
+			scratch.right.clear();
+			std::vector<GLuint> references(primCount);
+			std::iota(references.begin(), references.end(), 0);
+
+			Box3 rootBounds;
+			GLuint root = build(references, rootBounds);
+
+			// Now internal nodes can follow the leaves
+			const GLuint leafCount = (GLuint)scratch.order.size();
+			auto toNodeId = [leafCount](GLuint id)
+			{
+				return (id & InternalFlag) ? leafCount + (id & ~InternalFlag) : id;
+			};
+			for (GLuint i = 0; i < scratch.left.size(); ++i)
+			{
+				scratch.left[i] = toNodeId(scratch.left[i]);
+				scratch.right[i] = toNodeId(scratch.right[i]);
+			}
+			return toNodeId(root);
+		}
+	};
+
+	/**
+	* Decides bottom-up which subtrees become multi-triangle leaves by the SAH termination criterion.
+	* Returns the SAH cost of the subtree (not normalized by the root surface).
+	*/
+	float collapseLeaves(const NodeAccess& nodes, GLuint nodeId, GLuint maxLeafSize)
 	{
-		TempNode& node = nodes[nodeId];
+		float area = bboxSurfaceArea(nodes.min(nodeId), nodes.max(nodeId));
+		if (nodes.isLeaf(nodeId))
+		{
+			return area * IntersectionCost;
+		}
 
-		node.visitOrder = order++;
-		node.next = nextId;
+		BVHScratch& scratch = nodes.scratch;
+		GLuint internalIndex = nodeId - nodes.primCount;
+		GLuint left = scratch.left[internalIndex];
+		GLuint right = scratch.right[internalIndex];
+		float splitCost = area * TraversalCost + collapseLeaves(nodes, left, maxLeafSize) + collapseLeaves(nodes, right, maxLeafSize);
+
+		auto [leftFirst, leftSize] = nodes.leafRange(left);
+		auto [rightFirst, rightSize] = nodes.leafRange(right);
+		GLuint size = leftSize + rightSize;
+		scratch.subtreeFirst[internalIndex] = std::min(leftFirst, rightFirst);
+		scratch.subtreeSize[internalIndex] = size;
+
+		float leafCost = area * IntersectionCost * size;
+		scratch.collapsed[internalIndex] = size <= maxLeafSize && leafCost <= splitCost;
+		return scratch.collapsed[internalIndex] ? leafCost : splitCost;
+	}
 
-		if (node.left != BVHNode::InvalidMask)
+	// Recomputes the internal node bounds from the leaves. Subtree sizes come from the last collapseLeaves
+	void refitBounds(const NodeAccess& nodes, GLuint nodeId, ThreadPool* pool)
+	{
+		if (nodes.isLeaf(nodeId))
 		{
-			setDepthFirstVisitOrder(nodes, node.left, node.right, order);
+			return;
 		}
+		BVHScratch& scratch = nodes.scratch;
+		GLuint internalIndex = nodeId - nodes.primCount;
+		GLuint left = scratch.left[internalIndex];
+		GLuint right = scratch.right[internalIndex];
+		if (pool != nullptr && scratch.subtreeSize[internalIndex] > ParallelBuildThreshold)
+		{
+			auto leftTask = pool->submit([&nodes, left, pool] { refitBounds(nodes, left, pool); });
+			refitBounds(nodes, right, pool);
+			pool->wait(leftTask);
+		}
+		else
+		{
+			refitBounds(nodes, left, pool);
+			refitBounds(nodes, right, pool);
+		}
+		scratch.nodeMin[internalIndex] = glm::vec4(glm::min(nodes.min(left), nodes.min(right)), 0.0f);
+		scratch.nodeMax[internalIndex] = glm::vec4(glm::max(nodes.max(left), nodes.max(right)), 0.0f);
+	}
+
+	inline void setLane(BVHPackedNode& packed, GLuint lane, GLuint value)
+	{
+		memcpy(reinterpret_cast<char*>(&packed) + lane * sizeof(GLuint), &value, sizeof(GLuint));
+	}
+
+	// Triangle indices of indexed leaves which fit into one packed node. A slot of two packed nodes holds twice as many
+	const GLuint IndicesPerPackedNode = 4;
+
+	// Slots taken by the triangles which follow a multi-triangle leaf
+	inline GLuint leafTriangleSlots(GLuint size, bool indexed)
+	{
+		return indexed ? (size + IndicesPerPackedNode * 2 - 1) / (IndicesPerPackedNode * 2) : size;
+	}
+
+	void setDepthFirstVisitOrder(const NodeAccess& nodes, GLuint nodeId, GLuint nextId, bool indexed, GLuint& order)
+	{
+		BVHScratch& scratch = nodes.scratch;
+		scratch.visitOrder[nodeId] = order++;
+		scratch.next[nodeId] = nextId;
 
-		if (node.right != BVHNode::InvalidMask)
+		if (!nodes.isCollapsed(nodeId))
+		{
+			GLuint internalIndex = nodeId - nodes.primCount;
+			setDepthFirstVisitOrder(nodes, scratch.left[internalIndex], scratch.right[internalIndex], indexed, order);
+			setDepthFirstVisitOrder(nodes, scratch.right[internalIndex], nextId, indexed, order);
+		}
+		else if (GLuint size = nodes.leafRange(nodeId).second; size > 1)
 		{
-			setDepthFirstVisitOrder(nodes, node.right, nextId, order);
+			// The triangles of a multi-triangle leaf follow it
+			order += leafTriangleSlots(size, indexed);
 		}
 	}
 
-	void setDepthFirstVisitOrder(std::vector<TempNode>& nodes, GLuint root)
+	// Returns the number of slots (node pairs) the layout needs
+	GLuint setDepthFirstVisitOrder(const NodeAccess& nodes, GLuint root, bool indexed)
 	{
 		GLuint order = 0;
-		setDepthFirstVisitOrder(nodes, root, BVHNode::InvalidMask, order);
+		setDepthFirstVisitOrder(nodes, root, BVHNode::InvalidMask, indexed, order);
+		return order;
+	}
+
+	/**
+	* Writes the stackless binary layout. Every node occupies two packed nodes at baseSlot plus its visit order.
+	* Internal nodes are (bboxMin, InvalidMask), (bboxMax, next).
+	* Single-triangle leaves are (v0, triangle), (edgeA, next).
+	* Multi-triangle leaves are (bboxMin, LeafMask | count), (bboxMax, next), followed by (v0, triangle), (edgeA, 0) of each triangle.
+	* Hierarchies over boxes have leaves (bboxMin, leafData), (bboxMax, next) instead.
+	* Indexed triangles are not stored in the hierarchy. Single-triangle leaves are (bboxMin, triangle), (bboxMax, next)
+	* and multi-triangle leaves are followed by the triangle indices, padded with InvalidMask to whole slots.
+	*/
+	struct ThreadedLayoutWriter
+	{
+		const NodeAccess& nodes;
+		std::span<const FastTriangleFirstHalf> trianglesFirst;
+		std::span<const GLuint> leafData;
+		GLuint baseSlot;
+		GLuint triangleOffset;
+		bool indexed;
+		std::vector<BVHPackedNode>& packed;
+
+		GLuint nextSlot(GLuint nodeId) const
+		{
+			GLuint next = nodes.scratch.next[nodeId];
+			return next == BVHNode::InvalidMask ? BVHNode::InvalidMask : baseSlot + nodes.scratch.visitOrder[next];
+		}
+
+		void writeSlot(GLuint slot, const glm::vec3& first, GLuint firstValue, const glm::vec3& second, GLuint secondValue)
+		{
+			BVHNode node;
+			node.bboxMin = first;
+			node.triangleIndex = firstValue;
+			node.bboxMax = second;
+			node.next = secondValue;
+			memcpy(&packed[(baseSlot + slot) * 2], &node.bboxMin, sizeof(BVHPackedNode));
+			memcpy(&packed[(baseSlot + slot) * 2 + 1], &node.bboxMax, sizeof(BVHPackedNode));
+		}
+
+		void writeLeaf(GLuint slot, GLuint position, GLuint next)
+		{
+			GLuint primitive = nodes.triangle(position);
+			if (!leafData.empty())
+			{
+				writeSlot(slot, nodes.min(position), leafData[primitive], nodes.max(position), next);
+				return;
+			}
+			if (indexed)
+			{
+				writeSlot(slot, nodes.min(position), triangleOffset + primitive, nodes.max(position), next);
+				return;
+			}
+			const auto& triangle = trianglesFirst[primitive];
+			writeSlot(slot, triangle.v0, triangleOffset + primitive, triangle.edgeA, next);
+		}
+
+		void write(GLuint nodeId)
+		{
+			const GLuint slot = nodes.scratch.visitOrder[nodeId];
+			if (!nodes.isCollapsed(nodeId))
+			{
+				writeSlot(slot, nodes.min(nodeId), BVHNode::InvalidMask, nodes.max(nodeId), nextSlot(nodeId));
+				GLuint internalIndex = nodeId - nodes.primCount;
+				write(nodes.scratch.left[internalIndex]);
+				write(nodes.scratch.right[internalIndex]);
+				return;
+			}
+
+			auto [first, size] = nodes.leafRange(nodeId);
+			if (size == 1)
+			{
+				writeLeaf(slot, first, nextSlot(nodeId));
+			}
+			else
+			{
+				writeSlot(slot, nodes.min(nodeId), BVHNode::LeafMask | size, nodes.max(nodeId), nextSlot(nodeId));
+				if (indexed)
+				{
+					const std::size_t indices = (std::size_t)(baseSlot + slot + 1) * 2;
+					const GLuint lanes = leafTriangleSlots(size, true) * 2 * IndicesPerPackedNode;
+					for (GLuint i = 0; i < lanes; ++i)
+					{
+						setLane(packed[indices + i / IndicesPerPackedNode], i % IndicesPerPackedNode,
+							i < size ? triangleOffset + nodes.triangle(first + i) : BVHNode::InvalidMask);
+					}
+					return;
+				}
+				for (GLuint i = 0; i < size; ++i)
+				{
+					writeLeaf(slot + 1 + i, first + i, 0);
+				}
+			}
+		}
+	};
+
+	// Wide nodes consist of groups of 4 children. With full precision, each group is 7 packed nodes:
+	// min x, max x, min y, max y, min z, max z of the children and the child references.
+	// Quantized groups start with the origin and the scale exponents, followed by the quantized bounds and the references
+	const GLuint WideGroupWidth = 4;
+	const GLuint MaxWidth = 8;
+	const GLuint WideLeafCountShift = 28;
+
+	inline GLuint wideGroupSize(GLuint quantizationBits)
+	{
+		const GLuint boundWords = 6 * WideGroupWidth * quantizationBits / 32;
+		return quantizationBits == 0 ? 7 : 1 + (boundWords + 3) / 4 + 1;
+	}
+
+	// Power of two with the exponent stored like in a float
+	inline float exponentScale(GLuint biasedExponent)
+	{
+		return std::bit_cast<float>(biasedExponent << 23);
+	}
+
+	struct WideLayoutWriter
+	{
+		const NodeAccess& nodes;
+		std::span<const FastTriangleFirstHalf> trianglesFirst;
+		GLuint triangleOffset;
+		GLuint width;
+		GLuint quantizationBits;
+		bool indexed;
+		std::vector<BVHPackedNode>& packed;
+
+		// Pulls grandchildren up until there are `width` children. Internal children with the largest surface are opened first
+		GLuint collapseChildren(GLuint nodeId, std::array<GLuint, MaxWidth>& children) const
+		{
+			if (nodes.isCollapsed(nodeId))
+			{
+				children[0] = nodeId;
+				return 1;
+			}
+			GLuint internalIndex = nodeId - nodes.primCount;
+			children[0] = nodes.scratch.left[internalIndex];
+			children[1] = nodes.scratch.right[internalIndex];
+			GLuint count = 2;
+			while (count < width)
+			{
+				int largest = -1;
+				float largestArea = -1.0f;
+				for (GLuint i = 0; i < count; ++i)
+				{
+					if (!nodes.isCollapsed(children[i]))
+					{
+						float area = bboxSurfaceArea(nodes.min(children[i]), nodes.max(children[i]));
+						if (area > largestArea)
+						{
+							largestArea = area;
+							largest = (int)i;
+						}
+					}
+				}
+				if (largest < 0)
+				{
+					break;
+				}
+				GLuint opened = children[largest] - nodes.primCount;
+				std::copy_backward(children.begin() + largest + 1, children.begin() + count, children.begin() + count + 1);
+				children[largest] = nodes.scratch.left[opened];
+				children[largest + 1] = nodes.scratch.right[opened];
+				++count;
+			}
+			return count;
+		}
+
+		void writeFloatBounds(std::size_t group, const glm::vec3* mins, const glm::vec3* maxs, GLuint laneCount)
+		{
+			for (GLuint lane = 0; lane < laneCount; ++lane)
+			{
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					setLane(packed[group + axis * 2], lane, std::bit_cast<GLuint>(mins[lane][axis]));
+					setLane(packed[group + axis * 2 + 1], lane, std::bit_cast<GLuint>(maxs[lane][axis]));
+				}
+			}
+		}
+
+		/**
+		* Stores the bounds relative to the group origin in steps of a power of two per axis.
+		* Minimums are rounded down and maximums up, so the decoded boxes always contain the original ones.
+		*/
+		void writeQuantizedBounds(std::size_t group, const glm::vec3* mins, const glm::vec3* maxs, GLuint laneCount)
+		{
+			const GLuint maxValue = (1u << quantizationBits) - 1;
+			const GLuint valuesPerWord = 32 / quantizationBits;
+			GLuint packedExponents = 0;
+			glm::vec3 origin(0.0f);
+			std::array<std::array<GLuint, WideGroupWidth>, 6> quantized = {};
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float top = -FLT_MAX;
+				if (laneCount > 0)
+				{
+					origin[axis] = FLT_MAX;
+					for (GLuint lane = 0; lane < laneCount; ++lane)
+					{
+						origin[axis] = std::min(origin[axis], mins[lane][axis]);
+						top = std::max(top, maxs[lane][axis]);
+					}
+				}
+
+				int exponent = 0;
+				if (top > origin[axis])
+				{
+					std::frexp((top - origin[axis]) / maxValue, &exponent);
+				}
+				GLuint biasedExponent = (GLuint)std::clamp(exponent + 127, 1, 254);
+				for (;; ++biasedExponent)
+				{
+					bool fits = true;
+					float scale = exponentScale(biasedExponent);
+					for (GLuint lane = 0; lane < laneCount; ++lane)
+					{
+						GLuint low = (GLuint)std::floor((mins[lane][axis] - origin[axis]) / scale);
+						while (low > 0 && origin[axis] + low * scale > mins[lane][axis])
+						{
+							--low;
+						}
+						GLuint high = (GLuint)std::ceil((maxs[lane][axis] - origin[axis]) / scale);
+						while (origin[axis] + high * scale < maxs[lane][axis])
+						{
+							++high;
+						}
+						fits = fits && high <= maxValue;
+						quantized[axis * 2][lane] = low;
+						quantized[axis * 2 + 1][lane] = high;
+					}
+					if (fits)
+					{
+						packedExponents |= biasedExponent << (axis * 8);
+						break;
+					}
+				}
+			}
+
+			memcpy(&packed[group], &origin, sizeof(glm::vec3));
+			packed[group].d = packedExponents;
+			for (GLuint bound = 0; bound < 6; ++bound)
+			{
+				for (GLuint lane = 0; lane < laneCount; ++lane)
+				{
+					GLuint value = bound * WideGroupWidth + lane;
+					GLuint word = value / valuesPerWord;
+					BVHPackedNode& target = packed[group + 1 + word / 4];
+					GLuint current;
+					memcpy(&current, reinterpret_cast<char*>(&target) + word % 4 * sizeof(GLuint), sizeof(GLuint));
+					setLane(target, word % 4, current | quantized[bound][lane] << (value % valuesPerWord * quantizationBits));
+				}
+			}
+		}
+
+		/**
+		* Appends the node and its subtree in depth-first order. Leaf triangles are stored right after their parent as v0 and edgeA,
+		* or as indices packed four to a node when they are indexed. Leaf references hold the triangle count minus one above WideLeafCountShift.
+		* Returns the stack size needed to traverse the subtree. Leaves are intersected immediately so they never get onto the stack.
+		*/
+		GLuint write(GLuint nodeId)
+		{
+			std::array<GLuint, MaxWidth> children;
+			GLuint count = collapseChildren(nodeId, children);
+			std::array<glm::vec3, MaxWidth> mins, maxs;
+			for (GLuint i = 0; i < count; ++i)
+			{
+				mins[i] = nodes.min(children[i]);
+				maxs[i] = nodes.max(children[i]);
+			}
+
+			// Do not keep references into the output, it grows while the children are written
+			const GLuint groupSize = wideGroupSize(quantizationBits);
+			const std::size_t nodeOffset = packed.size();
+			packed.resize(nodeOffset + width / WideGroupWidth * groupSize, BVHPackedNode{});
+			for (GLuint first = 0; first < width; first += WideGroupWidth)
+			{
+				const std::size_t group = nodeOffset + first / WideGroupWidth * groupSize;
+				const GLuint laneCount = count > first ? std::min(WideGroupWidth, count - first) : 0;
+				if (quantizationBits == 0)
+				{
+					writeFloatBounds(group, &mins[first], &maxs[first], laneCount);
+				}
+				else
+				{
+					writeQuantizedBounds(group, &mins[first], &maxs[first], laneCount);
+				}
+			}
+
+			GLuint internalChildren = 0;
+			GLuint childStackSize = 0;
+			for (GLuint i = 0; i < width; ++i)
+			{
+				const std::size_t references = nodeOffset + i / WideGroupWidth * groupSize + groupSize - 1;
+				const GLuint lane = i % WideGroupWidth;
+				if (i >= count)
+				{
+					setLane(packed[references], lane, BVHNode::InvalidMask);
+					continue;
+				}
+
+				GLuint child = children[i];
+				GLuint childOffset = (GLuint)packed.size();
+				if (nodes.isCollapsed(child))
+				{
+					auto [first, size] = nodes.leafRange(child);
+					if (indexed)
+					{
+						const GLuint lanes = (size + IndicesPerPackedNode - 1) / IndicesPerPackedNode * IndicesPerPackedNode;
+						packed.resize(packed.size() + lanes / IndicesPerPackedNode, BVHPackedNode{});
+						for (GLuint entry = 0; entry < lanes; ++entry)
+						{
+							setLane(packed[childOffset + entry / IndicesPerPackedNode], entry % IndicesPerPackedNode,
+								entry < size ? triangleOffset + nodes.triangle(first + entry) : BVHNode::InvalidMask);
+						}
+					}
+					else
+					{
+						for (GLuint position = first; position < first + size; ++position)
+						{
+							GLuint triangleIndex = nodes.triangle(position);
+							const auto& triangle = trianglesFirst[triangleIndex];
+							BVHPackedNode data0, data1;
+							memcpy(&data0, &triangle.v0, sizeof(glm::vec3));
+							data0.d = triangleOffset + triangleIndex;
+							memcpy(&data1, &triangle.edgeA, sizeof(glm::vec3));
+							data1.d = 0;
+							packed.push_back(data0);
+							packed.push_back(data1);
+						}
+					}
+					setLane(packed[references], lane, BVHNode::LeafMask | (size - 1) << WideLeafCountShift | childOffset);
+				}
+				else
+				{
+					setLane(packed[references], lane, childOffset);
+					++internalChildren;
+					childStackSize = std::max(childStackSize, write(child));
+				}
+			}
+			return internalChildren == 0 ? 1 : internalChildren - 1 + childStackSize;
+		}
+	};
+
+	template<typename T>
+	std::size_t vectorBytes(const std::vector<T>& vector)
+	{
+		return vector.capacity() * sizeof(T);
 	}
+}
 
+std::size_t BVHScratch::allocatedBytes() const
+{
+	return vectorBytes(primMin) + vectorBytes(primMax) + vectorBytes(primCenter) + vectorBytes(order) + vectorBytes(referenceTriangle)
+		+ vectorBytes(nodeMin) + vectorBytes(nodeMax) + vectorBytes(left) + vectorBytes(right)
+		+ vectorBytes(subtreeFirst) + vectorBytes(subtreeSize) + vectorBytes(collapsed)
+		+ vectorBytes(visitOrder) + vectorBytes(next)
+		+ vectorBytes(sweepAreaLeft) + vectorBytes(sweepAreaRight)
+		+ vectorBytes(mortonCodes) + vectorBytes(mortonCodesTemp) + vectorBytes(orderTemp);
+}
+
+void BVHBuilder::build(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond)
+{
+	m_packedNodes.clear();
+	build(trianglesFirst, trianglesSecond, m_packedNodes, 0);
 }
 
-void BVHBuilder::build(std::vector<FastTriangleFirstHalf> trianglesFirst, std::vector<FastTriangleSecondHalf> trianglesSecond)
+void BVHBuilder::build(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond,
+	std::vector<BVHPackedNode>& output, GLuint triangleOffset)
 {
-	auto primCount = trianglesFirst.size();
-	m_nodes.clear();
-	m_nodes.reserve(primCount * 2 - 1);
+	const GLuint primCount = (GLuint)trianglesFirst.size();
+	m_width = layout == Layout::Wide8 ? 8 : layout == Layout::Wide4 ? 4 : 2;
+	m_quantizationBits = m_width == 2 || quantization == Quantization::None ? 0 : quantization == Quantization::Bits16 ? 16 : 8;
+	if (!prepare(primCount))
+	{
+		return;
+	}
+	ThreadPool* pool = preparePool();
 
-	std::vector<TempNode> tempNodes;
-	tempNodes.reserve(primCount * 2 - 1);
+	// The scratch arrays only grow, so their memory is reused by the next build
+	BVHScratch& scratch = m_scratch;
+	if (splitMethod == SplitMethod::SweepSAH && !spatialSplits)
+	{
+		scratch.sweepAreaLeft.resize(primCount);
+		scratch.sweepAreaRight.resize(primCount);
+	}
 
-	// Build leaf nodes
-	for (GLuint triangleIndex = 0; triangleIndex < primCount; ++triangleIndex)
+	// Calculate leaf bounds
+	auto buildLeaf = [&](std::size_t triangleIndex)
 	{
-		TempNode node;
 		Box3 box;
 		box.expandInit();
 
-		auto fast = toFast(trianglesFirst[triangleIndex],trianglesSecond[triangleIndex]);
-		auto triangle = fast.toClassic();
+		auto triangle = toFast(trianglesFirst[triangleIndex], trianglesSecond[triangleIndex]).toClassic();
 
 		box.expand(triangle[0]);
 		box.expand(triangle[1]);
 		box.expand(triangle[2]);
 
-		node.primArea = fast.calculateArea();
-
-		setBounds(node, box.m_min, box.m_max);
+		scratch.primMin[triangleIndex] = glm::vec4(box.m_min, 0.0f);
+		scratch.primMax[triangleIndex] = glm::vec4(box.m_max, 0.0f);
+		scratch.primCenter[triangleIndex] = box.center();
+		scratch.order[triangleIndex] = (GLuint)triangleIndex;
+	};
+	if (pool != nullptr)
+	{
+		pool->parallelFor(0, primCount, ParallelBuildThreshold, buildLeaf);
+	}
+	else
+	{
+		for (GLuint triangleIndex = 0; triangleIndex < primCount; ++triangleIndex)
+		{
+			buildLeaf(triangleIndex);
+		}
+	}
 
-		node.bboxCenter = box.center();
-		node.triangleIndex = triangleIndex;
-		node.left = BVHNode::InvalidMask;
-		node.right = BVHNode::InvalidMask;
-		tempNodes.push_back(node);
+	GLuint rootIndex;
+	if (spatialSplits)
+	{
+		scratch.referenceTriangle.resize(primCount);
+		std::iota(scratch.referenceTriangle.begin(), scratch.referenceTriangle.end(), 0);
+		Box3 rootBounds = calculateBounds(NodeAccess{ scratch, primCount }, 0, primCount);
+		SpatialSplitBuilder spatialBuilder{
+			scratch, trianglesFirst, trianglesSecond, *this,
+			primCount + (GLuint)(primCount * std::max(spatialSplitBudget, 0.0f)),
+			bboxSurfaceArea(rootBounds) * SpatialSplitOverlap
+		};
+		rootIndex = spatialBuilder.build(primCount);
+	}
+	else
+	{
+		rootIndex = buildObjectHierarchy(primCount, pool);
 	}
 
-	const GLuint rootIndex = buildNodeHierarchy(tempNodes, 0, (GLuint)tempNodes.size(), this->sahThreshold);
+	writeHierarchy(rootIndex, maxLeafSize, trianglesFirst, {}, triangleOffset, output);
+}
 
-	//
-	// Node reordering to ensure cache optimisation
-	//
+void BVHBuilder::build(std::span<const Box3> boxes, std::span<const GLuint> leafData, std::vector<BVHPackedNode>& output)
+{
+	const GLuint primCount = (GLuint)boxes.size();
+	m_width = 2;
+	m_quantizationBits = 0;
+	if (!prepare(primCount))
+	{
+		return;
+	}
+	ThreadPool* pool = preparePool();
 
-	setDepthFirstVisitOrder(tempNodes, rootIndex);
+	BVHScratch& scratch = m_scratch;
+	if (splitMethod == SplitMethod::SweepSAH)
+	{
+		scratch.sweepAreaLeft.resize(primCount);
+		scratch.sweepAreaRight.resize(primCount);
+	}
+	for (GLuint boxIndex = 0; boxIndex < primCount; ++boxIndex)
+	{
+		scratch.primMin[boxIndex] = glm::vec4(boxes[boxIndex].m_min, 0.0f);
+		scratch.primMax[boxIndex] = glm::vec4(boxes[boxIndex].m_max, 0.0f);
+		scratch.primCenter[boxIndex] = boxes[boxIndex].center();
+		scratch.order[boxIndex] = boxIndex;
+	}
 
-	m_nodes.resize(tempNodes.size());
+	// Every box gets its own leaf
+	writeHierarchy(buildObjectHierarchy(primCount, pool), 1, {}, leafData, 0, output);
+}
 
-	for (GLuint oldIndex = 0; oldIndex < (GLuint)tempNodes.size(); ++oldIndex)
+bool BVHBuilder::prepare(GLuint primCount)
+{
+	m_sahCost = 0;
+	m_traversalStackSize = 0;
+	m_referenceCount = 0;
+	m_rootOffset = BVHNode::InvalidMask;
+	m_rootIndex = BVHNode::InvalidMask;
+	m_bounds.expandInit();
+	if (primCount == 0)
 	{
-		const TempNode& oldNode = tempNodes[oldIndex];
+		return false;
+	}
 
-		BVHNode& newNode = m_nodes[oldNode.visitOrder];
+	BVHScratch& scratch = m_scratch;
+	scratch.primMin.resize(primCount);
+	scratch.primMax.resize(primCount);
+	scratch.primCenter.resize(primCount);
+	scratch.order.resize(primCount);
+	scratch.referenceTriangle.clear();
+	return true;
+}
 
-		glm::vec3 bboxMin(oldNode.bboxMin);
-		glm::vec3 bboxMax(oldNode.bboxMax);
-		setBounds(newNode, bboxMin, bboxMax);
+ThreadPool* BVHBuilder::preparePool()
+{
+	// A pool of its own would compete for the cores with the shared one, which decodes the textures meanwhile
+	return threadCount > 1 ? &ThreadPool::shared() : nullptr;
+}
 
-		newNode.triangleIndex = oldNode.triangleIndex;
-		newNode.next = oldNode.next == BVHNode::InvalidMask
-			? BVHNode::InvalidMask
-			: tempNodes[oldNode.next].visitOrder;
+GLuint BVHBuilder::buildObjectHierarchy(GLuint primCount, ThreadPool* pool)
+{
+	BVHScratch& scratch = m_scratch;
+	const GLuint internalCount = primCount - 1;
+	scratch.nodeMin.resize(internalCount);
+	scratch.nodeMax.resize(internalCount);
+	scratch.left.resize(internalCount);
+	scratch.right.resize(internalCount);
+
+	const bool mortonSplits = largeNodeSplit == LargeNodeSplit::Morton && primCount > sahThreshold;
+	if (mortonSplits)
+	{
+		sortByMortonCodes(scratch, primCount, pool);
 	}
 
-	//
-	// Node packing
-	//
-	m_packedNodes.clear();
-	m_packedNodes.reserve(m_nodes.size() + primCount);
+	BuildContext context{ NodeAccess{ scratch, primCount }, *this, pool, mortonSplits };
+	return buildNodeHierarchy(context, 0, primCount, primCount);
+}
+
+void BVHBuilder::writeHierarchy(GLuint rootIndex, GLuint leafSize, std::span<const FastTriangleFirstHalf> trianglesFirst,
+	std::span<const GLuint> leafData, GLuint triangleOffset, std::vector<BVHPackedNode>& output)
+{
+	BVHScratch& scratch = m_scratch;
+	m_referenceCount = (GLuint)scratch.order.size();
+	const NodeAccess nodes{ scratch, m_referenceCount };
+	const GLuint nodeCount = m_referenceCount * 2 - 1;
+	const GLuint internalCount = m_referenceCount - 1;
+	m_rootIndex = rootIndex;
+	m_bounds.m_min = nodes.min(rootIndex);
+	m_bounds.m_max = nodes.max(rootIndex);
+	scratch.subtreeFirst.resize(internalCount);
+	scratch.subtreeSize.resize(internalCount);
+	scratch.collapsed.resize(internalCount);
+	float cost = collapseLeaves(nodes, rootIndex, std::clamp(leafSize, 1u, MaxLeafSize));
+	// Hierarchies over boxes keep their leaf data in the leaves
+	const bool indexed = indexedTriangles && leafData.empty();
+	float rootArea = bboxSurfaceArea(m_bounds);
+	m_sahCost = rootArea > 0.0f ? cost / rootArea : 0.0f;
+
+	if (m_width > 2)
+	{
+		m_rootOffset = (GLuint)output.size();
+		WideLayoutWriter writer{ nodes, trianglesFirst, triangleOffset, m_width, m_quantizationBits, indexed, output };
+		m_traversalStackSize = writer.write(rootIndex);
+	}
+	else
+	{
+		//
+		// Node reordering to ensure cache optimisation
+		//
+		scratch.visitOrder.resize(nodeCount);
+		scratch.next.resize(nodeCount);
+		GLuint slotCount = setDepthFirstVisitOrder(nodes, rootIndex, indexed);
+
+		// Slots are pairs of packed nodes. A wide hierarchy written before may have left an odd size
+		output.resize((output.size() + 1) / 2 * 2 + slotCount * 2);
+		m_rootOffset = (GLuint)(output.size() / 2) - slotCount;
+		ThreadedLayoutWriter writer{ nodes, trianglesFirst, leafData, m_rootOffset, triangleOffset, indexed, output };
+		writer.write(rootIndex);
+	}
+
+	m_peakMemory = scratch.allocatedBytes() + vectorBytes(output);
+}
 
-	for (GLuint i = 0; i < (GLuint)tempNodes.size(); ++i)
+void BVHBuilder::refit(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond)
+{
+	if (m_rootIndex == BVHNode::InvalidMask)
+	{
+		build(trianglesFirst, trianglesSecond);
+		return;
+	}
+	ThreadPool* pool = preparePool();
+	BVHScratch& scratch = m_scratch;
+
+	// References made by spatial splits get the bounds of their whole triangle, which is conservative
+	auto refitLeaf = [&](std::size_t reference)
 	{
-		const BVHNode& node = m_nodes[i];
+		GLuint triangleIndex = scratch.referenceTriangle.empty() ? (GLuint)reference : scratch.referenceTriangle[reference];
+		Box3 box;
+		box.expandInit();
+
+		auto triangle = toFast(trianglesFirst[triangleIndex], trianglesSecond[triangleIndex]).toClassic();
+
+		box.expand(triangle[0]);
+		box.expand(triangle[1]);
+		box.expand(triangle[2]);
 
-		if (node.isLeaf())
+		scratch.primMin[reference] = glm::vec4(box.m_min, 0.0f);
+		scratch.primMax[reference] = glm::vec4(box.m_max, 0.0f);
+		scratch.primCenter[reference] = box.center();
+	};
+	if (pool != nullptr)
+	{
+		pool->parallelFor(0, m_referenceCount, ParallelBuildThreshold, refitLeaf);
+	}
+	else
+	{
+		for (GLuint reference = 0; reference < m_referenceCount; ++reference)
 		{
-			struct TriangleHalf {
-				glm::vec3 v0;
-				GLuint triIndex;
-				glm::vec3 edgeA;
-				GLuint next;
-			};
+			refitLeaf(reference);
+		}
+	}
+	refitBounds(NodeAccess{ scratch, m_referenceCount }, m_rootIndex, pool);
+
+	m_packedNodes.clear();
+	writeHierarchy(m_rootIndex, maxLeafSize, trianglesFirst, {}, 0, m_packedNodes);
+}
 
-			TriangleHalf triangleToPacked;
+void BVHBuilder::save(SceneCache::Writer& cache) const
+{
+	cache.add(m_packedNodes);
+	cache.addValue(Properties{ m_sahCost, m_referenceCount, m_width, m_quantizationBits, m_traversalStackSize, m_rootOffset, m_bounds, m_peakMemory });
+}
 
-			auto triangleSource = trianglesFirst[node.triangleIndex];
-			triangleToPacked.v0 = triangleSource.v0;
-			triangleToPacked.triIndex = node.triangleIndex;
-			triangleToPacked.edgeA = triangleSource.edgeA;
-			triangleToPacked.next = node.next;
+bool BVHBuilder::load(SceneCache::Reader& cache)
+{
+	Properties properties;
+	if (!cache.read(m_packedNodes) || !cache.readValue(properties))
+	{
+		m_packedNodes.clear();
+		return false;
+	}
+	m_sahCost = properties.sahCost;
+	m_referenceCount = properties.referenceCount;
+	m_width = properties.width;
+	m_quantizationBits = properties.quantizationBits;
+	m_traversalStackSize = properties.traversalStackSize;
+	m_rootOffset = properties.rootOffset;
+	m_bounds = properties.bounds;
+	m_peakMemory = properties.peakMemory;
+	m_rootIndex = BVHNode::InvalidMask;
+	return true;
+}
 
-			// There are 2 packed nodes per leaf node
-			BVHPackedNode data0, data1;
-			memcpy(&data0, &triangleToPacked.v0, sizeof(BVHPackedNode));
-			memcpy(&data1, &triangleToPacked.edgeA, sizeof(BVHPackedNode));
+void TwoLevelBVHBuilder::buildMeshes(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond,
+	std::span<const BVHMesh> meshes)
+{
+	m_packedNodes.clear();
+	m_meshRoots.clear();
+	m_meshBounds.clear();
+	m_traversalStackSize = 0;
+	m_referenceCount = 0;
+	m_peakMemory = 0;
+	for (const BVHMesh& mesh : meshes)
+	{
+		bottomLevel.build(trianglesFirst.subspan(mesh.firstTriangle, mesh.triangleCount),
+			trianglesSecond.subspan(mesh.firstTriangle, mesh.triangleCount), m_packedNodes, mesh.firstTriangle);
+		m_meshRoots.push_back(bottomLevel.m_rootOffset);
+		m_meshBounds.push_back(bottomLevel.m_bounds);
+		m_traversalStackSize = std::max(m_traversalStackSize, bottomLevel.m_traversalStackSize);
+		m_referenceCount += bottomLevel.m_referenceCount;
+		m_peakMemory = std::max(m_peakMemory, bottomLevel.m_peakMemory);
+	}
+	// The instance records and the top level are made of whole slots
+	m_packedNodes.resize((m_packedNodes.size() + 1) / 2 * 2);
+	m_bottomLevelSize = m_packedNodes.size();
+	m_topLevelRoot = BVHNode::InvalidMask;
+}
 
-			m_packedNodes.push_back(data0);
-			m_packedNodes.push_back(data1);
+void TwoLevelBVHBuilder::buildInstances(std::span<const BVHInstance> instances)
+{
+	m_packedNodes.resize(m_bottomLevelSize);
+	m_instanceBounds.clear();
+	m_instanceRecords.clear();
+	for (const BVHInstance& instance : instances)
+	{
+		const GLuint root = m_meshRoots[instance.mesh];
+		if (root == BVHNode::InvalidMask)
+		{
+			// Empty mesh
+			continue;
 		}
-		else
+
+		// The world bounds enclose the transformed corners of the mesh bounds
+		const Box3& meshBounds = m_meshBounds[instance.mesh];
+		Box3 bounds;
+		bounds.expandInit();
+		for (int corner = 0; corner < 8; ++corner)
 		{
-			BVHNode packedNode;
+			glm::vec3 point(
+				corner & 1 ? meshBounds.m_max.x : meshBounds.m_min.x,
+				corner & 2 ? meshBounds.m_max.y : meshBounds.m_min.y,
+				corner & 4 ? meshBounds.m_max.z : meshBounds.m_min.z
+			);
+			bounds.expand(glm::vec3(instance.transform * glm::vec4(point, 1.0f)));
+		}
+		m_instanceBounds.push_back(bounds);
+		m_instanceRecords.push_back((GLuint)m_packedNodes.size());
+
+		// Rows of the inverse transform, so a row dot (position, 1) gives one mesh-space coordinate
+		glm::mat4 worldToMesh = glm::transpose(glm::inverse(instance.transform));
+		BVHPackedNode rows[4];
+		memcpy(rows, glm::value_ptr(worldToMesh), 3 * sizeof(BVHPackedNode));
+		rows[3] = { root, 0, 0, 0 };
+		m_packedNodes.insert(m_packedNodes.end(), std::begin(rows), std::end(rows));
+	}
 
-			packedNode.bboxMin = node.bboxMin;
-			packedNode.triangleIndex = node.triangleIndex;
-			packedNode.bboxMax = node.bboxMax;
-			packedNode.next = node.next;
+	// Instances are few, so the top level is built on the calling thread
+	m_topLevel.threadCount = 1;
+	m_topLevel.build(m_instanceBounds, m_instanceRecords, m_packedNodes);
+	m_topLevelRoot = m_topLevel.m_rootOffset;
+}
 
-			BVHPackedNode data0, data1;
-			memcpy(&data0, &packedNode.bboxMin, sizeof(BVHPackedNode));
-			memcpy(&data1, &packedNode.bboxMax, sizeof(BVHPackedNode));
+void TwoLevelBVHBuilder::save(SceneCache::Writer& cache) const
+{
+	cache.add(std::span<const BVHPackedNode>(m_packedNodes.data(), m_bottomLevelSize));
+	cache.add(m_meshRoots);
+	cache.add(m_meshBounds);
+	cache.addValue(Properties{ m_traversalStackSize, m_referenceCount, bottomLevel.m_width, bottomLevel.m_quantizationBits, m_peakMemory });
+}
 
-			m_packedNodes.push_back(data0);
-			m_packedNodes.push_back(data1);
-		}
+bool TwoLevelBVHBuilder::load(SceneCache::Reader& cache)
+{
+	Properties properties;
+	m_topLevelRoot = BVHNode::InvalidMask;
+	if (!cache.read(m_packedNodes) || !cache.read(m_meshRoots) || !cache.read(m_meshBounds) || !cache.readValue(properties))
+	{
+		m_packedNodes.clear();
+		m_meshRoots.clear();
+		m_meshBounds.clear();
+		m_bottomLevelSize = 0;
+		return false;
 	}
-}
\ No newline at end of file
+	m_bottomLevelSize = m_packedNodes.size();
+	m_traversalStackSize = properties.traversalStackSize;
+	m_referenceCount = properties.referenceCount;
+	m_peakMemory = properties.peakMemory;
+	bottomLevel.m_width = properties.width;
+	bottomLevel.m_quantizationBits = properties.quantizationBits;
+	return true;
+}
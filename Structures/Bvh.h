@@ -6,7 +6,12 @@
 #include "../PrecompiledHeaders.hpp"
 #include <GL/glew.h>
 #include <vector>
+#include <memory>
+#include <span>
 #include "./SceneObjects.h"
+#include "./Box3.h"
+#include "./SceneCache.h"
+#include "../ThreadPool.h"
 
 struct BVHNode
 {
@@ -27,10 +32,223 @@ struct BVHPackedNode
 	GLuint a, b, c, d;
 };
 
+/**
+* Scratch memory of BVHBuilder in structure-of-arrays layout.
+* It is kept between builds, so rebuilding a scene of a similar size does not allocate again.
+*/
+struct BVHScratch
+{
+	// Indexed by triangle, or by reference with spatial splits
+	std::vector<glm::vec4> primMin;
+	std::vector<glm::vec4> primMax;
+	std::vector<glm::vec3> primCenter;
+	// Triangle at each leaf position. Splitting reorders only this array. Leaf node IDs are positions in it
+	std::vector<GLuint> order;
+	// Triangle of each reference when spatial splits create more references than triangles. Empty otherwise
+	std::vector<GLuint> referenceTriangle;
+
+	// Indexed by internal node ID minus the triangle count
+	std::vector<glm::vec4> nodeMin;
+	std::vector<glm::vec4> nodeMax;
+	std::vector<GLuint> left;
+	std::vector<GLuint> right;
+
+	// Leaf range of the subtree and whether it is turned into a multi-triangle leaf
+	std::vector<GLuint> subtreeFirst;
+	std::vector<GLuint> subtreeSize;
+	std::vector<uint8_t> collapsed;
+
+	// Indexed by any node ID. Used only for the binary layout
+	std::vector<GLuint> visitOrder;
+	std::vector<GLuint> next;
+
+	// Used only by some split methods
+	std::vector<float> sweepAreaLeft;
+	std::vector<float> sweepAreaRight;
+	std::vector<uint64_t> mortonCodes;
+	std::vector<uint64_t> mortonCodesTemp;
+	std::vector<GLuint> orderTemp;
+
+	std::size_t allocatedBytes() const;
+};
+
 struct BVHBuilder
 {
-	std::vector<BVHNode> m_nodes;
+	enum class SplitMethod {
+		// Sorts the primitives along every axis and sweeps all possible split positions
+		SweepSAH = 0,
+		// Evaluates SAH only at bin boundaries. Needs no sorting
+		BinnedSAH = 1
+	};
+
+	enum class LargeNodeSplit {
+		// Sorts the node along the largest axis and splits it in the middle
+		Median = 0,
+		// Sorts all the primitives by their Morton codes once and splits at the highest differing bit (LBVH)
+		Morton = 1
+	};
+
+	enum class Layout {
+		// Stackless threaded binary tree. Leaves contain the triangle inline
+		Binary = 0,
+		// Children are collapsed into 4-wide or 8-wide nodes with the child bounds stored per axis (SoA).
+		// Traversed with a stack
+		Wide4 = 1,
+		Wide8 = 2
+	};
+
+	enum class Quantization {
+		None = 0,
+		// Child bounds of wide nodes are stored relative to the node origin with a power-of-two step per axis
+		Bits16 = 1,
+		Bits8 = 2
+	};
+
+	// Contents of the shader BVH buffer, in the format given by layout
 	std::vector<BVHPackedNode> m_packedNodes;
+	// Nodes with more primitives than this are split by largeNodeSplit
 	unsigned int sahThreshold = 1000000;
-	void build(std::vector<FastTriangleFirstHalf> trianglesFirst, std::vector<FastTriangleSecondHalf> trianglesSecond);
+	SplitMethod splitMethod = SplitMethod::BinnedSAH;
+	// How to split nodes above sahThreshold. Setting sahThreshold to 0 with Morton splits builds a pure LBVH
+	LargeNodeSplit largeNodeSplit = LargeNodeSplit::Morton;
+	unsigned int binCount = 16;
+	// More than one builds the subtrees in parallel on ThreadPool::shared(). The result does not depend on the thread count
+	unsigned int threadCount = std::thread::hardware_concurrency();
+	// Subtrees with up to this many triangles (at most 8) become a single leaf when the SAH says it is cheaper
+	unsigned int maxLeafSize = 4;
+	// Split BVH: nodes may also be split by a plane, clipping the triangles which cross it into two references
+	bool spatialSplits = false;
+	// Extra references allowed by spatial splits, relative to the triangle count
+	float spatialSplitBudget = 0.3f;
+	Layout layout = Layout::Binary;
+	// Applies only to the wide layouts. Binary leaves carry the triangle instead of bounds
+	Quantization quantization = Quantization::None;
+	// Leaves store only the triangle indices, four to a packed node, and the shader fetches the vertices from a shared position buffer.
+	// Otherwise the leaves carry v0 and edgeA of every triangle
+	bool indexedTriangles = false;
+
+	// SAH cost of the last built hierarchy (relative to the root surface area)
+	float m_sahCost = 0;
+	// Bytes held by the scratch memory and the output arrays at the end of the last build
+	std::size_t m_peakMemory = 0;
+	// Leaves of the last built hierarchy. More than the triangle count when spatial splits duplicated some triangles
+	unsigned int m_referenceCount = 0;
+	// Branching factor of the hierarchy in m_packedNodes
+	unsigned int m_width = 2;
+	// Bits per quantized bound in m_packedNodes. 0 for full precision
+	unsigned int m_quantizationBits = 0;
+	// Stack entries needed to traverse the wide layout
+	unsigned int m_traversalStackSize = 0;
+	// Bounds of the last built hierarchy
+	Box3 m_bounds;
+	// Root of the last built hierarchy in its output. A slot (pair of packed nodes) for the binary layout, a packed node otherwise
+	GLuint m_rootOffset = BVHNode::InvalidMask;
+
+	void build(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond);
+	/**
+	* Appends the hierarchy to output. Node references point into the whole output
+	* and triangleOffset is added to the triangle indices stored in the leaves.
+	*/
+	void build(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond,
+		std::vector<BVHPackedNode>& output, GLuint triangleOffset);
+	// Appends a binary hierarchy over the boxes to output. Each leaf holds one box with its leafData value in place of a triangle index
+	void build(std::span<const Box3> boxes, std::span<const GLuint> leafData, std::vector<BVHPackedNode>& output);
+	/**
+	* Rewrites m_packedNodes for moved triangles. Keeps the topology of the last build(trianglesFirst, trianglesSecond)
+	* and only recomputes the bounds bottom-up. The triangles must be the same ones in the same order.
+	* The tree quality degrades with large deformations, so build again after them.
+	*/
+	void refit(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond);
+	// Stores m_packedNodes with the properties of the hierarchy. The build scratch is not stored
+	void save(SceneCache::Writer& cache) const;
+	// Restores a hierarchy stored by save(). There is no topology to refit then, so refit() builds from scratch
+	bool load(SceneCache::Reader& cache);
+
+private:
+	// Everything except m_packedNodes which save() stores
+	struct Properties
+	{
+		float sahCost;
+		unsigned int referenceCount;
+		unsigned int width;
+		unsigned int quantizationBits;
+		unsigned int traversalStackSize;
+		GLuint rootOffset;
+		Box3 bounds;
+		uint64_t peakMemory;
+	};
+
+	BVHScratch m_scratch;
+	// Root node ID of the last built hierarchy. InvalidMask when the scratch holds no topology
+	GLuint m_rootIndex = BVHNode::InvalidMask;
+
+	// Resets the outputs and sizes the primitive arrays. Returns false when there is nothing to build
+	bool prepare(GLuint primCount);
+	ThreadPool* preparePool();
+	GLuint buildObjectHierarchy(GLuint primCount, ThreadPool* pool);
+	void writeHierarchy(GLuint rootIndex, GLuint leafSize, std::span<const FastTriangleFirstHalf> trianglesFirst,
+		std::span<const GLuint> leafData, GLuint triangleOffset, std::vector<BVHPackedNode>& output);
+};
+
+// Triangle range of a mesh in the scene triangle arrays
+struct BVHMesh
+{
+	GLuint firstTriangle;
+	GLuint triangleCount;
+};
+
+struct BVHInstance
+{
+	// Mesh space to world space
+	glm::mat4 transform;
+	GLuint mesh;
+};
+
+/**
+* Two-level hierarchy for instanced geometry. Every mesh gets a bottom-level BVH in its own space, which is built once.
+* The top level over the world bounds of the instances is cheap to rebuild when the instance transforms change.
+* m_packedNodes holds the bottom levels, followed by the instance records and the top level in the binary layout.
+* An instance record is 4 packed nodes: three rows of the world-to-mesh matrix and the root offset of the mesh hierarchy.
+* Top-level leaves hold the offset of their instance record.
+*/
+struct TwoLevelBVHBuilder
+{
+	// Settings of the bottom levels
+	BVHBuilder bottomLevel;
+	std::vector<BVHPackedNode> m_packedNodes;
+	// Slot of the top-level root in m_packedNodes. InvalidMask when there are no instances
+	GLuint m_topLevelRoot = BVHNode::InvalidMask;
+	// Stack entries needed to traverse the deepest bottom level
+	unsigned int m_traversalStackSize = 0;
+	// Leaf references of all the bottom levels
+	unsigned int m_referenceCount = 0;
+	std::size_t m_peakMemory = 0;
+
+	// Builds the bottom levels. The instances must be built again afterwards
+	void buildMeshes(std::span<const FastTriangleFirstHalf> trianglesFirst, std::span<const FastTriangleSecondHalf> trianglesSecond,
+		std::span<const BVHMesh> meshes);
+	// Rebuilds only the instance records and the top level
+	void buildInstances(std::span<const BVHInstance> instances);
+	// Stores the bottom levels. The bottomLevel settings must be the same when loading them
+	void save(SceneCache::Writer& cache) const;
+	// Restores the bottom levels stored by save(). The instances must be built again afterwards
+	bool load(SceneCache::Reader& cache);
+
+private:
+	struct Properties
+	{
+		unsigned int traversalStackSize;
+		unsigned int referenceCount;
+		unsigned int width;
+		unsigned int quantizationBits;
+		uint64_t peakMemory;
+	};
+
+	BVHBuilder m_topLevel;
+	std::vector<GLuint> m_meshRoots;
+	std::vector<Box3> m_meshBounds;
+	// Packed nodes taken by the bottom levels
+	std::size_t m_bottomLevelSize = 0;
+	std::vector<Box3> m_instanceBounds;
+	std::vector<GLuint> m_instanceRecords;
 };
\ No newline at end of file
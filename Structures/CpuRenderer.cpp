@@ -0,0 +1,1100 @@
+#include "CpuRenderer.h"
+#include "RayPacket.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <glm/gtc/packing.hpp>
+
+namespace
+{
+	// Named like their counterparts in fragment.frag
+	const float Pi = 3.141592653589f;
+	const float TNear = 0.01f;
+	const GLuint LeafCountShift = 28;
+	const GLuint LeafOffsetMask = 0x0FFFFFFF;
+
+	struct Ray
+	{
+		glm::vec3 origin;
+		glm::vec3 direction;
+	};
+
+	struct Triangle
+	{
+		glm::vec3 v0;
+		glm::vec3 edgeA;
+		glm::vec3 edgeB;
+		glm::uvec3 attributeIndices;
+	};
+
+	struct Hit
+	{
+		GLuint vboStartIndex;
+		GLuint attrs;
+		GLuint totalAttrSize;
+		GLuint material;
+		float rayT;
+		glm::vec2 barycentric;
+		glm::uvec3 indices;
+		glm::vec3 normal;
+		// Transforms the normals of the hit mesh to the world space with a two-level BVH
+		glm::mat3 normalMatrix;
+	};
+
+	// What the shader stores in its G-buffer images
+	struct GBuffer
+	{
+		glm::vec4 albedoEmission;
+		glm::vec4 normalEmission;
+		glm::vec4 colorDepth;
+	};
+
+	// Value stored to an rgba8 image
+	float unorm8(float value)
+	{
+		return std::round(std::clamp(value, 0.f, 1.f) * 255.f) / 255.f;
+	}
+
+	glm::vec4 unorm8(glm::vec4 value)
+	{
+		return glm::vec4(unorm8(value.x), unorm8(value.y), unorm8(value.z), unorm8(value.w));
+	}
+
+	// Value stored to an rgba16f image
+	glm::vec4 half(glm::vec4 value)
+	{
+		return glm::unpackHalf4x16(glm::packHalf4x16(value));
+	}
+
+	float signmsk(float x)
+	{
+		return glm::intBitsToFloat(glm::floatBitsToInt(x) & int(0x80000000));
+	}
+
+	float xorf(float x, float y)
+	{
+		return glm::intBitsToFloat(glm::floatBitsToInt(x) ^ glm::floatBitsToInt(y));
+	}
+
+	float srgbToLinear(unsigned char value)
+	{
+		float c = value / 255.f;
+		return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	// Bilinear filtering with repeat wrapping, the GL defaults the scene textures keep
+	glm::vec3 sampleTexture(const CpuRenderer::Texture& texture, glm::vec2 uv)
+	{
+		if (texture.pixels.empty())
+		{
+			return glm::vec3(0.f);
+		}
+		glm::vec2 position = uv * glm::vec2(texture.width, texture.height) - 0.5f;
+		glm::vec2 base = glm::floor(position);
+		glm::vec2 weight = position - base;
+		auto texel = [&](int x, int y)
+			{
+				x = ((x % texture.width) + texture.width) % texture.width;
+				y = ((y % texture.height) + texture.height) % texture.height;
+				const unsigned char* pixel = &texture.pixels[((std::size_t)y * texture.width + x) * 4];
+				if (texture.srgb)
+				{
+					return glm::vec3(srgbToLinear(pixel[0]), srgbToLinear(pixel[1]), srgbToLinear(pixel[2]));
+				}
+				return glm::vec3(pixel[0], pixel[1], pixel[2]) / 255.f;
+			};
+		int x = (int)base.x;
+		int y = (int)base.y;
+		return glm::mix(
+			glm::mix(texel(x, y), texel(x + 1, y), weight.x),
+			glm::mix(texel(x, y + 1), texel(x + 1, y + 1), weight.x),
+			weight.y);
+	}
+
+	// https://www.shadertoy.com/view/4lfcDr
+	glm::vec2 sampleDisk(glm::vec2 uv)
+	{
+		float theta = 2.0f * Pi * uv.x;
+		float r = std::sqrt(uv.y);
+		return glm::vec2(std::cos(theta), std::sin(theta)) * r;
+	}
+
+	// Cosine-weighted sampling
+	glm::vec3 sampleCosHemisphere(glm::vec2 uv)
+	{
+		glm::vec2 disk = sampleDisk(uv);
+		return glm::vec3(disk.x, std::sqrt(std::max(0.0f, 1.0f - glm::dot(disk, disk))), disk.y);
+	}
+
+	glm::mat3 constructOnbFrisvad(glm::vec3 normal)
+	{
+		glm::mat3 ret;
+		ret[1] = normal;
+		if (normal.z < -0.999805696f)
+		{
+			ret[0] = glm::vec3(0.0f, -1.0f, 0.0f);
+			ret[2] = glm::vec3(-1.0f, 0.0f, 0.0f);
+		}
+		else
+		{
+			float a = 1.0f / (1.0f + normal.z);
+			float b = -normal.x * normal.y * a;
+			ret[0] = glm::vec3(1.0f - normal.x * normal.x * a, b, -normal.x);
+			ret[2] = glm::vec3(b, 1.0f - normal.y * normal.y * a, -normal.y);
+		}
+		return ret;
+	}
+
+	void encryptTea(glm::uvec2& arg)
+	{
+		const glm::uvec4 key = glm::uvec4(0xa341316c, 0xc8013ea4, 0xad90777d, 0x7e95761e);
+		GLuint v0 = arg[0], v1 = arg[1];
+		GLuint sum = 0u;
+		const GLuint delta = 0x9e3779b9u;
+
+		for (int i = 0; i < 32; i++)
+		{
+			sum += delta;
+			v0 += ((v1 << 4) + key[0]) ^ (v1 + sum) ^ ((v1 >> 5) + key[1]);
+			v1 += ((v0 << 4) + key[2]) ^ (v0 + sum) ^ ((v0 >> 5) + key[3]);
+		}
+		arg[0] = v0;
+		arg[1] = v1;
+	}
+
+	//https://www.shadertoy.com/view/tdBXRW
+	float xorTextureGradBox(glm::vec2 pos, glm::vec2 ddx, glm::vec2 ddy)
+	{
+		float result = 0.0f;
+		for (int i = 0; i < 8; i++)
+		{
+			// filter kernel
+			glm::vec2 w = glm::max(glm::abs(ddx), glm::abs(ddy)) + 0.01f;
+			// analytical integral (box filter)
+			glm::vec2 f = 2.0f * (glm::abs(glm::fract((pos - 0.5f * w) / 2.0f) - 0.5f) - glm::abs(glm::fract((pos + 0.5f * w) / 2.0f) - 0.5f)) / w;
+			// xor pattern
+			result += 0.5f - 0.5f * f.x * f.y;
+
+			// next octave
+			ddx *= 0.5f;
+			ddy *= 0.5f;
+			pos *= 0.5f;
+			result *= 0.5f;
+		}
+		return result;
+	}
+
+	// Camera of one Looking Glass view
+	struct ViewCamera
+	{
+		glm::mat4 inverseViewProj;
+		glm::vec3 position;
+	};
+
+	/**
+	* One instance per task. Holds the traversal stacks and the random generator state of the current pixel
+	*/
+	class Tracer
+	{
+	public:
+		Tracer(const CpuRenderer::Scene& scene, const CpuRenderer::Settings& settings)
+			: scene(scene), settings(settings),
+			stack(std::max(scene.traversalStackSize, 1u)), stackT(std::max(scene.traversalStackSize, 1u))
+		{
+		}
+
+		GLuint seed = 0;
+		GLuint time = 0;
+
+		glm::vec2 getRandom()
+		{
+			glm::uvec2 arg = glm::uvec2(time, seed++);
+			encryptTea(arg);
+			return glm::fract(glm::vec2(arg) / glm::vec2(float(0xffffffffu)));
+		}
+
+		Ray createSecondaryRay(glm::vec3 pos, glm::vec3 normal)
+		{
+			glm::vec2 randomValues = getRandom();
+			glm::mat3 onb = constructOnbFrisvad(normal);
+			glm::vec3 dir = glm::normalize(onb * sampleCosHemisphere(randomValues));
+			// Offset to prevent self-blocking
+			return Ray{ pos + normal * settings.rayOffset, dir };
+		}
+
+		void findClosestHit(const Ray& ray, Hit& closestHit)
+		{
+			if (!scene.twoLevel)
+			{
+				traverseClosestHit(0, ray, closestHit);
+				return;
+			}
+			GLuint nodeIndex = scene.topLevelRoot;
+			const GLuint lastNode = (GLuint)scene.bvh.size();
+			glm::vec3 invDir = 1.0f / ray.direction;
+			while (nodeIndex < lastNode)
+			{
+				glm::vec4 bboxMin = fetch(nodeIndex * 2);
+				glm::vec4 bboxMax = fetch(nodeIndex * 2 + 1);
+				GLuint instance = glm::floatBitsToUint(bboxMin.w);
+				float tmin, tmax;
+				if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax) && tmin <= closestHit.rayT)
+				{
+					if (instance == BVHNode::InvalidMask)
+					{
+						++nodeIndex;
+						continue;
+					}
+					float previousT = closestHit.rayT;
+					traverseClosestHit(scene.bvh[instance + 3].a, toMeshSpace(instance, ray), closestHit);
+					if (closestHit.rayT < previousT)
+					{
+						// Transposed inverse of the mesh-to-world matrix
+						closestHit.normalMatrix = glm::mat3(glm::vec3(fetch(instance)), glm::vec3(fetch(instance + 1)), glm::vec3(fetch(instance + 2)));
+						closestHit.normal = closestHit.normalMatrix * closestHit.normal;
+					}
+				}
+				nodeIndex = glm::floatBitsToUint(bboxMax.w);
+			}
+		}
+
+		// For shadows
+		void findAnyHit(const Ray& ray, Hit& anyHit)
+		{
+			if (!scene.twoLevel)
+			{
+				traverseAnyHit(0, ray, anyHit);
+				return;
+			}
+			GLuint nodeIndex = scene.topLevelRoot;
+			const GLuint lastNode = (GLuint)scene.bvh.size();
+			glm::vec3 invDir = 1.0f / ray.direction;
+			while (nodeIndex < lastNode)
+			{
+				glm::vec4 bboxMin = fetch(nodeIndex * 2);
+				glm::vec4 bboxMax = fetch(nodeIndex * 2 + 1);
+				GLuint instance = glm::floatBitsToUint(bboxMin.w);
+				float tmin, tmax;
+				if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax))
+				{
+					if (instance == BVHNode::InvalidMask)
+					{
+						++nodeIndex;
+						continue;
+					}
+					if (traverseAnyHit(scene.bvh[instance + 3].a, toMeshSpace(instance, ray), anyHit))
+					{
+						return;
+					}
+				}
+				nodeIndex = glm::floatBitsToUint(bboxMax.w);
+			}
+		}
+
+		bool resolveRay(const Ray& ray, float far, glm::vec3& albedo, glm::vec3& normal, glm::vec3& emission, float& depth)
+		{
+			Hit closestHit;
+			closestHit.rayT = far;
+			findClosestHit(ray, closestHit);
+			return resolveHit(closestHit, far, albedo, normal, emission, depth);
+		}
+
+		// Shades the closest hit of a ray which was traced up to far
+		bool resolveHit(const Hit& closestHit, float far, glm::vec3& albedo, glm::vec3& normal, glm::vec3& emission, float& depth)
+		{
+			if (closestHit.rayT == far)
+			{
+				return false;
+			}
+			// Interpolate other triangle attributes by barycentric coordinates
+			GLuint currentAttrOffset = 0;
+			glm::vec3 surfaceNormal = glm::normalize(closestHit.normal);
+			glm::vec2 uv = glm::vec2(0.f);
+			if ((closestHit.attrs & 1u) != 0)
+			{
+				// Vertex colors are not used
+				currentAttrOffset += 4;
+			}
+			if ((closestHit.attrs & 2u) != 0)
+			{
+				surfaceNormal = glm::vec3(interpolate(closestHit, currentAttrOffset), interpolate(closestHit, currentAttrOffset + 1), interpolate(closestHit, currentAttrOffset + 2));
+				surfaceNormal = glm::normalize((scene.twoLevel ? closestHit.normalMatrix : scene.sceneNormalMatrix) * surfaceNormal);
+				currentAttrOffset += 3;
+			}
+			if ((closestHit.attrs & 4u) != 0)
+			{
+				uv = glm::vec2(interpolate(closestHit, currentAttrOffset), interpolate(closestHit, currentAttrOffset + 1));
+				currentAttrOffset += 2;
+			}
+			albedo = getMaterialColor(closestHit.material, emission, uv);
+			normal = surfaceNormal;
+			depth = closestHit.rayT;
+			return true;
+		}
+
+		// Closest hit of a lane after RayPacket::findClosestHits
+		template<unsigned W>
+		Hit packetHit(const RayPacket::Packet<W>& packet, unsigned lane, float far) const
+		{
+			Hit hit;
+			hit.rayT = packet.t[lane];
+			if (hit.rayT == far)
+			{
+				return hit;
+			}
+			glm::vec2 barycentric = glm::vec2(packet.v[lane], packet.u[lane]);
+			glm::vec3 normal = glm::vec3(packet.normalX[lane], packet.normalY[lane], packet.normalZ[lane]);
+			if (scene.indexedPositions)
+			{
+				const IndexedTriangle& indexed = scene.trianglesIndexed[packet.triangle[lane]];
+				fillHit(indexed.objectIndex, indexed.indices, barycentric, normal, hit);
+			}
+			else
+			{
+				const FastTriangleSecondHalf& triSecond = scene.trianglesSecond[packet.triangle[lane]];
+				fillHit(triSecond.objectIndex, triSecond.indices, barycentric, normal, hit);
+			}
+			return hit;
+		}
+
+	private:
+		const CpuRenderer::Scene& scene;
+		const CpuRenderer::Settings& settings;
+		// Only internal nodes of the wide layouts get to the stack
+		std::vector<GLuint> stack;
+		std::vector<float> stackT;
+
+		glm::vec4 fetch(GLuint index) const
+		{
+			const BVHPackedNode& node = scene.bvh[index];
+			return glm::vec4(glm::uintBitsToFloat(node.a), glm::uintBitsToFloat(node.b), glm::uintBitsToFloat(node.c), glm::uintBitsToFloat(node.d));
+		}
+
+		glm::uvec4 fetchBits(GLuint index) const
+		{
+			const BVHPackedNode& node = scene.bvh[index];
+			return glm::uvec4(node.a, node.b, node.c, node.d);
+		}
+
+		static bool rayBoxIntersection(glm::vec3 minPos, glm::vec3 maxPos, glm::vec3 rayOrigin, glm::vec3 invDir, float& tmin, float& tmax)
+		{
+			glm::vec3 t1 = (minPos - rayOrigin) * invDir;
+			glm::vec3 t2 = (maxPos - rayOrigin) * invDir;
+			tmin = std::max(std::min(t1.x, t2.x), std::max(std::min(t1.y, t2.y), std::min(t1.z, t2.z)));
+			tmax = std::min(std::max(t1.x, t2.x), std::min(std::max(t1.y, t2.y), std::max(t1.z, t2.z)));
+			return !(tmax < 0 || tmin > tmax);
+		}
+
+		// The direction is not normalized, so the ray parameter is the same in both spaces
+		Ray toMeshSpace(GLuint instance, const Ray& ray) const
+		{
+			glm::vec4 row0 = fetch(instance);
+			glm::vec4 row1 = fetch(instance + 1);
+			glm::vec4 row2 = fetch(instance + 2);
+			glm::vec4 origin = glm::vec4(ray.origin, 1.f);
+			return Ray{
+				glm::vec3(glm::dot(row0, origin), glm::dot(row1, origin), glm::dot(row2, origin)),
+				glm::vec3(glm::dot(glm::vec3(row0), ray.direction), glm::dot(glm::vec3(row1), ray.direction), glm::dot(glm::vec3(row2), ray.direction))
+			};
+		}
+
+		//https://github.com/embree/embree/blob/master/kernels/geometry/triangle_intersector_moeller.h
+		bool embreeIntersect(const Triangle& tri, const Ray& ray, float& T, float& U, float& V, glm::vec3& normal) const
+		{
+			glm::vec3 edgeA = tri.edgeB;
+			glm::vec3 edgeB = tri.edgeA;
+			normal = glm::cross(tri.edgeA, tri.edgeB);
+			const float den = glm::dot(normal, ray.direction);
+			if (settings.backfaceCulling && den < 0.001f)
+			{
+				return false;
+			}
+			glm::vec3 C = tri.v0 - ray.origin;
+			glm::vec3 R = glm::cross(ray.direction, C);
+			const float absDen = std::abs(den);
+			if (!settings.backfaceCulling && absDen < 0.001f)
+			{
+				return false;
+			}
+			const float sgnDen = signmsk(den);
+
+			// perform edge tests
+			U = xorf(glm::dot(R, edgeB), sgnDen);
+			if (U < 0)
+			{
+				return false;
+			}
+			V = xorf(glm::dot(R, edgeA), sgnDen);
+			if (V < 0)
+			{
+				return false;
+			}
+			if (U + V > absDen)
+			{
+				return false;
+			}
+
+			// perform depth test
+			float invDen = 1 / absDen;
+			float newT = xorf(glm::dot(normal, C), sgnDen) * invDen;
+			if (newT >= TNear && newT < T)
+			{
+				T = newT;
+				U *= invDen;
+				V *= invDen;
+				return true;
+			}
+			return false;
+		}
+
+		// Fills the hit when the triangle is closer
+		bool intersectTriangle(const Triangle& tri, GLuint objectIndex, const Ray& ray, Hit& hit) const
+		{
+			float outU, outV;
+			glm::vec3 normal;
+			if (embreeIntersect(tri, ray, hit.rayT, outU, outV, normal))
+			{
+				fillHit(objectIndex, tri.attributeIndices, glm::vec2(outV, outU), glm::normalize(normal), hit);
+				return true;
+			}
+			return false;
+		}
+
+		void fillHit(GLuint objectIndex, glm::uvec3 attributeIndices, glm::vec2 barycentric, glm::vec3 normal, Hit& hit) const
+		{
+			const SceneObject& obj = scene.objects[objectIndex];
+			hit.vboStartIndex = obj.attrBufferPointer;
+			hit.attrs = obj.vertexAttrsMask;
+			hit.material = obj.material;
+			hit.totalAttrSize = obj.totalAttrSize;
+			hit.barycentric = barycentric;
+			hit.indices = attributeIndices;
+			hit.normal = normal;
+		}
+
+		// Gathers the vertices of the triangle from the position buffer
+		bool intersectIndexed(GLuint primitiveIndex, const Ray& ray, Hit& hit) const
+		{
+			const IndexedTriangle& indexed = scene.trianglesIndexed[primitiveIndex];
+			GLuint firstVertex = scene.objects[indexed.objectIndex].positionPointer;
+			glm::vec3 v0 = scene.vertexPositions[firstVertex + indexed.indices.x];
+			glm::vec3 v1 = scene.vertexPositions[firstVertex + indexed.indices.y];
+			glm::vec3 v2 = scene.vertexPositions[firstVertex + indexed.indices.z];
+			return intersectTriangle(Triangle{ v0, v0 - v1, v2 - v0, indexed.indices }, indexed.objectIndex, ray, hit);
+		}
+
+		// Tests the triangle whose first half (v0 and edgeA) is stored in the BVH
+		bool intersectSecondHalf(GLuint primitiveIndex, glm::vec3 v0, glm::vec3 edgeA, const Ray& ray, Hit& hit) const
+		{
+			const FastTriangleSecondHalf& triSecond = scene.trianglesSecond[primitiveIndex];
+			return intersectTriangle(Triangle{ v0, edgeA, triSecond.edgeB, triSecond.indices }, triSecond.objectIndex, ray, hit);
+		}
+
+		// Tests count triangles stored from the packed node first. Returns when any one is hit if stopAtFirst is set
+		bool intersectTriangles(GLuint first, GLuint count, bool stopAtFirst, const Ray& ray, Hit& hit) const
+		{
+			bool found = false;
+			for (GLuint i = 0; i < count; i++)
+			{
+				if (scene.indexedPositions)
+				{
+					found = intersectIndexed(fetchBits(first + i / 4)[i % 4], ray, hit) || found;
+				}
+				else
+				{
+					glm::vec4 v0 = fetch(first + i * 2);
+					found = intersectSecondHalf(glm::floatBitsToUint(v0.w), glm::vec3(v0), glm::vec3(fetch(first + i * 2 + 1)), ray, hit) || found;
+				}
+				if (found && stopAtFirst)
+				{
+					break;
+				}
+			}
+			return found;
+		}
+
+		GLuint groupSize() const
+		{
+			return scene.quantizationBits == 8 ? 4 : scene.quantizationBits == 16 ? 5 : 7;
+		}
+
+		// Bounds of the 4 children of a group in the order min x, max x, min y, max y, min z, max z
+		void decodeChildBounds(GLuint group, std::array<glm::vec4, 6>& bounds) const
+		{
+			if (scene.quantizationBits == 0)
+			{
+				for (GLuint i = 0; i < 6; i++)
+				{
+					bounds[i] = fetch(group + i);
+				}
+				return;
+			}
+			glm::vec4 header = fetch(group);
+			GLuint exponents = glm::floatBitsToUint(header.w);
+			for (GLuint i = 0; i < 6; i++)
+			{
+				GLuint axis = i / 2;
+				// Power of two made directly from the exponent bits
+				float scale = glm::uintBitsToFloat(((exponents >> (axis * 8)) & 0xFFu) << 23);
+				glm::uvec4 quantized;
+				if (scene.quantizationBits == 8)
+				{
+					GLuint word = fetchBits(group + 1 + i / 4)[i % 4];
+					quantized = (glm::uvec4(word) >> glm::uvec4(0, 8, 16, 24)) & 0xFFu;
+				}
+				else
+				{
+					glm::uvec4 words = fetchBits(group + 1 + i / 2);
+					GLuint low = words[(i % 2) * 2];
+					GLuint high = words[(i % 2) * 2 + 1];
+					quantized = (glm::uvec4(low, low, high, high) >> glm::uvec4(0, 16, 0, 16)) & 0xFFFFu;
+				}
+				bounds[i] = header[axis] + glm::vec4(quantized) * scale;
+			}
+		}
+
+		// Slab test of the 4 children of a group at once
+		static glm::bvec4 intersectChildren(const std::array<glm::vec4, 6>& bounds, glm::vec3 originDivDir, glm::vec3 invDir, float maxT, glm::vec4& tEntry, glm::vec4& tExit)
+		{
+			glm::vec4 tx0 = bounds[0] * invDir.x - originDivDir.x;
+			glm::vec4 tx1 = bounds[1] * invDir.x - originDivDir.x;
+			glm::vec4 ty0 = bounds[2] * invDir.y - originDivDir.y;
+			glm::vec4 ty1 = bounds[3] * invDir.y - originDivDir.y;
+			glm::vec4 tz0 = bounds[4] * invDir.z - originDivDir.z;
+			glm::vec4 tz1 = bounds[5] * invDir.z - originDivDir.z;
+
+			tEntry = glm::max(glm::max(glm::min(tx0, tx1), glm::min(ty0, ty1)), glm::max(glm::min(tz0, tz1), glm::vec4(0)));
+			tExit = glm::min(glm::min(glm::max(tx0, tx1), glm::max(ty0, ty1)), glm::min(glm::max(tz0, tz1), glm::vec4(maxT)));
+			return glm::lessThanEqual(tEntry, tExit);
+		}
+
+		static GLuint leafCount(GLuint child)
+		{
+			return ((child & ~BVHNode::LeafMask) >> LeafCountShift) + 1;
+		}
+
+		void traverseClosestHit(GLuint root, const Ray& ray, Hit& closestHit)
+		{
+			if (scene.bvh.empty())
+			{
+				return;
+			}
+			glm::vec3 invDir = 1.0f / ray.direction;
+			if (scene.bvhWidth == 2)
+			{
+				// Stackless threaded binary tree
+				GLuint nodeIndex = root;
+				const GLuint lastNode = (GLuint)scene.bvh.size();
+				while (nodeIndex < lastNode)
+				{
+					glm::vec4 bboxMin = fetch(nodeIndex * 2);
+					glm::vec4 bboxMax = fetch(nodeIndex * 2 + 1);
+					GLuint primitiveIndex = glm::floatBitsToUint(bboxMin.w);
+					bool isLeaf = primitiveIndex != BVHNode::InvalidMask;
+					float tmin, tmax;
+					if (isLeaf && (primitiveIndex & BVHNode::LeafMask) != 0)
+					{
+						// Multi-triangle leaf. Its bounds are followed by the triangles
+						if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax))
+						{
+							intersectTriangles((nodeIndex + 1) * 2, primitiveIndex & ~BVHNode::LeafMask, false, ray, closestHit);
+						}
+					}
+					else if (isLeaf)
+					{
+						if (scene.indexedPositions)
+						{
+							intersectIndexed(primitiveIndex, ray, closestHit);
+						}
+						else
+						{
+							intersectSecondHalf(primitiveIndex, glm::vec3(bboxMin), glm::vec3(bboxMax), ray, closestHit);
+						}
+					}
+					else if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax))
+					{
+						++nodeIndex;
+						continue;
+					}
+					nodeIndex = glm::floatBitsToUint(bboxMax.w);
+				}
+				return;
+			}
+
+			glm::vec3 originDivDir = ray.origin * invDir;
+			const GLuint groupStep = groupSize();
+			std::size_t stackSize = 1;
+			stack[0] = root;
+			stackT[0] = 0;
+			while (stackSize > 0)
+			{
+				--stackSize;
+				if (stackT[stackSize] > closestHit.rayT)
+				{
+					// A closer hit was found after the node had been pushed
+					continue;
+				}
+				GLuint node = stack[stackSize];
+
+				// Hit children sorted from the farthest so the nearest one is popped first
+				std::array<GLuint, 8> childNodes;
+				std::array<float, 8> childT;
+				GLuint childCount = 0;
+				for (GLuint group = node; group < node + scene.bvhWidth / 4 * groupStep; group += groupStep)
+				{
+					std::array<glm::vec4, 6> bounds;
+					decodeChildBounds(group, bounds);
+					glm::vec4 tEntry, tExit;
+					glm::bvec4 hits = intersectChildren(bounds, originDivDir, invDir, closestHit.rayT, tEntry, tExit);
+					glm::uvec4 children = fetchBits(group + groupStep - 1);
+					for (GLuint lane = 0; lane < 4; lane++)
+					{
+						if (children[lane] == BVHNode::InvalidMask || !hits[lane])
+						{
+							continue;
+						}
+						if ((children[lane] & BVHNode::LeafMask) != 0)
+						{
+							intersectTriangles(children[lane] & LeafOffsetMask, leafCount(children[lane]), false, ray, closestHit);
+						}
+						else
+						{
+							GLuint i = childCount++;
+							for (; i > 0 && childT[i - 1] < tEntry[lane]; i--)
+							{
+								childNodes[i] = childNodes[i - 1];
+								childT[i] = childT[i - 1];
+							}
+							childNodes[i] = children[lane];
+							childT[i] = tEntry[lane];
+						}
+					}
+				}
+				for (GLuint i = 0; i < childCount; i++, stackSize++)
+				{
+					stack[stackSize] = childNodes[i];
+					stackT[stackSize] = childT[i];
+				}
+			}
+		}
+
+		// Returns true when anything is hit
+		bool traverseAnyHit(GLuint root, const Ray& ray, Hit& anyHit)
+		{
+			if (scene.bvh.empty())
+			{
+				return false;
+			}
+			glm::vec3 invDir = 1.0f / ray.direction;
+			if (scene.bvhWidth == 2)
+			{
+				GLuint nodeIndex = root;
+				const GLuint lastNode = (GLuint)scene.bvh.size();
+				while (nodeIndex < lastNode)
+				{
+					glm::vec4 bboxMin = fetch(nodeIndex * 2);
+					glm::vec4 bboxMax = fetch(nodeIndex * 2 + 1);
+					GLuint primitiveIndex = glm::floatBitsToUint(bboxMin.w);
+					bool isLeaf = primitiveIndex != BVHNode::InvalidMask;
+					float tmin, tmax;
+					if (isLeaf && (primitiveIndex & BVHNode::LeafMask) != 0)
+					{
+						if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax)
+							&& intersectTriangles((nodeIndex + 1) * 2, primitiveIndex & ~BVHNode::LeafMask, true, ray, anyHit))
+						{
+							return true;
+						}
+					}
+					else if (isLeaf)
+					{
+						if (scene.indexedPositions ? intersectIndexed(primitiveIndex, ray, anyHit)
+							: intersectSecondHalf(primitiveIndex, glm::vec3(bboxMin), glm::vec3(bboxMax), ray, anyHit))
+						{
+							return true;
+						}
+					}
+					else if (rayBoxIntersection(glm::vec3(bboxMin), glm::vec3(bboxMax), ray.origin, invDir, tmin, tmax))
+					{
+						++nodeIndex;
+						continue;
+					}
+					nodeIndex = glm::floatBitsToUint(bboxMax.w);
+				}
+				return false;
+			}
+
+			glm::vec3 originDivDir = ray.origin * invDir;
+			const GLuint groupStep = groupSize();
+			std::size_t stackSize = 1;
+			stack[0] = root;
+			while (stackSize > 0)
+			{
+				GLuint node = stack[--stackSize];
+				for (GLuint group = node; group < node + scene.bvhWidth / 4 * groupStep; group += groupStep)
+				{
+					std::array<glm::vec4, 6> bounds;
+					decodeChildBounds(group, bounds);
+					glm::vec4 tEntry, tExit;
+					glm::bvec4 hits = intersectChildren(bounds, originDivDir, invDir, anyHit.rayT, tEntry, tExit);
+					glm::uvec4 children = fetchBits(group + groupStep - 1);
+					for (GLuint lane = 0; lane < 4; lane++)
+					{
+						if (!hits[lane] || children[lane] == BVHNode::InvalidMask)
+						{
+							continue;
+						}
+						if ((children[lane] & BVHNode::LeafMask) != 0)
+						{
+							if (intersectTriangles(children[lane] & LeafOffsetMask, leafCount(children[lane]), true, ray, anyHit))
+							{
+								return true;
+							}
+						}
+						else
+						{
+							stack[stackSize++] = children[lane];
+						}
+					}
+				}
+			}
+			return false;
+		}
+
+		float interpolate(const Hit& hit, GLuint currentAttrOffset) const
+		{
+			auto attribute = [&](GLuint index)
+				{
+					return scene.vertexAttrs[hit.vboStartIndex + index * hit.totalAttrSize + currentAttrOffset];
+				};
+			return attribute(hit.indices.x) * (1 - hit.barycentric.x - hit.barycentric.y)
+				+ attribute(hit.indices.y) * hit.barycentric.x
+				+ attribute(hit.indices.z) * hit.barycentric.y;
+		}
+
+		glm::vec3 textureColor(glm::vec3 packed, glm::vec2 uv) const
+		{
+			glm::uint64 index = Material::unpackHandle(packed);
+			// Missing textures are black, like the GL textures before they arrive
+			return index < scene.textures.size() && !scene.textures[index].pixels.empty() ? sampleTexture(scene.textures[index], uv) : glm::vec3(0.f);
+		}
+
+		glm::vec3 getMaterialColor(GLuint materialIndex, glm::vec3& emission, glm::vec2 uv) const
+		{
+			const Material& mat = scene.materials[materialIndex];
+			glm::vec3 albedo = (mat.isTexture & 1u) != 0 ? textureColor(mat.colorOrHandle, uv) : mat.colorOrHandle;
+			emission = (mat.isTexture & 2u) != 0 ? textureColor(mat.emissive, uv) : mat.emissive;
+			return albedo;
+		}
+	};
+
+	/**
+	* Port of rayTraceSubPixel for one subpixel over all the iterations. The G-buffer values pass through the precision of the shader images.
+	* The closest hit of the camera ray is found by the caller
+	*/
+	glm::vec3 traceSubPixel(Tracer& tracer, const CpuRenderer::Scene& scene, const CpuRenderer::Settings& settings,
+		const Ray& cameraRay, const Hit& cameraHit, glm::vec2 planeDdx, glm::vec2 planeDdy, float cameraFarPlane, GLuint firstFrame)
+	{
+		glm::vec3 primaryAlbedo, normal, emission;
+		float primaryDepth;
+
+		// raytrace the coordinate 'xor' plane at (0,-1,0)
+		float planeDist = (-1 - cameraRay.origin.y) / cameraRay.direction.y;
+		auto planeColor = [&](float t)
+			{
+				glm::vec3 pos = cameraRay.origin + t * cameraRay.direction;
+				return glm::vec3(xorTextureGradBox(glm::vec2(pos.x, pos.z), planeDdx, planeDdy) / std::clamp(t * 0.09f, 2.1f, 8.0f));
+			};
+
+		// This is the primary ray
+		GBuffer gBuffer;
+		glm::vec3 primaryColor;
+		if (tracer.resolveHit(cameraHit, cameraFarPlane, primaryAlbedo, normal, emission, primaryDepth))
+		{
+			gBuffer = {
+				glm::vec4(primaryAlbedo + emission, (emission.x + emission.y) * 0.55f),
+				glm::vec4(normal * 0.5f + 0.5f, emission.z),
+				glm::vec4(glm::vec3(0.f), primaryDepth)
+			};
+			primaryColor = planeDist > 0 && primaryDepth > planeDist
+				// The object is behind the plane so make the plane 80% transparent
+				? glm::mix(primaryAlbedo + emission, planeColor(planeDist), 0.3f)
+				: primaryAlbedo + emission;
+		}
+		else
+		{
+			gBuffer = { glm::vec4(0.f), glm::vec4(0.5f, 0.5f, 0.5f, 0.f), glm::vec4(0.f) };
+			primaryColor = planeDist > 0 ? planeColor(planeDist) : glm::vec3(0.1f);
+		}
+		if (settings.iterations == 0)
+		{
+			return primaryColor;
+		}
+		gBuffer.albedoEmission = unorm8(gBuffer.albedoEmission);
+		gBuffer.normalEmission = unorm8(gBuffer.normalEmission);
+		gBuffer.colorDepth = half(gBuffer.colorDepth);
+
+		for (unsigned int iteration = 1; iteration <= settings.iterations; iteration++)
+		{
+			// This is a secondary ray. Every iteration is another frame of the shader
+			tracer.time = firstFrame + iteration;
+			Ray primaryRay = cameraRay;
+			glm::vec3 albedo = glm::vec3(gBuffer.albedoEmission);
+			glm::vec3 previousNormal = glm::vec3(gBuffer.normalEmission) * 2.f - 1.f;
+			float depth = gBuffer.colorDepth.a;
+			glm::vec3 contrib = glm::vec3(gBuffer.colorDepth);
+			if (gBuffer.normalEmission.a > 0)
+			{
+				// The primary ray hit a light source here
+				contrib += albedo;
+			}
+			else
+			{
+				glm::vec3 throughput = albedo;
+				glm::vec3 secondaryColor;
+				// Basically the alrogithm from https://www.shadertoy.com/view/4lfcDr
+				for (unsigned int i = 0; i < settings.maxBounces && !scene.lights.empty(); i++)
+				{
+					const Light& light = scene.lights[0];
+					glm::vec3 position = primaryRay.origin + primaryRay.direction * depth;
+					{ // Next event estimation (sample light)
+						glm::vec2 rng = tracer.getRandom();
+						glm::vec3 posLs = light.position + glm::vec3(rng.x - 0.5f, 0, rng.y - 0.5f) * light.size;
+						glm::vec3 dirToLight = posLs - position;
+						glm::vec3 lNee = dirToLight;
+						float rrNee = glm::dot(lNee, lNee);
+						lNee /= std::sqrt(rrNee);
+						float G = std::max(0.0f, glm::dot(previousNormal, lNee)) * std::max(0.0f, -glm::dot(lNee, light.normal)) / rrNee;
+						if (G > 0.0f)
+						{
+							float lightPdf = 1.0f / (light.area * G);
+							float brdfPdf = 1.0f / Pi;
+							float w = lightPdf / (lightPdf + brdfPdf);
+							glm::vec3 brdf = albedo / Pi;
+
+							// Test light visibility
+							float far = glm::length(dirToLight);
+							Ray shadowRay{ position, dirToLight / far };
+							Hit anyHit;
+							anyHit.rayT = far;
+							tracer.findAnyHit(shadowRay, anyHit);
+							if (anyHit.rayT == far)
+							{
+								glm::vec3 Le = glm::vec3(light.emission);
+								contrib += throughput * (Le * w * brdf) / lightPdf;
+							}
+						}
+					}
+					{ // Sample surface using BRDF
+						Ray secondary = tracer.createSecondaryRay(position, previousNormal);
+						if (!tracer.resolveRay(secondary, cameraFarPlane, secondaryColor, normal, emission, depth))
+						{
+							break;
+						}
+						glm::vec3 brdf = secondaryColor / Pi;
+						float brdfPdf = 1.0f / Pi;
+						if (emission.x > 0.f || emission.y > 0.f || emission.z > 0.f)
+						{
+							// Hit a light source
+							float G = std::max(0.0f, glm::dot(secondary.direction, previousNormal)) * std::max(0.0f, -glm::dot(secondary.direction, normal)) / (depth * depth);
+							if (G <= 0.0f)
+							{
+								// hit back side of light source
+								break;
+							}
+							float lightPdf = 1.0f / (light.area * G);
+							float w = brdfPdf / (lightPdf + brdfPdf);
+							glm::vec3 Le = glm::vec3(light.emission);
+							contrib += throughput * (Le * w * brdf) / brdfPdf;
+							break;
+						}
+						throughput *= brdf / brdfPdf;
+						primaryRay = secondary;
+						previousNormal = normal;
+						albedo = secondaryColor;
+					}
+				}
+			}
+			gBuffer.colorDepth = half(glm::vec4(contrib, gBuffer.colorDepth.a));
+		}
+		return glm::vec3(gBuffer.colorDepth) / (float)settings.iterations;
+	}
+}
+
+namespace CpuRenderer
+{
+	std::vector<glm::vec3> render(const Scene& scene, const Camera& camera, const Settings& settings)
+	{
+		std::vector<glm::vec3> image((std::size_t)settings.width * settings.height);
+		const float cameraFarPlane = camera.proj[2].w / (camera.proj[2].z + 1.0f);
+		const float aspect = (float)settings.width / settings.height;
+
+		// There are only a few distinct cameras, so their matrices are inverted once
+		std::vector<ViewCamera> views;
+		const glm::mat4 invView = glm::inverse(camera.view);
+		const glm::mat4 invProj = glm::inverse(camera.proj);
+		if (camera.lookingGlass)
+		{
+			for (int view = 0; view < Tile; view++)
+			{
+				Camera shifted = viewCamera(camera, view, Tile, aspect);
+				views.push_back({ glm::inverse(shifted.proj * shifted.view), glm::vec3(glm::inverse(shifted.view) * glm::vec4(0, 0, 0, 1)) });
+			}
+		}
+
+		// Camera ray through the NDC position for the subpixel, like getRay
+		auto cameraRay = [&](glm::vec2 ndc, GLuint subpixel)
+			{
+				if (camera.lookingGlass)
+				{
+					// generateChaRay
+					glm::vec2 texCoords = ndc * .5f + .5f;
+					const Calibration::ForShader& calibration = camera.calibration;
+					float view = (texCoords.x + calibration.subp * subpixel + texCoords.y * calibration.tilt) * calibration.pitch - calibration.center;
+					view = 1.0f - glm::fract(view);
+					const ViewCamera& viewCamera = views[std::clamp((int)std::floor(view * Tile), 0, Tile - 1)];
+					glm::vec4 dir = viewCamera.inverseViewProj * glm::vec4(ndc, 1, 1);
+					return Ray{ viewCamera.position, glm::normalize(glm::vec3(dir) / dir.w) };
+				}
+				// getFlatScreenRay
+				glm::vec4 dir = invProj * glm::vec4(ndc, 1, 1);
+				dir.w = 0;
+				dir = invView * dir;
+				return Ray{ glm::vec3(invView * glm::vec4(0, 0, 0, 1)), glm::normalize(glm::vec3(dir)) };
+			};
+		auto planePosition = [](const Ray& ray)
+			{
+				float t = (-1 - ray.origin.y) / ray.direction.y;
+				glm::vec3 pos = ray.origin + t * ray.direction;
+				return glm::vec2(pos.x, pos.z);
+			};
+
+		const unsigned int tileSize = std::max(settings.tileSize, 1u);
+		const unsigned int tilesX = (settings.width + tileSize - 1) / tileSize;
+		const unsigned int tilesY = (settings.height + tileSize - 1) / tileSize;
+		constexpr unsigned int PacketWidth = RayPacket::NativeWidth;
+		// Neighbouring camera rays are coherent, so a row of a tile is traced in packets
+		const bool usePackets = settings.rayPackets && !scene.twoLevel && scene.bvhWidth == 2;
+		const glm::vec2 pixelSize = 2.f / glm::vec2(settings.width, settings.height);
+		ThreadPool::shared().parallelFor(0, (std::size_t)tilesX * tilesY, 1, [&](std::size_t tile)
+			{
+				Tracer tracer(scene, settings);
+				RayPacket::Packet<PacketWidth> packet;
+				std::array<Ray, PacketWidth> rays;
+				const unsigned int firstX = (tile % tilesX) * tileSize;
+				const unsigned int firstY = (tile / tilesX) * tileSize;
+				const unsigned int endX = std::min(firstX + tileSize, settings.width);
+				for (unsigned int y = firstY; y < std::min(firstY + tileSize, settings.height); y++)
+				{
+					for (GLuint subpixel = 0; subpixel < (camera.lookingGlass ? 3u : 1u); subpixel++)
+					{
+						for (unsigned int packetX = firstX; packetX < endX; packetX += PacketWidth)
+						{
+							const unsigned int count = std::min(PacketWidth, endX - packetX);
+							for (unsigned int lane = 0; lane < count; lane++)
+							{
+								glm::vec2 ndc = (glm::vec2(packetX + lane, y) + 0.5f) * pixelSize - 1.f;
+								rays[lane] = cameraRay(ndc, subpixel);
+								packet.setRay(lane, rays[lane].origin, rays[lane].direction, cameraFarPlane);
+							}
+							if (usePackets)
+							{
+								packet.active = (1 << count) - 1;
+								RayPacket::findClosestHits(scene, settings.backfaceCulling, packet);
+							}
+
+							for (unsigned int lane = 0; lane < count; lane++)
+							{
+								const unsigned int x = packetX + lane;
+								glm::vec2 fragCoord = glm::vec2(x, y) + 0.5f;
+								glm::vec2 ndc = fragCoord * pixelSize - 1.f;
+								const Ray& ray = rays[lane];
+								Hit hit;
+								if (usePackets)
+								{
+									hit = tracer.packetHit(packet, lane, cameraFarPlane);
+								}
+								else
+								{
+									hit.rayT = cameraFarPlane;
+									tracer.findClosestHit(ray, hit);
+								}
+								// The shader gets the derivatives of the plane position from the neighbouring fragments
+								glm::vec2 plane = planePosition(ray);
+								glm::vec2 ddx = planePosition(cameraRay(ndc + glm::vec2(pixelSize.x, 0), subpixel)) - plane;
+								glm::vec2 ddy = planePosition(cameraRay(ndc + glm::vec2(0, pixelSize.y), subpixel)) - plane;
+
+								tracer.seed = GLuint(fragCoord.x + fragCoord.y * fragCoord.x);
+								glm::vec3 subpixelColor = traceSubPixel(tracer, scene, settings, ray, hit, ddx, ddy, cameraFarPlane, subpixel * settings.iterations);
+								glm::vec3& color = image[(std::size_t)y * settings.width + x];
+								if (camera.lookingGlass)
+								{
+									color[subpixel] = subpixelColor[subpixel];
+								}
+								else
+								{
+									color = subpixelColor;
+								}
+							}
+						}
+					}
+				}
+			});
+		return image;
+	}
+
+	std::vector<glm::vec3> renderQuilt(const Scene& scene, const Camera& camera, const Settings& settings, unsigned int columns, unsigned int rows)
+	{
+		std::vector<glm::vec3> quilt((std::size_t)settings.width * settings.height);
+		Settings viewSettings = settings;
+		viewSettings.width = settings.width / columns;
+		viewSettings.height = settings.height / rows;
+		const float aspect = (float)viewSettings.width / viewSettings.height;
+		const int viewCount = (int)(columns * rows);
+		for (int view = 0; view < viewCount; view++)
+		{
+			auto image = render(scene, viewCamera(camera, view, viewCount, aspect), viewSettings);
+			// The first view is in the bottom left corner
+			const std::size_t firstX = (view % columns) * viewSettings.width;
+			const std::size_t firstY = (view / columns) * viewSettings.height;
+			for (unsigned int y = 0; y < viewSettings.height; y++)
+			{
+				std::copy_n(&image[(std::size_t)y * viewSettings.width], viewSettings.width, &quilt[(firstY + y) * settings.width + firstX]);
+			}
+		}
+		return quilt;
+	}
+
+	Camera viewCamera(const Camera& camera, int view, int viewCount, float aspect)
+	{
+		// Like generateChaRay
+		const float S = 0.5f * camera.focusDistance * std::tan(camera.viewCone);
+		const float invTanFov = camera.proj[1][1];
+		// A single view looks from the center
+		float ttt = viewCount > 1 ? view / (viewCount - 1.f) : 0.5f;
+		float s = S - 2 * ttt * S;
+		Camera shifted = camera;
+		shifted.lookingGlass = false;
+		shifted.view[3][0] += s;
+		shifted.proj[2][0] += s / (camera.focusDistance * aspect * (1 / invTanFov));
+		return shifted;
+	}
+
+	std::vector<unsigned char> toRgb8(std::span<const glm::vec3> image, unsigned int width, unsigned int height)
+	{
+		std::vector<unsigned char> result((std::size_t)width * height * 3);
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++)
+			{
+				// gamma correction
+				glm::vec3 color = glm::pow(glm::clamp(image[(std::size_t)y * width + x], 0.f, 1.f), glm::vec3(1.0f / 2.2f));
+				unsigned char* out = &result[((std::size_t)(height - 1 - y) * width + x) * 3];
+				for (int c = 0; c < 3; c++)
+				{
+					out[c] = (unsigned char)std::round(color[c] * 255.f);
+				}
+			}
+		}
+		return result;
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include "../PrecompiledHeaders.hpp"
+#include <span>
+#include <vector>
+#include "./SceneObjects.h"
+#include "./Bvh.h"
+#include "../Calibration/Calibration.h"
+
+/**
+* Multithreaded CPU port of the path tracer in fragment.frag. It reads the same arrays the shader gets in its buffers
+* and traverses the same packed BVH, so its images can be compared with the GPU output, also on machines without a GPU.
+*/
+namespace CpuRenderer
+{
+	// RGBA8 image as it is stored in the GL texture
+	struct Texture
+	{
+		int width = 0;
+		int height = 0;
+		// Decoded to linear colors when sampled, like the GL_SRGB* formats
+		bool srgb = true;
+		std::vector<unsigned char> pixels;
+	};
+
+	struct Scene
+	{
+		// Contents of the BVH buffer with the properties the shader is compiled with
+		std::span<const BVHPackedNode> bvh;
+		unsigned int bvhWidth = 2;
+		unsigned int quantizationBits = 0;
+		unsigned int traversalStackSize = 0;
+		bool twoLevel = false;
+		// Slot of the top-level root with twoLevel
+		GLuint topLevelRoot = BVHNode::InvalidMask;
+		bool indexedPositions = false;
+		// Filled without indexedPositions
+		std::span<const FastTriangleSecondHalf> trianglesSecond;
+		// Filled with indexedPositions
+		std::span<const IndexedTriangle> trianglesIndexed;
+		std::span<const glm::vec3> vertexPositions;
+		std::span<const float> vertexAttrs;
+		std::span<const SceneObject> objects;
+		// Textured materials hold an index into textures instead of a bindless handle
+		std::span<const Material> materials;
+		std::span<const Texture> textures;
+		std::span<const Light> lights;
+		// Applied to the vertex normals of a single-level BVH scene
+		glm::mat3 sceneNormalMatrix = glm::mat3(1.f);
+	};
+
+	// The uniforms of fragment.frag
+	struct Camera
+	{
+		glm::mat4 view;
+		glm::mat4 proj;
+		bool lookingGlass = false;
+		Calibration::ForShader calibration;
+		// Radians
+		float viewCone;
+		float focusDistance;
+	};
+
+	struct Settings
+	{
+		unsigned int width;
+		unsigned int height;
+		// Path tracing iterations after the primary ray. Without them the image holds the primary ray shading
+		unsigned int iterations = 30;
+		unsigned int maxBounces = 3;
+		float rayOffset = 1e-5f;
+		bool backfaceCulling = true;
+		unsigned int tileSize = 16;
+		// Camera rays of the single-level binary BVH are traced in SIMD packets of RayPacket::NativeWidth rays
+		bool rayPackets = true;
+	};
+
+	/**
+	* Traces every pixel like the fragment shader. Looking Glass pixels trace each subpixel with its own ray.
+	* The result is the average of the iterations in linear colors, rows from the bottom like in GL.
+	* The shader scales its accumulated sum on the screen differently in each mode, so compare with the GPU output only after normalizing.
+	*/
+	std::vector<glm::vec3> render(const Scene& scene, const Camera& camera, const Settings& settings);
+	/**
+	* Renders columns * rows views of the Looking Glass into a quilt of settings.width * settings.height pixels.
+	* Every view is traced with a flat camera, the first one in the bottom left corner
+	*/
+	std::vector<glm::vec3> renderQuilt(const Scene& scene, const Camera& camera, const Settings& settings, unsigned int columns, unsigned int rows);
+	// Number of views of the Looking Glass, named like in fragment.frag
+	const int Tile = 45;
+	// Flat camera of one of viewCount Looking Glass views. The aspect ratio is the one of the view
+	Camera viewCamera(const Camera& camera, int view, int viewCount, float aspect);
+	// Gamma-corrected RGB rows from the top, as image files store them
+	std::vector<unsigned char> toRgb8(std::span<const glm::vec3> image, unsigned int width, unsigned int height);
+}
@@ -0,0 +1,319 @@
+#pragma once
+#include "../PrecompiledHeaders.hpp"
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include "./CpuRenderer.h"
+
+/**
+* Traverses the stackless binary BVH with packets of coherent rays, one ray per SIMD lane.
+* The packet visits the nodes in the order of the threaded next pointers and descends into a node when any active ray hits it.
+* The width is a template parameter: 4 lanes use SSE, 8 lanes AVX and 16 lanes AVX-512, when the compiler targets them.
+*/
+namespace RayPacket
+{
+	// Operations on W floats. Masks have all bits of a lane set, or one bit per lane with AVX-512
+	template<unsigned W>
+	struct Lanes;
+
+	template<>
+	struct Lanes<4>
+	{
+		using Float = __m128;
+		using Mask = __m128;
+
+		static Float set1(float value) { return _mm_set1_ps(value); }
+		static Float setBits(uint32_t bits) { return _mm_castsi128_ps(_mm_set1_epi32((int)bits)); }
+		static Float load(const float* values) { return _mm_load_ps(values); }
+		static void store(float* values, Float v) { _mm_store_ps(values, v); }
+		static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm_max_ps(a, b); }
+		static Float bitXor(Float a, Float b) { return _mm_xor_ps(a, b); }
+		static Float bitAnd(Float a, Float b) { return _mm_and_ps(a, b); }
+		static Mask less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+		static Mask lessEqual(Float a, Float b) { return _mm_cmple_ps(a, b); }
+		static Mask greaterEqual(Float a, Float b) { return _mm_cmpge_ps(a, b); }
+		static Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+		// a and not b
+		static Mask except(Mask a, Mask b) { return _mm_andnot_ps(b, a); }
+		static int bits(Mask m) { return _mm_movemask_ps(m); }
+		// Lanes of a where the mask is set, b elsewhere
+		static Float select(Mask m, Float a, Float b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	};
+
+#ifdef __AVX__
+	template<>
+	struct Lanes<8>
+	{
+		using Float = __m256;
+		using Mask = __m256;
+
+		static Float set1(float value) { return _mm256_set1_ps(value); }
+		static Float setBits(uint32_t bits) { return _mm256_castsi256_ps(_mm256_set1_epi32((int)bits)); }
+		static Float load(const float* values) { return _mm256_load_ps(values); }
+		static void store(float* values, Float v) { _mm256_store_ps(values, v); }
+		static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm256_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm256_max_ps(a, b); }
+		static Float bitXor(Float a, Float b) { return _mm256_xor_ps(a, b); }
+		static Float bitAnd(Float a, Float b) { return _mm256_and_ps(a, b); }
+		static Mask less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+		static Mask lessEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+		static Mask greaterEqual(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+		static Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+		static Mask except(Mask a, Mask b) { return _mm256_andnot_ps(b, a); }
+		static int bits(Mask m) { return _mm256_movemask_ps(m); }
+		static Float select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+	};
+#endif
+
+#ifdef __AVX512F__
+	template<>
+	struct Lanes<16>
+	{
+		using Float = __m512;
+		using Mask = __mmask16;
+
+		static Float set1(float value) { return _mm512_set1_ps(value); }
+		static Float setBits(uint32_t bits) { return _mm512_castsi512_ps(_mm512_set1_epi32((int)bits)); }
+		static Float load(const float* values) { return _mm512_load_ps(values); }
+		static void store(float* values, Float v) { _mm512_store_ps(values, v); }
+		static Float add(Float a, Float b) { return _mm512_add_ps(a, b); }
+		static Float sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+		static Float mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+		static Float div(Float a, Float b) { return _mm512_div_ps(a, b); }
+		static Float min(Float a, Float b) { return _mm512_min_ps(a, b); }
+		static Float max(Float a, Float b) { return _mm512_max_ps(a, b); }
+		// The float bitwise operations need AVX-512DQ
+		static Float bitXor(Float a, Float b) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+		static Float bitAnd(Float a, Float b) { return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+		static Mask less(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+		static Mask lessEqual(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+		static Mask greaterEqual(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+		static Mask both(Mask a, Mask b) { return a & b; }
+		static Mask except(Mask a, Mask b) { return a & ~b; }
+		static int bits(Mask m) { return (int)m; }
+		static Float select(Mask m, Float a, Float b) { return _mm512_mask_blend_ps(m, b, a); }
+	};
+#endif
+
+	// Closer hits are ignored, like in fragment.frag
+	constexpr float TNear = 0.01f;
+
+	// Widest packet the compiler targets
+#if defined(__AVX512F__)
+	constexpr unsigned NativeWidth = 16;
+#elif defined(__AVX__)
+	constexpr unsigned NativeWidth = 8;
+#else
+	constexpr unsigned NativeWidth = 4;
+#endif
+
+	/**
+	* Rays in structure-of-arrays layout, with their closest hits after findClosestHits()
+	*/
+	template<unsigned W>
+	struct Packet
+	{
+		alignas(64) float originX[W];
+		alignas(64) float originY[W];
+		alignas(64) float originZ[W];
+		alignas(64) float directionX[W];
+		alignas(64) float directionY[W];
+		alignas(64) float directionZ[W];
+		// The far plane before the traversal, the closest hit distance after it
+		alignas(64) float t[W];
+		alignas(64) float u[W] = {};
+		alignas(64) float v[W] = {};
+		// Normalized geometric normal of the hit triangle
+		alignas(64) float normalX[W] = {};
+		alignas(64) float normalY[W] = {};
+		alignas(64) float normalZ[W] = {};
+		// Index of the hit triangle. Valid only when t is closer than the far plane
+		alignas(64) uint32_t triangle[W] = {};
+		// Bit per lane which holds a ray
+		int active = (1 << W) - 1;
+
+		void setRay(unsigned lane, glm::vec3 origin, glm::vec3 direction, float far)
+		{
+			originX[lane] = origin.x;
+			originY[lane] = origin.y;
+			originZ[lane] = origin.z;
+			directionX[lane] = direction.x;
+			directionY[lane] = direction.y;
+			directionZ[lane] = direction.z;
+			t[lane] = far;
+		}
+	};
+
+	/**
+	* Finds the closest triangle of every active ray like findClosestHit in fragment.frag.
+	* Requires the single-level binary layout. The triangle test is the same as in the shader, lanes without a hit keep their t
+	*/
+	template<unsigned W>
+	void findClosestHits(const CpuRenderer::Scene& scene, bool backfaceCulling, Packet<W>& packet)
+	{
+		using L = Lanes<W>;
+		using Float = typename L::Float;
+		using Mask = typename L::Mask;
+		if (scene.bvh.empty() || packet.active == 0)
+		{
+			return;
+		}
+		// Inactive lanes have nothing closer than 0 to find
+		for (unsigned lane = 0; lane < W; lane++)
+		{
+			if ((packet.active & (1 << lane)) == 0)
+			{
+				packet.t[lane] = 0;
+				packet.directionX[lane] = packet.directionY[lane] = packet.directionZ[lane] = 1;
+			}
+		}
+		const Float originX = L::load(packet.originX), originY = L::load(packet.originY), originZ = L::load(packet.originZ);
+		const Float directionX = L::load(packet.directionX), directionY = L::load(packet.directionY), directionZ = L::load(packet.directionZ);
+		const Float one = L::set1(1.f);
+		const Float invDirX = L::div(one, directionX), invDirY = L::div(one, directionY), invDirZ = L::div(one, directionZ);
+		const Float zero = L::set1(0.f);
+		const Float signBit = L::set1(-0.f);
+		Float t = L::load(packet.t);
+		Float u = L::load(packet.u);
+		Float v = L::load(packet.v);
+		Float normalX = L::load(packet.normalX), normalY = L::load(packet.normalY), normalZ = L::load(packet.normalZ);
+		Float triangle = L::load(reinterpret_cast<const float*>(packet.triangle));
+
+		auto node = [&](GLuint index)
+			{
+				const BVHPackedNode& packed = scene.bvh[index];
+				return glm::vec4(glm::uintBitsToFloat(packed.a), glm::uintBitsToFloat(packed.b), glm::uintBitsToFloat(packed.c), glm::uintBitsToFloat(packed.d));
+			};
+		// Slab test. Rays whose closest hit is nearer than the box skip it
+		auto hitsBox = [&](glm::vec3 bboxMin, glm::vec3 bboxMax)
+			{
+				Float t1x = L::mul(L::sub(L::set1(bboxMin.x), originX), invDirX);
+				Float t2x = L::mul(L::sub(L::set1(bboxMax.x), originX), invDirX);
+				Float t1y = L::mul(L::sub(L::set1(bboxMin.y), originY), invDirY);
+				Float t2y = L::mul(L::sub(L::set1(bboxMax.y), originY), invDirY);
+				Float t1z = L::mul(L::sub(L::set1(bboxMin.z), originZ), invDirZ);
+				Float t2z = L::mul(L::sub(L::set1(bboxMax.z), originZ), invDirZ);
+				Float tmin = L::max(L::min(t1x, t2x), L::max(L::min(t1y, t2y), L::min(t1z, t2z)));
+				Float tmax = L::min(L::max(t1x, t2x), L::min(L::max(t1y, t2y), L::max(t1z, t2z)));
+				int missed = L::bits(L::less(tmax, zero)) | L::bits(L::less(tmax, tmin)) | L::bits(L::less(t, tmin));
+				return (packet.active & ~missed) != 0;
+			};
+		// embreeIntersect of fragment.frag for all the rays at once
+		auto intersect = [&](GLuint index, glm::vec3 v0, glm::vec3 edgeA, glm::vec3 edgeB)
+			{
+				glm::vec3 normal = glm::cross(edgeA, edgeB);
+				Float nX = L::set1(normal.x), nY = L::set1(normal.y), nZ = L::set1(normal.z);
+				Float den = L::add(L::add(L::mul(nX, directionX), L::mul(nY, directionY)), L::mul(nZ, directionZ));
+				Float sgnDen = L::bitAnd(den, signBit);
+				Float absDen = L::bitXor(den, sgnDen);
+				Mask valid = backfaceCulling
+					? L::greaterEqual(den, L::set1(0.001f))
+					: L::greaterEqual(absDen, L::set1(0.001f));
+				if (L::bits(valid) == 0)
+				{
+					return;
+				}
+				Float cX = L::sub(L::set1(v0.x), originX), cY = L::sub(L::set1(v0.y), originY), cZ = L::sub(L::set1(v0.z), originZ);
+				// R = cross(direction, C)
+				Float rX = L::sub(L::mul(directionY, cZ), L::mul(cY, directionZ));
+				Float rY = L::sub(L::mul(directionZ, cX), L::mul(cZ, directionX));
+				Float rZ = L::sub(L::mul(directionX, cY), L::mul(cX, directionY));
+				// The shader swaps the edges for the edge tests
+				Float U = L::bitXor(L::add(L::add(L::mul(rX, L::set1(edgeA.x)), L::mul(rY, L::set1(edgeA.y))), L::mul(rZ, L::set1(edgeA.z))), sgnDen);
+				Float V = L::bitXor(L::add(L::add(L::mul(rX, L::set1(edgeB.x)), L::mul(rY, L::set1(edgeB.y))), L::mul(rZ, L::set1(edgeB.z))), sgnDen);
+				valid = L::except(L::except(valid, L::less(U, zero)), L::less(V, zero));
+				valid = L::except(valid, L::less(absDen, L::add(U, V)));
+				Float invDen = L::div(one, absDen);
+				Float newT = L::mul(L::bitXor(L::add(L::add(L::mul(nX, cX), L::mul(nY, cY)), L::mul(nZ, cZ)), sgnDen), invDen);
+				valid = L::both(valid, L::both(L::greaterEqual(newT, L::set1(TNear)), L::less(newT, t)));
+				if (L::bits(valid) == 0)
+				{
+					return;
+				}
+				glm::vec3 unitNormal = glm::normalize(normal);
+				t = L::select(valid, newT, t);
+				u = L::select(valid, L::mul(U, invDen), u);
+				v = L::select(valid, L::mul(V, invDen), v);
+				normalX = L::select(valid, L::set1(unitNormal.x), normalX);
+				normalY = L::select(valid, L::set1(unitNormal.y), normalY);
+				normalZ = L::select(valid, L::set1(unitNormal.z), normalZ);
+				triangle = L::select(valid, L::setBits(index), triangle);
+			};
+		auto intersectIndexed = [&](GLuint index)
+			{
+				const IndexedTriangle& indexed = scene.trianglesIndexed[index];
+				GLuint firstVertex = scene.objects[indexed.objectIndex].positionPointer;
+				glm::vec3 v0 = scene.vertexPositions[firstVertex + indexed.indices.x];
+				glm::vec3 v1 = scene.vertexPositions[firstVertex + indexed.indices.y];
+				glm::vec3 v2 = scene.vertexPositions[firstVertex + indexed.indices.z];
+				intersect(index, v0, v0 - v1, v2 - v0);
+			};
+
+		GLuint nodeIndex = 0;
+		const GLuint lastNode = (GLuint)scene.bvh.size();
+		while (nodeIndex < lastNode)
+		{
+			glm::vec4 bboxMin = node(nodeIndex * 2);
+			glm::vec4 bboxMax = node(nodeIndex * 2 + 1);
+			GLuint primitiveIndex = glm::floatBitsToUint(bboxMin.w);
+			bool isLeaf = primitiveIndex != BVHNode::InvalidMask;
+			if (isLeaf && (primitiveIndex & BVHNode::LeafMask) != 0)
+			{
+				// Multi-triangle leaf. Its bounds are followed by the triangles
+				if (hitsBox(glm::vec3(bboxMin), glm::vec3(bboxMax)))
+				{
+					const GLuint first = (nodeIndex + 1) * 2;
+					const GLuint count = primitiveIndex & ~BVHNode::LeafMask;
+					for (GLuint i = 0; i < count; i++)
+					{
+						if (scene.indexedPositions)
+						{
+							const BVHPackedNode& indices = scene.bvh[first + i / 4];
+							intersectIndexed((&indices.a)[i % 4]);
+						}
+						else
+						{
+							glm::vec4 v0 = node(first + i * 2);
+							GLuint index = glm::floatBitsToUint(v0.w);
+							intersect(index, glm::vec3(v0), glm::vec3(node(first + i * 2 + 1)), scene.trianglesSecond[index].edgeB);
+						}
+					}
+				}
+			}
+			else if (isLeaf)
+			{
+				if (scene.indexedPositions)
+				{
+					intersectIndexed(primitiveIndex);
+				}
+				else
+				{
+					intersect(primitiveIndex, glm::vec3(bboxMin), glm::vec3(bboxMax), scene.trianglesSecond[primitiveIndex].edgeB);
+				}
+			}
+			else if (hitsBox(glm::vec3(bboxMin), glm::vec3(bboxMax)))
+			{
+				++nodeIndex;
+				continue;
+			}
+			nodeIndex = glm::floatBitsToUint(bboxMax.w);
+		}
+
+		L::store(packet.t, t);
+		L::store(packet.u, u);
+		L::store(packet.v, v);
+		L::store(packet.normalX, normalX);
+		L::store(packet.normalY, normalY);
+		L::store(packet.normalZ, normalZ);
+		L::store(reinterpret_cast<float*>(packet.triangle), triangle);
+	}
+}
@@ -1,8 +1,10 @@
 #pragma once
+#include <atomic>
 #include <filesystem>
 #include <assimp/vector3.h>
 #include "../FirstPersonController.h"
 #include "../Calibration/Calibration.h"
+#include "Bvh.h"
 
 inline bool wasOverridePowerSave;
 
@@ -20,17 +22,48 @@ namespace SceneAndViewSettings {
 		Flat = 0, LookingGlass = 1
 	} GlobalScreenType;
 	inline bool applyScreenType = false;
+	// The Looking Glass views are rendered into a quilt with one pinhole camera per tile, which is then interleaved for the display
+	inline bool quiltRendering = false;
+	inline unsigned int quiltColumns = 5;
+	inline unsigned int quiltRows = 9;
+	inline unsigned int quiltWidth = 4096;
+	inline unsigned int quiltHeight = 4096;
+	// GL_MAX_TEXTURE_SIZE of the render window, which bounds the quilt size. OpenGL 4.5 guarantees at least 16384
+	inline unsigned int maxTextureSize = 16384;
 
 	// Read by render job and executed once. Then set to false
 	inline bool recompileFShaders = false;
 	inline bool reloadScene = false;
+	// Renders the view on the CPU once and saves the image
+	inline bool renderOnCpu = false;
+	// Saves the current quilt to an image
+	inline bool saveQuilt = false;
+	// Written by the scene loading thread
+	enum class LoadingPhase {
+		Idle = 0, Import, Textures, Meshes, BVH, Upload
+	};
+	inline std::atomic<LoadingPhase> loadingPhase = LoadingPhase::Idle;
+	// Progress of the current phase from 0 to 1. Negative when it is unknown
+	inline std::atomic<float> loadingProgress = -1.f;
+	inline void setLoadingPhase(LoadingPhase phase)
+	{
+		loadingProgress = -1.f;
+		loadingPhase = phase;
+	}
+	// Stores the loaded scene with its BVH on disk and loads it from there while the file and the settings which affect it stay the same
+	inline bool sceneCache = true;
+	// Kilobytes of texture data uploaded per frame while a loaded scene's textures arrive
+	inline unsigned int textureUploadBudget = 16384;
+	// Applies the scene transform without reloading. Rebuilds the top level of the two-level BVH or refits the single-level one
+	inline bool updateSceneTransform = false;
 	inline struct {
 		std::filesystem::path path = "";
 		aiVector3D scale = { 10,10,10 };
 		aiVector3D position;
 		aiVector3D rotationDeg;
 	} scene;
-	inline int objectCountLimit = 10;
+	// The object buffer is sized by the scene, so this only limits the loaded meshes for debugging
+	inline int objectCountLimit = 1000000;
 	inline GLenum debugOutput = GL_DEBUG_SEVERITY_LOW;
 	inline bool pathTracing = false;
 	inline std::size_t rayIteration = 0;
@@ -45,6 +78,20 @@ namespace SceneAndViewSettings {
 	inline bool skyLight = false;
 	inline bool visualizeBVH;
 	inline unsigned int bvhSAHthreshold = 1000000;
+	inline BVHBuilder::SplitMethod bvhSplitMethod = BVHBuilder::SplitMethod::BinnedSAH;
+	inline unsigned int bvhBinCount = 16;
+	inline BVHBuilder::LargeNodeSplit bvhLargeNodeSplit = BVHBuilder::LargeNodeSplit::Morton;
+	inline unsigned int bvhThreads = std::thread::hardware_concurrency();
+	inline unsigned int bvhMaxLeafSize = 4;
+	// Bottom-level BVH per mesh and a top-level BVH over the instances
+	inline bool bvhTwoLevel = true;
+	// Triangles refer to a shared vertex position buffer instead of storing their vertices. Saves memory on meshes with many shared vertices,
+	// but the shader has to gather the positions
+	inline bool indexedPositions = false;
+	inline bool bvhSpatialSplits = false;
+	inline float bvhSpatialSplitBudget = 0.3f;
+	inline BVHBuilder::Layout bvhLayout = BVHBuilder::Layout::Binary;
+	inline BVHBuilder::Quantization bvhQuantization = BVHBuilder::Quantization::None;
 	inline unsigned int bvhDebugIterationsMask = 0x3;
 	inline float bvhEdgeWidth = 0.3f;
 
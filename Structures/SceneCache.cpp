@@ -0,0 +1,216 @@
+#include "SceneCache.h"
+#include <cstdio>
+#include <fstream>
+#ifdef WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	uint64_t alignUp(uint64_t value)
+	{
+		return (value + SceneCache::SectionAlignment - 1) / SceneCache::SectionAlignment * SceneCache::SectionAlignment;
+	}
+}
+
+namespace SceneCache
+{
+	uint64_t hash(std::string_view data)
+	{
+		uint64_t result = 14695981039346656037ull;
+		for (char c : data)
+		{
+			result ^= (unsigned char)c;
+			result *= 1099511628211ull;
+		}
+		return result;
+	}
+
+	std::filesystem::path fileFor(const std::string& key)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx.lgptcache", (unsigned long long)hash(key));
+		return std::filesystem::temp_directory_path() / "LookingGlassPT" / name;
+	}
+
+	Writer::Writer(std::string key) : m_key(std::move(key))
+	{
+	}
+
+	bool Writer::save(const std::filesystem::path& file) const
+	{
+		std::error_code error;
+		std::filesystem::create_directories(file.parent_path(), error);
+		std::filesystem::path temporary = file;
+		temporary += ".tmp";
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			if (!out)
+			{
+				return false;
+			}
+
+			FileHeader header;
+			std::memcpy(header.magic, Magic, sizeof(Magic));
+			header.version = Version;
+			header.sectionCount = (uint32_t)m_sections.size();
+			header.keySize = m_key.size();
+
+			std::vector<SectionEntry> entries;
+			uint64_t offset = alignUp(sizeof(FileHeader) + m_key.size() + m_sections.size() * sizeof(SectionEntry));
+			for (const auto& section : m_sections)
+			{
+				entries.push_back({ offset, section.size() });
+				offset = alignUp(offset + section.size());
+			}
+
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(m_key.data(), m_key.size());
+			out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(SectionEntry));
+			for (std::size_t i = 0; i < m_sections.size(); i++)
+			{
+				out.seekp(entries[i].offset);
+				out.write(m_sections[i].data(), m_sections[i].size());
+			}
+			// Pad the last section so every section can be mapped whole
+			out.seekp(offset - 1);
+			out.put(0);
+			if (!out)
+			{
+				return false;
+			}
+		}
+		std::filesystem::rename(temporary, file, error);
+		return !error;
+	}
+
+	Reader::~Reader()
+	{
+		close();
+	}
+
+	bool Reader::map(const std::filesystem::path& file)
+	{
+#ifdef WIN32
+		m_file = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			m_file = nullptr;
+			return false;
+		}
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+		{
+			return false;
+		}
+		m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr)
+		{
+			return false;
+		}
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+		m_size = (std::size_t)size.QuadPart;
+#else
+		int descriptor = ::open(file.c_str(), O_RDONLY);
+		if (descriptor < 0)
+		{
+			return false;
+		}
+		struct stat status;
+		void* data = MAP_FAILED;
+		if (fstat(descriptor, &status) == 0 && status.st_size > 0)
+		{
+			data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		}
+		// The mapping stays valid without the descriptor
+		::close(descriptor);
+		if (data == MAP_FAILED)
+		{
+			return false;
+		}
+		m_data = static_cast<const char*>(data);
+		m_size = status.st_size;
+#endif
+		return m_data != nullptr;
+	}
+
+	bool Reader::open(const std::filesystem::path& file, const std::string& key)
+	{
+		close();
+		if (!map(file))
+		{
+			close();
+			return false;
+		}
+
+		FileHeader header;
+		if (m_size < sizeof(header))
+		{
+			close();
+			return false;
+		}
+		std::memcpy(&header, m_data, sizeof(header));
+		const uint64_t tableOffset = sizeof(header) + header.keySize;
+		// The file name is only a hash, so compare the whole key
+		if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 || header.version != Version || header.keySize != key.size()
+			|| m_size < tableOffset + header.sectionCount * sizeof(SectionEntry)
+			|| std::memcmp(m_data + sizeof(header), key.data(), key.size()) != 0)
+		{
+			close();
+			return false;
+		}
+		m_sections.resize(header.sectionCount);
+		std::memcpy(m_sections.data(), m_data + tableOffset, m_sections.size() * sizeof(SectionEntry));
+		return true;
+	}
+
+	void Reader::close()
+	{
+#ifdef WIN32
+		if (m_data != nullptr)
+		{
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping != nullptr)
+		{
+			CloseHandle(m_mapping);
+		}
+		if (m_file != nullptr)
+		{
+			CloseHandle(m_file);
+		}
+		m_mapping = nullptr;
+		m_file = nullptr;
+#else
+		if (m_data != nullptr)
+		{
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+#endif
+		m_data = nullptr;
+		m_size = 0;
+		m_sections.clear();
+		m_nextSection = 0;
+	}
+
+	const SectionEntry* Reader::next()
+	{
+		if (m_nextSection >= m_sections.size())
+		{
+			return nullptr;
+		}
+		const SectionEntry* section = &m_sections[m_nextSection++];
+		// A truncated file must not be read past its end
+		if (section->offset > m_size || section->size > m_size - section->offset)
+		{
+			return nullptr;
+		}
+		return section;
+	}
+}
@@ -0,0 +1,153 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/**
+* Binary cache of a loaded scene. The file holds a key and a list of sections. The sections are read back in the order they were written.
+* Every section starts at a page boundary, so the file can be memory-mapped and the sections used in place.
+*/
+namespace SceneCache
+{
+	constexpr char Magic[8] = { 'L', 'G', 'P', 'T', 'S', 'C', 'N', 'C' };
+	// Increment when the layout of any cached structure changes
+	constexpr uint32_t Version = 3;
+	constexpr uint64_t SectionAlignment = 4096;
+
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t sectionCount;
+		uint64_t keySize;
+	};
+
+	struct SectionEntry
+	{
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	// FNV-1a
+	uint64_t hash(std::string_view data);
+	// Where the cache for the key is stored. The file name is the hash of the key
+	std::filesystem::path fileFor(const std::string& key);
+
+	/**
+	* Collects the sections and writes them in save(). Arrays are not copied, so they must stay alive until then
+	*/
+	class Writer
+	{
+	public:
+		explicit Writer(std::string key);
+
+		template<typename T>
+		void add(std::span<const T> items)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			m_sections.push_back({ reinterpret_cast<const char*>(items.data()), items.size_bytes() });
+		}
+
+		template<typename T>
+		void add(const std::vector<T>& items)
+		{
+			add(std::span<const T>(items));
+		}
+
+		// Copies the value
+		template<typename T>
+		void addValue(const T& item)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			const std::string& copy = m_values.emplace_back(reinterpret_cast<const char*>(&item), sizeof(T));
+			m_sections.push_back({ copy.data(), copy.size() });
+		}
+
+		// Writes to a temporary file first, so a failed save never leaves a broken cache behind
+		bool save(const std::filesystem::path& file) const;
+
+	private:
+		std::string m_key;
+		std::vector<std::span<const char>> m_sections;
+		std::deque<std::string> m_values;
+	};
+
+	/**
+	* Maps the whole file into memory. Sections can be viewed in place while the reader stays open
+	*/
+	class Reader
+	{
+	public:
+		Reader() = default;
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+		~Reader();
+
+		// Returns false when there is no cache for the key or it was written by another version
+		bool open(const std::filesystem::path& file, const std::string& key);
+		void close();
+		bool isOpen() const
+		{
+			return m_data != nullptr;
+		}
+
+		// Gives the next section without copying it. Returns false when it does not exist or does not consist of whole items
+		template<typename T>
+		bool view(std::span<const T>& items)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+			const SectionEntry* section = next();
+			if (section == nullptr || section->size % sizeof(T) != 0)
+			{
+				return false;
+			}
+			// Sections are page aligned, so the cast keeps the alignment of T
+			items = std::span<const T>(reinterpret_cast<const T*>(m_data + section->offset), section->size / sizeof(T));
+			return true;
+		}
+
+		// Copies the next section
+		template<typename T>
+		bool read(std::vector<T>& items)
+		{
+			std::span<const T> mapped;
+			if (!view(mapped))
+			{
+				return false;
+			}
+			items.assign(mapped.begin(), mapped.end());
+			return true;
+		}
+
+		template<typename T>
+		bool readValue(T& item)
+		{
+			std::span<const T> mapped;
+			if (!view(mapped) || mapped.size() != 1)
+			{
+				return false;
+			}
+			item = mapped[0];
+			return true;
+		}
+
+	private:
+		const char* m_data = nullptr;
+		std::size_t m_size = 0;
+#ifdef WIN32
+		void* m_file = nullptr;
+		void* m_mapping = nullptr;
+#endif
+		std::vector<SectionEntry> m_sections;
+		std::size_t m_nextSection = 0;
+
+		bool map(const std::filesystem::path& file);
+		const SectionEntry* next();
+	};
+}
@@ -4,6 +4,8 @@
 #include <bitset>
 #include <type_traits>
 #include <sstream>
+#include <span>
+#include <vector>
 
 inline std::string debugArray(const char* data, size_t len, bool fl) {
 	std::stringstream out;
@@ -93,10 +95,7 @@ struct Material {
 	Material(glm::uint64 handle)
 	{
 		isTexture = 1u;
-		this->colorOrHandle = glm::vec3(
-			glm::uintBitsToFloat((handle >> 32u) & 0xFFFFFFFFu),
-			glm::uintBitsToFloat(handle & 0xFFFFFFFFu), 0.f
-		);
+		this->colorOrHandle = packHandle(handle);
 	}
 
 	Material(glm::vec3 color)
@@ -113,11 +112,21 @@ struct Material {
 	void setEmissive(glm::uint64 handle)
 	{
 		isTexture |= 1u << 1u;
-		this->emissive = glm::vec3(
+		this->emissive = packHandle(handle);
+	}
+
+	static glm::vec3 packHandle(glm::uint64 handle)
+	{
+		return glm::vec3(
 			glm::uintBitsToFloat((handle >> 32u) & 0xFFFFFFFFu),
 			glm::uintBitsToFloat(handle & 0xFFFFFFFFu), 0.f
 		);
 	}
+
+	static glm::uint64 unpackHandle(glm::vec3 packed)
+	{
+		return ((glm::uint64)glm::floatBitsToUint(packed.x) << 32u) | glm::floatBitsToUint(packed.y);
+	}
 };
 
 template<uint32_t... Items>
@@ -180,6 +189,8 @@ struct SceneObject {
 	uint32_t attrBufferPointer;
 	uint32_t vertexAttrsMask;
 	uint32_t totalAttrSize;
+	// First vertex of the object in the position buffer of indexed triangles
+	uint32_t positionPointer = 0;
 
 	SceneObject(
 		uint32_t material,
@@ -210,160 +221,37 @@ struct SceneObject {
 	}
 };
 
-class anySized
+/**
+* Vertex attributes of all the objects in one float array. The attributes of a vertex are interleaved
+* in the order of SceneObject::vertexAttrsMask bits. The ranges of all the meshes are allocated at once and the meshes fill them in place.
+*/
+class AttributeArena
 {
 public:
-	std::byte* data = nullptr;
-	std::size_t size = 0;
-	const std::type_info& type;
-	template <typename T>
-	anySized(T&& item) :
-		size(sizeof(T)),
-		type(typeid(T))
-	{
-		data = new std::byte[size];
-		std::memcpy(data, &item, size);
-	}
-	anySized(const anySized& other) = delete;
-	/* :
-		type(other.type)
-	{
-		size = other.size;;
-		data = new std::byte[size];
-		std::memcpy(data, other.data, size);
-	}*/
-	~anySized()
-	{
-		if (data != nullptr)
-		{
-			delete[] data;
-		}
-	}
-};
-
-// https://stackoverflow.com/a/49730915
-class anyVector
-{
-	struct typeInfo
-	{
-		std::size_t size;
-		const std::type_info& type;
-	};
-public:
-	std::vector<typeInfo> types;
-	std::size_t totalSize = 0;
-	std::stringstream buffer;
-
-public:
-	void push(const anySized&& item) {
-		totalSize += item.size;
-		types.push_back({ item.size, item.type });
-		buffer.write(
-			reinterpret_cast<const char*>(item.data),
-			item.size
-		);
-	}
-
-	void push(const anySized& item) {
-		totalSize += item.size;
-		types.push_back({ item.size, item.type });
-		buffer.write(
-			reinterpret_cast<const char*>(item.data),
-			item.size
-		);
-	}
-
-	void push(const std::initializer_list<anySized>&& items)
-	{
-		for (auto&& item : items)
-		{
-			this->push(item);
-		}
-	}
+	std::vector<float> data;
 
-	/**
-	* Pushes a value into the buffer and increnets a counter by the value's size
-	*/
-	template<typename CounterT>
-	void push(const anySized&& item, CounterT& counter) {
-		totalSize += item.size;
-		counter += item.size;
-		types.push_back({ item.size, item.type });
-		buffer.write(
-			reinterpret_cast<const char*>(item.data),
-			item.size
-		);
-	}
-
-	void clear()
+	// Appends count floats and returns the first one. The pointer is valid until the next allocation
+	float* allocate(std::size_t count)
 	{
-		types.clear();
-		buffer.str("");
-		buffer.clear();
-		totalSize = 0;
+		std::size_t offset = data.size();
+		data.resize(offset + count);
+		return data.data() + offset;
 	}
 
-	anyVector(std::initializer_list<anySized>&& items)
+	// Number of floats
+	std::size_t size() const
 	{
-		for (auto&& item : items)
-		{
-			totalSize += item.size;
-			types.push_back({ item.size, item.type });
-			buffer.write(
-				reinterpret_cast<const char*>(item.data),
-				item.size
-			);
-		}
+		return data.size();
 	}
-	anyVector()
-	{
 
-	}
-
-	std::stringstream debug(bool fl = false)
+	std::span<const char> bytes() const
 	{
-		std::stringstream s;
-		std::size_t i = 0;
-		std::size_t offset = 0;
-		for (auto& type : types)
-		{
-			s << i << ": " << type.type.name() << std::endl;
-			s << debugArray(buffer.view().data() + offset, type.size, fl) << std::endl;
-			//s << ((Printable*)buffer.view().substr(offset, type.size).data())->to_print().rdbuf();
-			s << "(" << type.size << " bytes)" << std::endl;
-			i++;
-			offset += type.size;
-		}
-		s << std::endl;
-		return s;
+		return std::span<const char>(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
 	}
 
-	std::stringstream debug(std::initializer_list<std::pair<std::size_t, bool>> subSizes)
+	void clear()
 	{
-		std::stringstream s;
-		std::size_t i = 0;
-		std::size_t offset = 0;
-		for (auto& type : types)
-		{
-			s << i << ": " << type.type.name() << std::endl;
-			std::size_t subOffset = 0;
-			for (auto& subItem : subSizes)
-			{
-				s << "subitem at " << subOffset << " of size " << subItem.first << std::endl;
-				s << debugArray(buffer.view().data() + offset + subOffset, subItem.first, subItem.second) << std::endl;
-				subOffset += subItem.first;
-			}
-			if (subOffset != type.size)
-			{
-				s << "remaining:\n";
-			}
-			s << debugArray(buffer.view().data() + offset + subOffset, type.size - subOffset, false) << std::endl;
-			s << "(" << type.size << " bytes)" << std::endl;
-			i++;
-			offset += type.size;
-		}
-		s << std::endl;
-		return s;
+		data.clear();
 	}
 };
 
@@ -379,6 +267,12 @@ struct FastTriangleSecondHalf {
 	uint32_t objectIndex;
 };
 
+// What the shader gets instead of FastTriangleSecondHalf when the vertex positions are indexed
+struct IndexedTriangle {
+	glm::uvec3 indices;
+	uint32_t objectIndex;
+};
+
 /// https://github.com/embree/embree/blob/master/kernels/geometry/triangle.h combined with BVH purposes
 struct FastTriangle {
 	glm::vec3 v0;
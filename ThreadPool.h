@@ -0,0 +1,196 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+* Fixed set of worker threads executing queued tasks.
+* A thread which waits for a task result through wait() executes other queued tasks of its batch in the meantime,
+* so tasks can spawn subtasks and wait for them without exhausting the pool.
+* A batch holds the tasks submitted by one outside thread and the subtasks they spawn, so a thread waiting for its own work
+* does not pick up long tasks of another one.
+*/
+class ThreadPool
+{
+public:
+	// The calling thread also helps when waiting, so the pool spawns one thread less
+	explicit ThreadPool(unsigned int threadCount = std::thread::hardware_concurrency())
+	{
+		threadCount = std::max(threadCount, 1u);
+		for (unsigned int i = 1; i < threadCount; i++)
+		{
+			workers.emplace_back([this] { workerLoop(); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock lock(queueMutex);
+			stopping = true;
+		}
+		wakeUp.notify_all();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	// Number of threads which execute tasks (including the waiting one)
+	unsigned int size() const
+	{
+		return (unsigned int)workers.size() + 1;
+	}
+
+	template<typename F>
+	auto submit(F&& task) -> std::future<std::invoke_result_t<F>>
+	{
+		using ResultT = std::invoke_result_t<F>;
+		auto packaged = std::make_shared<std::packaged_task<ResultT()>>(std::forward<F>(task));
+		auto future = packaged->get_future();
+		if (workers.empty())
+		{
+			// Nobody would execute the task otherwise
+			(*packaged)();
+			return future;
+		}
+		if (currentBatch == 0)
+		{
+			currentBatch = nextBatch++;
+		}
+		{
+			std::unique_lock lock(queueMutex);
+			queue.push_back({ currentBatch, [packaged] { (*packaged)(); } });
+		}
+		wakeUp.notify_one();
+		progress.notify_all();
+		return future;
+	}
+
+	// Executes other queued tasks of the calling thread's batch until the result is ready
+	template<typename T>
+	T wait(std::future<T>& future)
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock lock(queueMutex);
+				auto own = queue.end();
+				progress.wait(lock, [&] {
+					own = std::find_if(queue.begin(), queue.end(), [](const Task& queued) { return queued.batch == currentBatch; });
+					return own != queue.end() || future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+					});
+				if (own == queue.end())
+				{
+					break;
+				}
+				task = std::move(own->run);
+				queue.erase(own);
+			}
+			runTask(task);
+		}
+		return future.get();
+	}
+
+	/**
+	* Calls function(i) for every i in [begin, end). The range is split into chunks of at least grainSize items.
+	* Returns after all the items are processed.
+	*/
+	template<typename F>
+	void parallelFor(std::size_t begin, std::size_t end, std::size_t grainSize, F&& function)
+	{
+		if (end <= begin)
+		{
+			return;
+		}
+		std::size_t chunkSize = std::max(grainSize, (end - begin + size() * 4 - 1) / (size() * 4));
+		std::vector<std::future<void>> chunks;
+		for (std::size_t chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize)
+		{
+			std::size_t chunkEnd = std::min(end, chunkBegin + chunkSize);
+			chunks.push_back(submit([&function, chunkBegin, chunkEnd] {
+				for (std::size_t i = chunkBegin; i < chunkEnd; i++)
+				{
+					function(i);
+				}
+				}));
+		}
+		for (std::size_t i = begin; i < std::min(end, begin + chunkSize); i++)
+		{
+			function(i);
+		}
+		for (auto& chunk : chunks)
+		{
+			wait(chunk);
+		}
+	}
+
+	// Pool for general background work, spanning all the hardware threads
+	static ThreadPool& shared()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	struct Task
+	{
+		std::size_t batch;
+		std::function<void()> run;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<Task> queue;
+	std::mutex queueMutex;
+	std::condition_variable wakeUp;
+	// Signals waiting threads that a task was queued or finished
+	std::condition_variable progress;
+	bool stopping = false;
+
+	// Batch of the task the thread executes. Outside threads get their own batch when they first submit
+	static inline thread_local std::size_t currentBatch = 0;
+	static inline std::atomic<std::size_t> nextBatch = 1;
+
+	// Wakes the threads waiting for the finished task
+	void runTask(const std::function<void()>& task)
+	{
+		task();
+		{
+			std::unique_lock lock(queueMutex);
+		}
+		progress.notify_all();
+	}
+
+	void workerLoop()
+	{
+		while (true)
+		{
+			Task task;
+			{
+				std::unique_lock lock(queueMutex);
+				wakeUp.wait(lock, [this] { return stopping || !queue.empty(); });
+				if (stopping && queue.empty())
+				{
+					return;
+				}
+				task = std::move(queue.front());
+				queue.pop_front();
+			}
+			currentBatch = task.batch;
+			runTask(task.run);
+			currentBatch = 0;
+		}
+	}
+};
@@ -13,6 +13,17 @@ AppWindow::AppWindow(const char* name, float x, float y, float w, float h)
 	assert(window);
 }
 
+AppWindow::AppWindow(float w, float h)
+{
+	windowWidth = w;
+	windowHeight = h;
+	windowPosX = 0;
+	windowPosY = 0;
+	windowID = 0;
+	pixelScale = 1;
+	hidden = true;
+}
+
 // Runs on the render thread
 void AppWindow::setupGL()
 {
@@ -145,6 +156,11 @@ void AppWindow::show()
 
 AppWindow::~AppWindow()
 {
+	if (window == nullptr)
+	{
+		// Headless
+		return;
+	}
 	ImGui::SetCurrentContext(imGuiContext);
 	// Cleanup
 	ImGui_ImplOpenGL3_Shutdown();
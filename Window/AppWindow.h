@@ -10,7 +10,7 @@
 
 class AppWindow {
 public:
-	SDL_Window* window;
+	SDL_Window* window = nullptr;
 	SDL_WindowFlags flags = static_cast<SDL_WindowFlags>(SDL_WINDOW_RESIZABLE | SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI);
 	SDL_GLContext glContext;
 	ImGuiContext* imGuiContext = nullptr;
@@ -31,6 +31,9 @@ public:
 	// Runs on tha main thread
 	AppWindow(const char* name, float x, float y, float w, float h);
 
+	// Without any SDL window, GL context or ImGui context. Used by the headless render mode
+	AppWindow(float w, float h);
+
 	// Runs on the render thread
 	virtual void setupGL();
 
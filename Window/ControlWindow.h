@@ -191,6 +191,10 @@ public:
 						pathTracingDuration = -1;
 					}
 				}
+				if (ImGui::Button("Save CPU Reference"))
+				{
+					SceneAndViewSettings::renderOnCpu = true;
+				}
 			}
 			ImGui::TreePop();
 		}
@@ -213,6 +217,33 @@ public:
 			{
 				SceneAndViewSettings::recompileFShaders = true;
 			}
+			if (ImGui::Checkbox("Render Quilt", &SceneAndViewSettings::quiltRendering))
+			{
+				// The quilt shader is compiled only when it is used
+				SceneAndViewSettings::recompileFShaders = true;
+			}
+			if (SceneAndViewSettings::quiltRendering)
+			{
+				bool quiltEdited = ImGui::InputScalar("Quilt Columns", ImGuiDataType_U32, &SceneAndViewSettings::quiltColumns, &step);
+				quiltEdited = ImGui::InputScalar("Quilt Rows", ImGuiDataType_U32, &SceneAndViewSettings::quiltRows, &step) || quiltEdited;
+				quiltEdited = ImGui::InputScalar("Quilt Width", ImGuiDataType_U32, &SceneAndViewSettings::quiltWidth, &step, &bigStep) || quiltEdited;
+				quiltEdited = ImGui::InputScalar("Quilt Height", ImGuiDataType_U32, &SceneAndViewSettings::quiltHeight, &step, &bigStep) || quiltEdited;
+				if (quiltEdited)
+				{
+					SceneAndViewSettings::quiltColumns = std::max(SceneAndViewSettings::quiltColumns, 1u);
+					SceneAndViewSettings::quiltRows = std::max(SceneAndViewSettings::quiltRows, 1u);
+					SceneAndViewSettings::quiltColumns = std::min(SceneAndViewSettings::quiltColumns, SceneAndViewSettings::maxTextureSize);
+					SceneAndViewSettings::quiltRows = std::min(SceneAndViewSettings::quiltRows, SceneAndViewSettings::maxTextureSize);
+					SceneAndViewSettings::quiltWidth = std::clamp(SceneAndViewSettings::quiltWidth, SceneAndViewSettings::quiltColumns, SceneAndViewSettings::maxTextureSize);
+					SceneAndViewSettings::quiltHeight = std::clamp(SceneAndViewSettings::quiltHeight, SceneAndViewSettings::quiltRows, SceneAndViewSettings::maxTextureSize);
+					// Recreates the quilt
+					SceneAndViewSettings::applyScreenType = true;
+				}
+				if (ImGui::Button("Save Quilt"))
+				{
+					SceneAndViewSettings::saveQuilt = true;
+				}
+			}
 			ImGui::TreePop();
 		}
 		if (ImGui::RadioButton("Flat", (int*)&SceneAndViewSettings::GlobalScreenType, (int)SceneAndViewSettings::ScreenType::Flat))
@@ -315,6 +346,7 @@ public:
 						scalePower.y = scalePower.z = scalePower.x;
 					}
 					SceneAndViewSettings::scene.scale = GlHelpers::structConvert<aiVector3D, glm::vec3>(glm::pow(glm::vec3(10.f), scalePower));
+					SceneAndViewSettings::updateSceneTransform = true;
 					//std::cout << GlHelpers::aiToGlm(SceneAndViewSettings::scene.scale) << std::endl;
 				}
 			}
@@ -324,12 +356,12 @@ public:
 				const decltype(SceneAndViewSettings::scene.scale.x) max = 100000;
 				if (uniformScale)
 				{
-					ImGui::DragScalar("Scale##Scene", dataType, &SceneAndViewSettings::scene.scale.x, 100.f, &min, &max, "%lf", ImGuiSliderFlags_Logarithmic);
+					SceneAndViewSettings::updateSceneTransform |= ImGui::DragScalar("Scale##Scene", dataType, &SceneAndViewSettings::scene.scale.x, 100.f, &min, &max, "%lf", ImGuiSliderFlags_Logarithmic);
 					SceneAndViewSettings::scene.scale.y = SceneAndViewSettings::scene.scale.z = SceneAndViewSettings::scene.scale.x;
 				}
 				else
 				{
-					ImGui::DragScalarN("Scale##Scene", dataType, &SceneAndViewSettings::scene.scale.x, 3, 100.f, &min, &max, "%f", ImGuiSliderFlags_Logarithmic);
+					SceneAndViewSettings::updateSceneTransform |= ImGui::DragScalarN("Scale##Scene", dataType, &SceneAndViewSettings::scene.scale.x, 3, 100.f, &min, &max, "%f", ImGuiSliderFlags_Logarithmic);
 				}
 			}
 			ImGui::TreePush("Details");
@@ -339,10 +371,10 @@ public:
 			ImGui::TreePop();
 			decltype(SceneAndViewSettings::scene.position.x) min = -10000;
 			decltype(SceneAndViewSettings::scene.position.x) max = -10000;
-			ImGui::DragScalarN("Position##Scene", dataType, &SceneAndViewSettings::scene.position.x, 3, .1f, &min, &max);
+			SceneAndViewSettings::updateSceneTransform |= ImGui::DragScalarN("Position##Scene", dataType, &SceneAndViewSettings::scene.position.x, 3, .1f, &min, &max);
 			min = 0;
 			max = 360 - (dataType == ImGuiDataType_::ImGuiDataType_Float ? FLT_EPSILON : DBL_EPSILON);
-			ImGui::DragScalarN("Rotation (deg)", dataType, &SceneAndViewSettings::scene.rotationDeg.x, 3, .1f, &min, &max);
+			SceneAndViewSettings::updateSceneTransform |= ImGui::DragScalarN("Rotation (deg)", dataType, &SceneAndViewSettings::scene.rotationDeg.x, 3, .1f, &min, &max);
 			ImGui::SliderFloat("Light Multiplier", &SceneAndViewSettings::lightMultiplier, 0.1, 10.f, "%.3f", ImGuiSliderFlags_Logarithmic);
 			ImGui::Checkbox("Skylight", &SceneAndViewSettings::skyLight);
 			if (ImGui::Checkbox("Backface Culling", &SceneAndViewSettings::backfaceCulling))
@@ -353,10 +385,64 @@ public:
 			if (ImGui::TreeNode("Performance"))
 			{
 				ImGui::InputScalar("Max Triangles For SAH", ImGuiDataType_U32, &SceneAndViewSettings::bvhSAHthreshold, &step, &bigStep);
+				const char* const largeNodeSplits[] = {
+					"Median",
+					"Morton Code (LBVH)"
+				};
+				ImGui::Combo("Above SAH Limit", (int*)&SceneAndViewSettings::bvhLargeNodeSplit, largeNodeSplits, IM_ARRAYSIZE(largeNodeSplits));
+				const char* const splitMethods[] = {
+					"Full Sort",
+					"Binned"
+				};
+				ImGui::Combo("SAH Evaluation", (int*)&SceneAndViewSettings::bvhSplitMethod, splitMethods, IM_ARRAYSIZE(splitMethods));
+				if (SceneAndViewSettings::bvhSplitMethod == BVHBuilder::SplitMethod::BinnedSAH)
+				{
+					ImGui::InputScalar("SAH Bins", ImGuiDataType_U32, &SceneAndViewSettings::bvhBinCount, &step, &bigStep);
+				}
+				ImGui::Checkbox("Two-Level BVH (Instancing)", &SceneAndViewSettings::bvhTwoLevel);
+				ImGui::Checkbox("Indexed Vertex Positions", &SceneAndViewSettings::indexedPositions);
+				ImGui::InputScalar("Max Triangles Per Leaf", ImGuiDataType_U32, &SceneAndViewSettings::bvhMaxLeafSize, &step);
+				SceneAndViewSettings::bvhMaxLeafSize = std::clamp(SceneAndViewSettings::bvhMaxLeafSize, 1u, 8u);
+				ImGui::Checkbox("Spatial Splits (SBVH)", &SceneAndViewSettings::bvhSpatialSplits);
+				if (SceneAndViewSettings::bvhSpatialSplits)
+				{
+					ImGui::SliderFloat("Duplicate Triangles Budget", &SceneAndViewSettings::bvhSpatialSplitBudget, 0.0f, 2.0f);
+				}
+				ImGui::InputScalar("BVH Build Threads", ImGuiDataType_U32, &SceneAndViewSettings::bvhThreads, &step);
+				const char* const layouts[] = {
+					"Binary (Stackless)",
+					"4-wide",
+					"8-wide"
+				};
+				ImGui::Combo("BVH Layout", (int*)&SceneAndViewSettings::bvhLayout, layouts, IM_ARRAYSIZE(layouts));
+				if (SceneAndViewSettings::bvhLayout != BVHBuilder::Layout::Binary)
+				{
+					const char* const quantizations[] = {
+						"Full Precision",
+						"16-bit",
+						"8-bit"
+					};
+					ImGui::Combo("Child Bounds", (int*)&SceneAndViewSettings::bvhQuantization, quantizations, IM_ARRAYSIZE(quantizations));
+				}
 				ImGui::InputScalar("Maximum Objects", ImGuiDataType_U32, &SceneAndViewSettings::objectCountLimit, &step);
+				ImGui::Checkbox("Scene Cache", &SceneAndViewSettings::sceneCache);
+				ImGui::InputScalar("Texture Upload KB/Frame", ImGuiDataType_U32, &SceneAndViewSettings::textureUploadBudget, &step, &bigStep);
 				ImGui::TreePop();
 			}
-			if (ImGui::Button("(Re)load"))
+			if (SceneAndViewSettings::loadingPhase != SceneAndViewSettings::LoadingPhase::Idle)
+			{
+				const char* const phases[] = {
+					"Idle",
+					"Importing",
+					"Decoding Textures",
+					"Processing Meshes",
+					"Building BVH",
+					"Uploading"
+				};
+				float progress = SceneAndViewSettings::loadingProgress;
+				ImGui::ProgressBar(progress < 0 ? 0 : progress, ImVec2(-FLT_MIN, 0), phases[(int)SceneAndViewSettings::loadingPhase.load()]);
+			}
+			else if (ImGui::Button("(Re)load"))
 			{
 				SceneAndViewSettings::reloadScene = true;
 			}
@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <array>
+#include <atomic>
+#include <future>
 #include <string>
 #include <limits>
 #include <random>
@@ -15,6 +17,8 @@
 #include "../Structures/SceneAndViewSettings.h"
 #include "../Structures/SceneObjects.h"
 #include "../Structures/Bvh.h"
+#include "../Structures/SceneCache.h"
+#include "../Structures/CpuRenderer.h"
 
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
@@ -22,17 +26,26 @@
 #include <assimp/material.h>
 #include <assimp/DefaultLogger.hpp>
 #include <assimp/LogStream.hpp>
+#include <assimp/ProgressHandler.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
 
 using namespace SceneAndViewSettings;
 class ProjectWindow : public AppWindow {
 public:
 	GLuint fShader;
 	GLuint fFlatShader;
+	// Compiled only with SceneAndViewSettings::quiltRendering
+	GLuint fQuiltShader = 0;
 	GLuint vShader;
 	GLuint program;
+	// Interleaves the quilt for the Looking Glass
+	GLuint fInterleaveShader;
+	GLuint interleaveProgram;
+	GLint interleaveQuiltTiles;
 	GLuint fullScreenVAO;
 	GLuint fullScreenVertexBuffer;
 	GLuint uCalibrationHandle;
@@ -43,6 +56,8 @@ public:
 		GLuint material;
 		GLuint lights;
 		GLuint bvh;
+		GLuint positions;
+		GLuint viewCameras;
 	} bufferHandles;
 	struct BufferDefinition {
 		GLuint index;
@@ -60,15 +75,16 @@ public:
 		GLint uMouse;
 		GLint uView;
 		GLint uProj;
-		GLint uViewCone;
-		GLint uFocusDistance;
 		GLint uObjectCount;
 		GLint uInvRayCount;
 		GLint uRayIndex;
 		GLint uRayOffset;
 		GLint uSubpI;
+		GLint uTopLevelRoot;
+		GLint uSceneNormalMatrix;
+		GLint uQuiltTiles;
 		BufferDefinition uCalibration;
-		BufferDefinition uObjects;
+		BufferDefinition Objects;
 		ImageDefinition uScreenAlbedo;
 		ImageDefinition uScreenNormal;
 		ImageDefinition uScreenColorDepth;
@@ -77,9 +93,33 @@ public:
 		BufferDefinition Material;
 		BufferDefinition Lights;
 		BufferDefinition BVH;
+		BufferDefinition Positions;
+		BufferDefinition ViewCameras;
 	} shaderInputs;
 
-	anyVector vertexAttrs;
+	// Inverted view cameras as the shader reads them, so it does not invert matrices per fragment
+	struct ViewCamera {
+		glm::mat4 inverseViewProj;
+		glm::vec4 position;
+	};
+	// Inputs of the uploaded view cameras. They are uploaded again only when one of these changes
+	struct ViewCamerasKey {
+		glm::mat4 view;
+		glm::mat4 proj;
+		float viewCone;
+		float focusDistance;
+		float aspect;
+		// 0 for the flat screen
+		int viewCount;
+		bool operator==(const ViewCamerasKey&) const = default;
+	} viewCamerasKey = {};
+	// Render target of the quilt mode
+	struct {
+		GLuint framebuffer = 0;
+		GLuint texture = 0;
+	} quilt;
+
+	AttributeArena vertexAttrs;
 	// The rendering is non-indexed
 	std::vector<FastTriangleFirstHalf> trianglesFirst;
 	std::vector<FastTriangleSecondHalf> trianglesSecond;
@@ -87,6 +127,70 @@ public:
 	std::vector<Material> materials;
 	std::vector<Light> lights;
 	BVHBuilder bvhBuilder;
+	// Used instead of bvhBuilder when the scene was loaded with SceneAndViewSettings::bvhTwoLevel
+	TwoLevelBVHBuilder twoLevelBuilder;
+	bool sceneTwoLevel = false;
+	// The scene was loaded with SceneAndViewSettings::indexedPositions. The shader then gets vertexPositions and indexedTriangles
+	bool sceneIndexed = false;
+	// Copies of the settings for the loading thread. They become sceneTwoLevel and sceneIndexed in finishSceneLoading
+	struct {
+		bool twoLevel = false;
+		bool indexed = false;
+		// The file and its transform, which the control window edits meanwhile
+		decltype(SceneAndViewSettings::scene) scene;
+	} loadingScene;
+	std::vector<glm::vec3> vertexPositions;
+	std::vector<IndexedTriangle> indexedTriangles;
+	struct SubmittedMesh {
+		uint32_t object;
+		GLuint bvhMesh;
+		// In the space the mesh was submitted in
+		glm::vec3 aabbMin;
+		glm::vec3 aabbMax;
+		glm::vec3 averageNormal;
+	};
+	// A mesh placed by SubmitScene, whose data is written afterwards
+	struct PendingMesh {
+		const aiMesh* mesh;
+		unsigned int meshIndex;
+		aiMatrix4x4 transform;
+		std::size_t attributeOffset;
+		std::size_t triangleOffset;
+		// Only with indexed positions
+		std::size_t positionOffset;
+		SubmittedMesh submitted;
+	};
+	// Sizes of the mesh data arrays while the meshes are placed
+	struct MeshRanges {
+		std::size_t attributeCount;
+		std::size_t triangleCount;
+		std::size_t positionCount;
+	};
+
+	// Two-level BVH data. Indexed by assimp mesh index
+	std::unordered_map<unsigned int, SubmittedMesh> submittedMeshes;
+	std::vector<BVHMesh> bvhMeshes;
+	// Node transforms without the scene transform
+	std::vector<unsigned int> instanceMeshes;
+	std::vector<aiMatrix4x4> instanceTransforms;
+	std::vector<BVHInstance> bvhInstances;
+	// Single-level BVH data. The triangles and meshes before the scene transform
+	std::vector<FastTriangleFirstHalf> sceneTrianglesFirst;
+	std::vector<FastTriangleSecondHalf> sceneTrianglesSecond;
+	std::vector<glm::vec3> scenePositions;
+	std::vector<SubmittedMesh> sceneMeshes;
+	// The scene cache the scene was loaded from. Arrays which only the GPU needs are uploaded straight from its mapping
+	SceneCache::Reader sceneCacheFile;
+	std::span<const char> mappedVertexAttrs;
+	std::span<const FastTriangleSecondHalf> mappedTriangles;
+	// The vertex attribute normals of the single-level BVH scene are not scene transformed
+	glm::mat3 sceneNormalMatrix = glm::mat3(1.f);
+	// BVH layout the fragment shader was compiled for
+	unsigned int compiledBvhWidth = 2;
+	unsigned int compiledQuantizationBits = 0;
+	unsigned int compiledStackSize = 0;
+	bool compiledTwoLevel = false;
+	bool compiledIndexed = false;
 	uint32_t rayNumber;
 	uint32_t raySalt;
 
@@ -95,10 +199,49 @@ public:
 	//
 	const aiScene* gScene = nullptr;
 	Assimp::Importer importer;
+	// Reports the import progress to the control window
+	struct ImportProgress : Assimp::ProgressHandler
+	{
+		bool Update(float percentage) override
+		{
+			SceneAndViewSettings::loadingProgress = percentage;
+			return true;
+		}
+	};
+	static constexpr unsigned int ImportFlags = aiProcessPreset_TargetRealtime_Quality | aiPostProcessSteps::aiProcess_FlipUVs | aiPostProcessSteps::aiProcess_FixInfacingNormals | aiPostProcessSteps::aiProcess_Triangulate;
 	// images / texture
-	std::unordered_map<std::string, std::tuple<std::reference_wrapper<GLuint>, GLuint64>> textureHandleMap;	// map image filenames to textureIds and resident handles
+	// Texture paths relative to the scene. Materials refer to the textures by the index in it until the render thread uploads them
+	std::vector<std::string> texturePaths;
+	std::unordered_map<std::string, uint32_t> textureIndices;
+	// Image decoded by the loading thread, always RGBA
+	struct DecodedTexture {
+		unsigned char* pixels = nullptr;
+		int width = 0;
+		int height = 0;
+		int channels = 0;
+	};
+	std::vector<DecodedTexture> decodedTextures;
+	// Streams the decoded textures to their GL textures over several frames through a ring of pixel unpack buffers
+	struct TextureStream {
+		static constexpr std::size_t RingSize = 3;
+		std::array<GLuint, RingSize> buffers = {};
+		// Signalled when the GPU has read the buffer
+		std::array<GLsync, RingSize> fences = {};
+		std::size_t bufferSize = 0;
+		std::size_t current = 0;
+		// Owned by the render thread, so the loading thread can decode the next scene meanwhile
+		std::vector<DecodedTexture> textures;
+		std::size_t nextTexture = 0;
+		int nextRow = 0;
+		std::chrono::system_clock::time_point start;
+	} textureStream;
 	std::vector<GLuint> textureIds;
-	GLuint invalidHandle = -1u;
+	// Resident bindless handles. -1 for the textures which failed to load
+	std::vector<GLuint64> textureHandles;
+	// The scene is loaded on this thread
+	std::future<void> sceneLoading;
+	std::string sceneErrors;
+	std::string sceneTextureErrors;
 	std::unordered_map<int, uint32_t> sceneMaterialIndices;
 
 	std::mt19937 randomGenerator;
@@ -107,6 +250,25 @@ public:
 		: AppWindow(name, x, y, w, h)
 	{
 		eventDriven = false;
+		// The importer takes the ownership
+		importer.SetProgressHandler(new ImportProgress);
+	}
+
+	// Headless
+	ProjectWindow(float w, float h)
+		: AppWindow(w, h)
+	{
+		eventDriven = false;
+		importer.SetProgressHandler(new ImportProgress);
+	}
+
+	~ProjectWindow()
+	{
+		// The loading thread writes to the members
+		if (sceneLoading.valid())
+		{
+			sceneLoading.wait();
+		}
 	}
 
 	// Runs on the render thread
@@ -117,6 +279,11 @@ public:
 		{
 			GlHelpers::initCallback();
 		}
+		GLint maxTextureSize;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+		SceneAndViewSettings::maxTextureSize = maxTextureSize;
+		SceneAndViewSettings::quiltWidth = std::min(SceneAndViewSettings::quiltWidth, SceneAndViewSettings::maxTextureSize);
+		SceneAndViewSettings::quiltHeight = std::min(SceneAndViewSettings::quiltHeight, SceneAndViewSettings::maxTextureSize);
 
 		program = glCreateProgram();
 		try {
@@ -129,6 +296,19 @@ public:
 		glAttachShader(program, vShader);
 		recompileFragmentSh();
 		GlHelpers::linkProgram(program);
+
+		interleaveProgram = glCreateProgram();
+		try {
+			GlHelpers::compileShader<GL_FRAGMENT_SHADER>(Helpers::relativeToExecutable("interleave.frag").string(), fInterleaveShader, {});
+		}
+		catch (const std::runtime_error& e)
+		{
+			resourceError += e.what();
+		}
+		glAttachShader(interleaveProgram, vShader);
+		glAttachShader(interleaveProgram, fInterleaveShader);
+		GlHelpers::linkProgram(interleaveProgram);
+		interleaveQuiltTiles = glGetUniformLocation(interleaveProgram, "uQuiltTiles");
 		glCreateVertexArrays(1, &fullScreenVAO);
 		// Assign to fullScreenVertexBuffer
 		glCreateBuffers(1, &fullScreenVertexBuffer);
@@ -150,11 +330,11 @@ public:
 		glBindBufferBase(GL_UNIFORM_BUFFER, shaderInputs.uCalibration.location, uCalibrationHandle);//For explanation: https://stackoverflow.com/questions/54955186/difference-between-glbindbuffer-and-glbindbufferbase
 
 		glGenBuffers(1, &bufferHandles.objects);
-		glBindBuffer(GL_UNIFORM_BUFFER, bufferHandles.objects);
-		glBufferData(GL_UNIFORM_BUFFER, 0, objects.data(), GL_STATIC_READ);
-		glBindBufferBase(GL_UNIFORM_BUFFER, shaderInputs.uObjects.location, bufferHandles.objects);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandles.objects);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(SceneObject), objects.data(), GL_STATIC_READ);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, shaderInputs.Objects.location, bufferHandles.objects);
 
-		createFlexibleBuffer(bufferHandles.vertex, shaderInputs.Attribute.location, vertexAttrs);
+		createFlexibleBuffer(bufferHandles.vertex, shaderInputs.Attribute.location, vertexAttrs.bytes());
 
 		glGenBuffers(1, &bufferHandles.triangles);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandles.triangles);
@@ -175,9 +355,18 @@ public:
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandles.bvh);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, shaderInputs.BVH.location, bufferHandles.bvh);
 
+		glGenBuffers(1, &bufferHandles.positions);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandles.positions);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, shaderInputs.Positions.location, bufferHandles.positions);
+
+		glGenBuffers(1, &bufferHandles.viewCameras);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandles.viewCameras);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, shaderInputs.ViewCameras.location, bufferHandles.viewCameras);
+
 		createFullScreenImageBuffer(shaderInputs.uScreenAlbedo.texture, shaderInputs.uScreenAlbedo.unit);
 		createFullScreenImageBuffer(shaderInputs.uScreenNormal.texture, shaderInputs.uScreenNormal.unit);
 		createFullScreenImageBuffer(shaderInputs.uScreenColorDepth.texture, shaderInputs.uScreenColorDepth.unit, GL_RGBA16F);
+		recreateQuilt();
 
 		glBindVertexArray(fullScreenVAO);
 		glUniform1f(shaderInputs.uTime, 0);
@@ -197,7 +386,8 @@ public:
 		//Create the texture
 		glGenTextures(1, &textureId);
 		glBindTexture(GL_TEXTURE_2D, textureId);
-		glTexStorage2D(GL_TEXTURE_2D, 1, format, windowWidth, windowHeight);
+		glm::vec2 size = renderSize();
+		glTexStorage2D(GL_TEXTURE_2D, 1, format, size.x, size.y);
 		glBindTexture(GL_TEXTURE_2D, 0); //Unbind the texture
 
 		bindImage(textureId, binding, format);
@@ -208,23 +398,24 @@ public:
 		glBindImageTexture(binding, textureId, 0, GL_FALSE, 0, GL_READ_WRITE, format);
 	}
 
-	void createFlexibleBuffer(GLuint& bufferHandle, GLuint index, anyVector& buffer)
+	void createFlexibleBuffer(GLuint& bufferHandle, GLuint index, std::span<const char> buffer)
 	{
 		glGenBuffers(1, &bufferHandle);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bufferHandle);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, buffer.totalSize, buffer.buffer.view().data(), GL_STATIC_READ);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, buffer.size(), buffer.data(), GL_STATIC_READ);
 		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, bufferHandle);
 	}
 
-	void updateFlexibleBuffer(GLuint& bufferHandle, anyVector& buffer)
+	template<typename T>
+	void updateFlexibleBuffer(GLuint& bufferHandle, const std::vector<T>& buffer)
 	{
-		glNamedBufferData(bufferHandle, buffer.totalSize, buffer.buffer.view().data(), GL_STATIC_READ);
+		glNamedBufferData(bufferHandle, buffer.size() * sizeof(T), buffer.data(), GL_STATIC_READ);
 	}
 
 	template<typename T>
-	void updateFlexibleBuffer(GLuint& bufferHandle, std::vector<T>& buffer)
+	void updateFlexibleBuffer(GLuint& bufferHandle, std::span<const T> buffer)
 	{
-		glNamedBufferData(bufferHandle, buffer.size() * sizeof(T), buffer.data(), GL_STATIC_READ);
+		glNamedBufferData(bufferHandle, buffer.size_bytes(), buffer.data(), GL_STATIC_READ);
 	}
 
 	void bindShaderInputs()
@@ -236,18 +427,20 @@ public:
 			glGetUniformLocation(program, "uMouse"),
 			glGetUniformLocation(program, "uView"),
 			glGetUniformLocation(program, "uProj"),
-			glGetUniformLocation(program, "uViewCone"),
-			glGetUniformLocation(program, "uFocusDistance"),
 			glGetUniformLocation(program, "uObjectCount"),
 			glGetUniformLocation(program, "uInvRayCount"),
 			glGetUniformLocation(program, "uRayIndex"),
 			glGetUniformLocation(program, "uRayOffset"),
 			glGetUniformLocation(program, "uSubpI"),
+			glGetUniformLocation(program, "uTopLevelRoot"),
+			glGetUniformLocation(program, "uSceneNormalMatrix"),
+			glGetUniformLocation(program, "uQuiltTiles"),
 			{
 				glGetUniformBlockIndex(program, "CalibrationBuffer")
 			},
 			{
-				glGetUniformBlockIndex(program, "ObjectBuffer")
+				glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK,   "ObjectBuffer"),
+				11
 			},
 			{
 				glGetUniformLocation(program, "uScreenAlbedo"),
@@ -281,15 +474,22 @@ public:
 				glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK,   "BVHBuffer"),
 				9
 			},
+			{
+				glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK,   "PositionBuffer"),
+				10
+			},
+			{
+				glGetProgramResourceIndex(program, GL_SHADER_STORAGE_BLOCK,   "ViewBuffer"),
+				12
+			},
 		};
 		glGetActiveUniformBlockiv(program, shaderInputs.uCalibration.index, GL_UNIFORM_BLOCK_BINDING, &shaderInputs.uCalibration.location);
-		glGetActiveUniformBlockiv(program, shaderInputs.uObjects.index, GL_UNIFORM_BLOCK_BINDING, &shaderInputs.uObjects.location);
 		/*glGetIntegeri_v(GL_SHADER_STORAGE_BUFFER_BINDING, shaderInputs.Vertex.index, &shaderInputs.Vertex.location);
 		glGetIntegeri_v(GL_SHADER_STORAGE_BUFFER_BINDING, shaderInputs.Index.index, &shaderInputs.Index.location);
 		glGetIntegeri_v(GL_SHADER_STORAGE_BUFFER_BINDING, shaderInputs.Material.index, &shaderInputs.Material.location);*/
 	}
 
-	void recompileFragmentSh()
+	void detachFragmentShaders()
 	{
 		// Will produce errors if the shader is not compiled yet but c'est la vie
 		GLsizei count;
@@ -304,6 +504,11 @@ public:
 				glDetachShader(program, shaders[i]);
 			}
 		}
+	}
+
+	void recompileFragmentSh()
+	{
+		detachFragmentShaders();
 		try {
 			std::string fragSource = Helpers::relativeToExecutable("fragment.frag").string();
 			auto bouncesDefine = fmt::format("MAX_BOUNCES {:d}", maxBounces);
@@ -312,9 +517,26 @@ public:
 			auto debugVisualizeBVHDefine = std::string(SceneAndViewSettings::visualizeBVH ? "DEBUG_VISUALIZE_BVH" : "NO_DEBUG_VISUALIZE_BVH");
 			auto debugLevelMaskDefine = fmt::format("DEBUG_BVH_LEVEL_MASK 0x{:X}u", SceneAndViewSettings::bvhDebugIterationsMask);
 			auto debugBvhEdgeWidthDefine = fmt::format("DEBUG_BVH_EDGE_WIDTH {:f}", SceneAndViewSettings::bvhEdgeWidth);
-			GlHelpers::compileShader<GL_FRAGMENT_SHADER>(fragSource, fShader, { bouncesDefine, subpixelOnePassDefine, cullingDefine, debugVisualizeBVHDefine, debugLevelMaskDefine, debugBvhEdgeWidthDefine });
-			GlHelpers::compileShader<GL_FRAGMENT_SHADER>(fragSource, fFlatShader, { "FLAT_SCREEN", bouncesDefine, subpixelOnePassDefine, cullingDefine, debugVisualizeBVHDefine, debugLevelMaskDefine, debugBvhEdgeWidthDefine });
-			glAttachShader(program, GlobalScreenType == ScreenType::Flat ? fFlatShader : fShader);
+			// The traversal must match the BVH which is currently uploaded, not the one set in the UI
+			const BVHBuilder& builder = sceneTwoLevel ? twoLevelBuilder.bottomLevel : bvhBuilder;
+			compiledBvhWidth = builder.m_width;
+			compiledQuantizationBits = builder.m_quantizationBits;
+			compiledStackSize = std::max(20u, traversalStackSize());
+			compiledTwoLevel = sceneTwoLevel;
+			compiledIndexed = sceneIndexed;
+			auto twoLevelDefine = std::string(compiledTwoLevel ? "BVH_TWO_LEVEL" : "BVH_SINGLE_LEVEL");
+			auto indexedDefine = std::string(compiledIndexed ? "INDEXED_POSITIONS" : "TRIANGLES_IN_BVH");
+			auto bvhWidthDefine = fmt::format("BVH_WIDTH {:d}", compiledBvhWidth);
+			auto bvhQuantizationDefine = fmt::format("BVH_QUANTIZATION {:d}", compiledQuantizationBits);
+			auto stackSizeDefine = fmt::format("STACK_SIZE {:d}", compiledStackSize);
+			GlHelpers::compileShader<GL_FRAGMENT_SHADER>(fragSource, fShader, { bouncesDefine, subpixelOnePassDefine, cullingDefine, debugVisualizeBVHDefine, debugLevelMaskDefine, debugBvhEdgeWidthDefine, bvhWidthDefine, bvhQuantizationDefine, stackSizeDefine, twoLevelDefine, indexedDefine });
+			GlHelpers::compileShader<GL_FRAGMENT_SHADER>(fragSource, fFlatShader, { "FLAT_SCREEN", bouncesDefine, subpixelOnePassDefine, cullingDefine, debugVisualizeBVHDefine, debugLevelMaskDefine, debugBvhEdgeWidthDefine, bvhWidthDefine, bvhQuantizationDefine, stackSizeDefine, twoLevelDefine, indexedDefine });
+			if (SceneAndViewSettings::quiltRendering)
+			{
+				// Every view is traced like on a flat screen
+				GlHelpers::compileShader<GL_FRAGMENT_SHADER>(fragSource, fQuiltShader, { "FLAT_SCREEN", "QUILT", bouncesDefine, subpixelOnePassDefine, cullingDefine, debugVisualizeBVHDefine, debugLevelMaskDefine, debugBvhEdgeWidthDefine, bvhWidthDefine, bvhQuantizationDefine, stackSizeDefine, twoLevelDefine, indexedDefine });
+			}
+			glAttachShader(program, activeFragmentShader());
 		}
 		catch (const std::runtime_error& e)
 		{
@@ -326,15 +548,21 @@ public:
 	void render() override
 	{
 		ui();
+		streamTextures();
 		glBindVertexArray(fullScreenVAO);
 		glUseProgram(program);
 		glUniform1f(shaderInputs.uTime, frame);
 		glUniformMatrix4fv(shaderInputs.uView, 1, false, glm::value_ptr(person.Camera.GetViewMatrix()));
 		glUniformMatrix4fv(shaderInputs.uProj, 1, false, glm::value_ptr(person.Camera.GetProjectionMatrix()));
-		glUniform1f(shaderInputs.uViewCone, glm::radians(viewCone));
-		glUniform1f(shaderInputs.uFocusDistance, focusDistance);
 		glUniform2f(shaderInputs.uMouse, mouseX, mouseY);
-		if (!SceneAndViewSettings::subpixelOnePass && GlobalScreenType == ScreenType::LookingGlass)
+		updateViewCameras();
+		if (quiltActive())
+		{
+			glUniform2ui(shaderInputs.uQuiltTiles, quiltColumns, quiltRows);
+			glBindFramebuffer(GL_FRAMEBUFFER, quilt.framebuffer);
+			glViewport(0, 0, quiltWidth, quiltHeight);
+		}
+		else if (!SceneAndViewSettings::subpixelOnePass && GlobalScreenType == ScreenType::LookingGlass)
 		{
 			switch (currentSubpixel)
 			{
@@ -376,9 +604,117 @@ public:
 		{
 			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 		}
+		if (quiltActive())
+		{
+			// The quilt keeps the result, so only the interleaving runs when the path tracing is paused
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, windowWidth, windowHeight);
+			glUseProgram(interleaveProgram);
+			glUniform2ui(interleaveQuiltTiles, quiltColumns, quiltRows);
+			glBindTextureUnit(0, quilt.texture);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+			glUseProgram(program);
+		}
 		frame++;
 	}
 
+	bool quiltActive() const
+	{
+		return GlobalScreenType == ScreenType::LookingGlass && SceneAndViewSettings::quiltRendering;
+	}
+
+	GLuint activeFragmentShader() const
+	{
+		return quiltActive() ? fQuiltShader : GlobalScreenType == ScreenType::LookingGlass ? fShader : fFlatShader;
+	}
+
+	// Size of the G-buffer images, which is the size of the quilt in the quilt mode
+	glm::vec2 renderSize() const
+	{
+		return quiltActive() ? glm::vec2(quiltWidth, quiltHeight) : glm::vec2(windowWidth, windowHeight);
+	}
+
+	void recreateQuilt()
+	{
+		if (quilt.framebuffer != 0)
+		{
+			glDeleteFramebuffers(1, &quilt.framebuffer);
+			glDeleteTextures(1, &quilt.texture);
+			quilt.framebuffer = quilt.texture = 0;
+		}
+		if (!quiltActive())
+		{
+			return;
+		}
+		glCreateTextures(GL_TEXTURE_2D, 1, &quilt.texture);
+		glTextureStorage2D(quilt.texture, 1, GL_RGBA8, quiltWidth, quiltHeight);
+		glTextureParameteri(quilt.texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTextureParameteri(quilt.texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTextureParameteri(quilt.texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(quilt.texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glCreateFramebuffers(1, &quilt.framebuffer);
+		glNamedFramebufferTexture(quilt.framebuffer, GL_COLOR_ATTACHMENT0, quilt.texture, 0);
+	}
+
+	// One camera for each Looking Glass view or quilt tile, or the single flat screen camera
+	void updateViewCameras()
+	{
+		const CpuRenderer::Camera camera = cpuCamera();
+		const int viewCount = quiltActive() ? (int)(quiltColumns * quiltRows) : camera.lookingGlass ? CpuRenderer::Tile : 0;
+		const ViewCamerasKey key = { camera.view, camera.proj, camera.viewCone, camera.focusDistance, windowWidth / windowHeight, viewCount };
+		if (key == viewCamerasKey)
+		{
+			return;
+		}
+		viewCamerasKey = key;
+
+		std::vector<ViewCamera> viewCameras;
+		if (viewCount == 0)
+		{
+			// Zeroing w of the unprojected point makes the inverse view matrix rotate it to a direction, like getFlatScreenRay did
+			const glm::mat4 invView = glm::inverse(camera.view);
+			glm::mat4 dropW(1);
+			dropW[3][3] = 0;
+			viewCameras.push_back({ invView * dropW * glm::inverse(camera.proj), invView * glm::vec4(0, 0, 0, 1) });
+		}
+		for (int view = 0; view < viewCount; view++)
+		{
+			CpuRenderer::Camera shifted = CpuRenderer::viewCamera(camera, view, viewCount, key.aspect);
+			viewCameras.push_back({ glm::inverse(shifted.proj * shifted.view), glm::inverse(shifted.view) * glm::vec4(0, 0, 0, 1) });
+		}
+		updateFlexibleBuffer(bufferHandles.viewCameras, viewCameras);
+	}
+
+	// The file name follows the Looking Glass quilt naming with the tiles and the aspect ratio of a view
+	void saveQuiltImage()
+	{
+		std::vector<unsigned char> pixels((std::size_t)quiltWidth * quiltHeight * 4);
+		glGetTextureImage(quilt.texture, 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLsizei)pixels.size(), pixels.data());
+		std::string file = fmt::format("quilt_qs{}x{}a{:.2f}.png", quiltColumns, quiltRows, windowWidth / windowHeight);
+		// GL rows are from the bottom
+		stbi_flip_vertically_on_write(1);
+		bool written = stbi_write_png(file.c_str(), quiltWidth, quiltHeight, 4, pixels.data(), quiltWidth * 4);
+		stbi_flip_vertically_on_write(0);
+		if (written)
+		{
+			std::cout << "Quilt saved to " << std::filesystem::absolute(file) << std::endl;
+		}
+		else
+		{
+			std::cerr << "Could not write " << file << std::endl;
+		}
+	}
+
+	const std::vector<BVHPackedNode>& packedBvh() const
+	{
+		return sceneTwoLevel ? twoLevelBuilder.m_packedNodes : bvhBuilder.m_packedNodes;
+	}
+
+	unsigned int traversalStackSize() const
+	{
+		return sceneTwoLevel ? twoLevelBuilder.m_traversalStackSize : bvhBuilder.m_traversalStackSize;
+	}
+
 	void submitObjectBuffer()
 	{
 		updateFlexibleBuffer(bufferHandles.objects, objects);
@@ -387,11 +723,18 @@ public:
 
 	void clearTextures()
 	{
+		for (DecodedTexture& texture : textureStream.textures)
+		{
+			stbi_image_free(texture.pixels);
+		}
+		textureStream.textures.clear();
+		textureStream.nextTexture = 0;
+		textureStream.nextRow = 0;
 		if (textureIds.size())
 		{
 			glDeleteTextures(textureIds.size(), textureIds.data());
 			textureIds.clear();
-			textureHandleMap.clear();
+			textureHandles.clear();
 		}
 	}
 
@@ -406,15 +749,14 @@ public:
 
 	void applyScreenType()
 	{
-		if (GlobalScreenType == ScreenType::LookingGlass)
+		swapShaders(activeFragmentShader());
+		if (GlobalScreenType == ScreenType::Flat || quiltActive())
 		{
-			swapShaders(fFlatShader, fShader);
-		}
-		else
-		{
-			swapShaders(fShader, fFlatShader);
 			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+			currentSubpixel = 2;
 		}
+		// The G-buffer takes the size of the quilt
+		recreateBufferImages();
 	}
 
 	void renderOnEvent(std::deque<SDL_Event>e) override
@@ -430,94 +772,99 @@ public:
 		createFullScreenImageBuffer(shaderInputs.uScreenAlbedo.texture, shaderInputs.uScreenAlbedo.unit);
 		createFullScreenImageBuffer(shaderInputs.uScreenNormal.texture, shaderInputs.uScreenNormal.unit);
 		createFullScreenImageBuffer(shaderInputs.uScreenColorDepth.texture, shaderInputs.uScreenColorDepth.unit, GL_RGBA16F);
+		recreateQuilt();
+		// The new images hold no result to accumulate to
+		SceneAndViewSettings::rayIteration = 0;
 	}
 
 	void ui()
 	{
-		if (SceneAndViewSettings::applyScreenType)
+		// Swapping the shaders uploads the scene buffers, so it waits for the loading thread
+		if (SceneAndViewSettings::applyScreenType && !sceneLoading.valid())
 		{
 			SceneAndViewSettings::applyScreenType = false;
 			applyScreenType();
 		}
-		if (SceneAndViewSettings::recompileFShaders)
+		if (SceneAndViewSettings::reloadScene && !sceneLoading.valid())
 		{
-			recompileFShaders = false;
-			recompileFragmentSh();
-			GlHelpers::linkProgram(program);
-			glUseProgram(program);
-			bindShaderInputs();
-			recreateBufferImages();
-			glUniform2f(shaderInputs.uWindowSize, windowWidth, windowHeight);
-			if (subpixelOnePass)
-			{
-				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
-				currentSubpixel = 2; //Because rayIteration is incremented by currentSubpixel/2 when doing path tracing
-			}
-			updateBuffers();
+			SceneAndViewSettings::reloadScene = false;
+			startSceneLoading();
 		}
-		if (SceneAndViewSettings::reloadScene)
+		if (sceneLoading.valid() && sceneLoading.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
 		{
-			SceneAndViewSettings::reloadScene = false;
-			clearBuffers();
-
-
-			try
+			finishSceneLoading();
+		}
+		// The scene data belong to the loading thread until it finishes
+		if (SceneAndViewSettings::updateSceneTransform && !sceneLoading.valid())
+		{
+			SceneAndViewSettings::updateSceneTransform = false;
+			loadingScene.scene.scale = scene.scale;
+			loadingScene.scene.position = scene.position;
+			loadingScene.scene.rotationDeg = scene.rotationDeg;
+			if (!objects.empty())
 			{
-				Import3DFromFile(SceneAndViewSettings::scene.path);
-
-				textureErrors = LoadGLTextures(gScene);
-				SubmitScene(gScene, nullptr, aiMatrix4x4(scene.scale, aiQuaternion(
-					glm::radians(scene.rotationDeg.x), glm::radians(scene.rotationDeg.y), glm::radians(scene.rotationDeg.z)
-				), scene.position));
-
-				if (SceneAndViewSettings::skyLight)
+				auto before = std::chrono::system_clock::now();
+				applySceneTransform();
+				if (sceneTwoLevel)
 				{
-					if (lights.empty())
+					twoLevelBuilder.buildInstances(bvhInstances);
+					glUniform1ui(shaderInputs.uTopLevelRoot, twoLevelBuilder.m_topLevelRoot);
+				}
+				else
+				{
+					// Keeps the topology of the last build
+					bvhBuilder.refit(trianglesFirst, trianglesSecond);
+					if (sceneIndexed)
 					{
-						Light currentLight = {
-							glm::vec3(0,1000,0),
-							10000,
-							glm::vec3(0,-1,0),
-							10000 * 10000,
-							glm::vec4(1.f) * SceneAndViewSettings::lightMultiplier,
-							UINT32_MAX
-						};
-						lights.push_back(currentLight);
+						updateFlexibleBuffer(bufferHandles.positions, vertexPositions);
 					}
 					else
 					{
-						std::cerr << "Sky light cannot be used with other lights\n";
+						updateFlexibleBuffer(bufferHandles.triangles, trianglesSecond);
 					}
+					glUniformMatrix3fv(shaderInputs.uSceneNormalMatrix, 1, false, glm::value_ptr(sceneNormalMatrix));
 				}
-
-				auto before = std::chrono::system_clock::now();
-				bvhBuilder.sahThreshold = SceneAndViewSettings::bvhSAHthreshold;
-				bvhBuilder.build(trianglesFirst, trianglesSecond);
-				auto after = std::chrono::system_clock::now();
-				std::cout << "BVH Construction took " << std::chrono::duration<float, std::milli>(after - before).count() << " ms";
-
-				if (!textureErrors.empty())
+				updateFlexibleBuffer(bufferHandles.lights, lights);
+				updateFlexibleBuffer(bufferHandles.bvh, packedBvh());
+				if (traversalStackSize() > compiledStackSize)
 				{
-					ImGui::OpenPopup(textureLoadingFailed);
-					std::cerr << "Texture loading failed \n";
+					SceneAndViewSettings::recompileFShaders = true;
 				}
+				SceneAndViewSettings::rayIteration = 0;
+				auto after = std::chrono::system_clock::now();
+				std::cout << (sceneTwoLevel ? "Top-level BVH rebuilt in " : "BVH refitted in ")
+					<< std::chrono::duration<float, std::milli>(after - before).count() << " ms" << std::endl;
 			}
-			catch (const std::runtime_error& e)
+		}
+		if (SceneAndViewSettings::renderOnCpu && !sceneLoading.valid())
+		{
+			SceneAndViewSettings::renderOnCpu = false;
+			saveCpuReference();
+		}
+		if (SceneAndViewSettings::saveQuilt)
+		{
+			SceneAndViewSettings::saveQuilt = false;
+			if (quiltActive())
 			{
-				resourceError = e.what();
-				ImGui::OpenPopup(resourceLoadingFailed);
-				std::cerr << "Resource loading failed:\n" << resourceError << std::endl;
+				saveQuiltImage();
+			}
+		}
+		// After the scene reload because the shader may need to change with the BVH layout
+		if (SceneAndViewSettings::recompileFShaders && !sceneLoading.valid())
+		{
+			recompileFShaders = false;
+			recompileFragmentSh();
+			GlHelpers::linkProgram(program);
+			glUseProgram(program);
+			bindShaderInputs();
+			recreateBufferImages();
+			glUniform2f(shaderInputs.uWindowSize, windowWidth, windowHeight);
+			if (subpixelOnePass || quiltActive())
+			{
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+				currentSubpixel = 2; //Because rayIteration is incremented by currentSubpixel/2 when doing path tracing
 			}
-
 			updateBuffers();
-			std::cout << "Scene " << scene.path.filename() << " loaded." << std::endl
-				<< "Total:\n"
-				<< "Obj " << objects.size() << " (" << objects.size() * sizeof(SceneObject) << " bytes)" << std::endl
-				<< "Attr " << vertexAttrs.types.size() << " (" << vertexAttrs.totalSize << " bytes)" << std::endl
-				<< "Tri " << trianglesFirst.size() << " (" << trianglesFirst.size() * sizeof(FastTriangleSecondHalf) << " bytes)" << std::endl
-				<< "BVH " << bvhBuilder.m_packedNodes.size() << " (" << bvhBuilder.m_packedNodes.size() * sizeof(BVHPackedNode) << " bytes)" << std::endl
-				<< "Mat " << materials.size() << " (" << materials.size() * sizeof(Material) << " bytes)" << std::endl
-				<< "Tex " << textureHandleMap.size() << std::endl;
 		}
 		if (ImGui::BeginPopup(textureLoadingFailed))
 		{
@@ -558,6 +905,354 @@ public:
 		}
 	}
 
+	// Captures the settings and starts loading the scene on another thread. The previous scene stays on the GPU until finishSceneLoading
+	void startSceneLoading()
+	{
+		captureSceneSettings();
+		SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Import);
+		sceneLoading = std::async(std::launch::async, [this] { loadScene(); });
+	}
+
+	// The scene is loaded with these settings even if they change in the meantime
+	void captureSceneSettings()
+	{
+		loadingScene.twoLevel = SceneAndViewSettings::bvhTwoLevel;
+		loadingScene.indexed = SceneAndViewSettings::indexedPositions;
+		loadingScene.scene = SceneAndViewSettings::scene;
+		BVHBuilder& builder = loadingScene.twoLevel ? twoLevelBuilder.bottomLevel : bvhBuilder;
+		builder.sahThreshold = SceneAndViewSettings::bvhSAHthreshold;
+		builder.splitMethod = SceneAndViewSettings::bvhSplitMethod;
+		builder.binCount = SceneAndViewSettings::bvhBinCount;
+		builder.largeNodeSplit = SceneAndViewSettings::bvhLargeNodeSplit;
+		builder.threadCount = SceneAndViewSettings::bvhThreads;
+		builder.maxLeafSize = SceneAndViewSettings::bvhMaxLeafSize;
+		builder.spatialSplits = SceneAndViewSettings::bvhSpatialSplits;
+		builder.spatialSplitBudget = SceneAndViewSettings::bvhSpatialSplitBudget;
+		builder.layout = SceneAndViewSettings::bvhLayout;
+		builder.quantization = SceneAndViewSettings::bvhQuantization;
+		builder.indexedTriangles = loadingScene.indexed;
+	}
+
+	/**
+	* Runs on the scene loading thread and produces the whole CPU-side scene with decoded textures.
+	* The render thread does not touch these data until the thread finishes. Errors go to sceneErrors and sceneTextureErrors
+	*/
+	void loadScene()
+	{
+		clearBuffers();
+		sceneErrors.clear();
+		sceneTextureErrors.clear();
+		const BVHBuilder& builder = loadingScene.twoLevel ? twoLevelBuilder.bottomLevel : bvhBuilder;
+
+		std::string cacheKey = sceneCacheKey();
+		auto before = std::chrono::system_clock::now();
+		if (SceneAndViewSettings::sceneCache && loadSceneCache(cacheKey))
+		{
+			SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Textures);
+			sceneTextureErrors = DecodeTextures();
+			applySceneTransform();
+			if (loadingScene.twoLevel)
+			{
+				twoLevelBuilder.buildInstances(bvhInstances);
+			}
+			auto after = std::chrono::system_clock::now();
+			std::cout << "Scene loaded from cache " << SceneCache::fileFor(cacheKey) << " in "
+				<< std::chrono::duration<float, std::milli>(after - before).count() << " ms" << std::endl;
+		}
+		else
+		{
+			Import3DFromFile(loadingScene.scene.path);
+
+			SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Textures);
+			sceneTextureErrors = CollectTextures(gScene);
+			sceneTextureErrors += DecodeTextures();
+			SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Meshes);
+			// The scene transform is applied afterwards so it can change without reloading
+			SubmitScene(gScene);
+			if (!loadingScene.twoLevel)
+			{
+				sceneTrianglesFirst.swap(trianglesFirst);
+				sceneTrianglesSecond.swap(trianglesSecond);
+				scenePositions.swap(vertexPositions);
+			}
+			applySceneTransform();
+
+			SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::BVH);
+			before = std::chrono::system_clock::now();
+			if (loadingScene.twoLevel)
+			{
+				twoLevelBuilder.buildMeshes(trianglesFirst, trianglesSecond, bvhMeshes);
+				twoLevelBuilder.buildInstances(bvhInstances);
+			}
+			else
+			{
+				bvhBuilder.build(trianglesFirst, trianglesSecond);
+			}
+			auto after = std::chrono::system_clock::now();
+			std::cout << "BVH Construction took " << std::chrono::duration<float, std::milli>(after - before).count() << " ms ("
+				<< (builder.splitMethod == BVHBuilder::SplitMethod::BinnedSAH ? fmt::format("{} bins", builder.binCount) : "full sort")
+				<< ", " << (builder.threadCount > 1 ? ThreadPool::shared().size() : 1) << " threads, " << builder.m_width << "-wide";
+			if (loadingScene.twoLevel)
+			{
+				std::cout << ", " << bvhMeshes.size() << " meshes, " << bvhInstances.size() << " instances), "
+					<< "builder memory " << twoLevelBuilder.m_peakMemory / (1024.0f * 1024.0f) << " MB"
+					<< ", " << twoLevelBuilder.m_referenceCount << " leaf references" << std::endl;
+			}
+			else
+			{
+				std::cout << "), SAH cost " << bvhBuilder.m_sahCost
+					<< ", builder memory " << bvhBuilder.m_peakMemory / (1024.0f * 1024.0f) << " MB"
+					<< ", " << bvhBuilder.m_referenceCount << " leaf references" << std::endl;
+			}
+			// A scene with missing parts would be loaded from the cache without reporting them
+			if (SceneAndViewSettings::sceneCache && sceneTextureErrors.empty() && sceneErrors.empty() && !saveSceneCache(cacheKey))
+			{
+				std::cerr << "Could not write the scene cache " << SceneCache::fileFor(cacheKey) << std::endl;
+			}
+		}
+		packIndexedTriangles();
+	}
+
+	// The loaded scene takes the place of the previous one, so the render thread can use its layout
+	void commitSceneSettings()
+	{
+		sceneTwoLevel = loadingScene.twoLevel;
+		sceneIndexed = loadingScene.indexed;
+	}
+
+	// Uploads the scene which the loading thread produced in place of the previous one
+	void finishSceneLoading()
+	{
+		SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Upload);
+		try
+		{
+			sceneLoading.get();
+		}
+		catch (const std::runtime_error& e)
+		{
+			sceneErrors += e.what();
+			std::cerr << "Resource loading failed:\n" << e.what() << std::endl;
+		}
+		sceneLoading = {};
+		commitSceneSettings();
+
+		clearTextures();
+		CreateTextures();
+		ResolveMaterialTextures();
+		const BVHBuilder& builder = sceneTwoLevel ? twoLevelBuilder.bottomLevel : bvhBuilder;
+		if (builder.m_width != compiledBvhWidth || builder.m_quantizationBits != compiledQuantizationBits
+			|| traversalStackSize() > compiledStackSize || sceneTwoLevel != compiledTwoLevel || sceneIndexed != compiledIndexed)
+		{
+			SceneAndViewSettings::recompileFShaders = true;
+		}
+		if (!sceneTextureErrors.empty())
+		{
+			textureErrors = sceneTextureErrors;
+			ImGui::OpenPopup(textureLoadingFailed);
+			std::cerr << "Texture loading failed \n";
+		}
+		// Opens the popup
+		resourceError += sceneErrors;
+
+		updateBuffers();
+		SceneAndViewSettings::setLoadingPhase(SceneAndViewSettings::LoadingPhase::Idle);
+		std::cout << "Scene " << loadingScene.scene.path.filename() << " loaded." << std::endl
+			<< "Total:\n"
+			<< "Obj " << objects.size() << " (" << objects.size() * sizeof(SceneObject) << " bytes)" << std::endl
+			<< "Attr " << vertexAttributeData().size() / sizeof(float) << " (" << vertexAttributeData().size() << " bytes)" << std::endl
+			<< "Tri " << triangleData().size() << " (" << triangleBufferData().size() << " bytes)" << std::endl
+			<< "Pos " << vertexPositions.size() << " (" << vertexPositions.size() * sizeof(glm::vec3) << " bytes)" << std::endl
+			<< "BVH " << packedBvh().size() << " (" << packedBvh().size() * sizeof(BVHPackedNode) << " bytes)" << std::endl
+			<< "Mat " << materials.size() << " (" << materials.size() * sizeof(Material) << " bytes)" << std::endl
+			<< "Tex " << textureHandles.size() << std::endl;
+	}
+
+	/**
+	* Renders the current view with the CPU port of the shader and saves it to cpuReference.png.
+	* The scene textures are read back from the GPU, because the decoded images are freed after the upload
+	*/
+	void saveCpuReference()
+	{
+		std::vector<CpuRenderer::Texture> cpuTextures(textureIds.size());
+		std::unordered_map<GLuint64, uint32_t> handleIndices;
+		for (std::size_t i = 0; i < textureIds.size(); i++)
+		{
+			if (textureHandles[i] == GLuint64(-1))
+			{
+				continue;
+			}
+			handleIndices.emplace(textureHandles[i], (uint32_t)i);
+			CpuRenderer::Texture& texture = cpuTextures[i];
+			GLint internalFormat;
+			glGetTextureLevelParameteriv(textureIds[i], 0, GL_TEXTURE_WIDTH, &texture.width);
+			glGetTextureLevelParameteriv(textureIds[i], 0, GL_TEXTURE_HEIGHT, &texture.height);
+			glGetTextureLevelParameteriv(textureIds[i], 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+			texture.srgb = internalFormat == GL_SRGB8_ALPHA8 || internalFormat == GL_SRGB8;
+			texture.pixels.resize((std::size_t)texture.width * texture.height * 4);
+			// The stored sRGB values are returned without conversion
+			glGetTextureImage(textureIds[i], 0, GL_RGBA, GL_UNSIGNED_BYTE, (GLsizei)texture.pixels.size(), texture.pixels.data());
+		}
+		// The CPU renderer gets the texture indices instead of the bindless handles
+		std::vector<Material> cpuMaterials = materials;
+		for (Material& material : cpuMaterials)
+		{
+			if (material.isTexture & 1u)
+			{
+				material.colorOrHandle = Material::packHandle(handleIndices.contains(Material::unpackHandle(material.colorOrHandle))
+					? handleIndices.at(Material::unpackHandle(material.colorOrHandle)) : GLuint64(-1));
+			}
+			if (material.isTexture & 2u)
+			{
+				material.emissive = Material::packHandle(handleIndices.contains(Material::unpackHandle(material.emissive))
+					? handleIndices.at(Material::unpackHandle(material.emissive)) : GLuint64(-1));
+			}
+		}
+
+		CpuRenderer::Settings settings = cpuSettings((unsigned int)maxIterations);
+		auto before = std::chrono::system_clock::now();
+		auto image = CpuRenderer::render(cpuScene(cpuMaterials, cpuTextures), cpuCamera(), settings);
+		auto after = std::chrono::system_clock::now();
+		const char* file = "cpuReference.png";
+		if (writeImage(file, image, settings.width, settings.height))
+		{
+			std::cout << "CPU reference with " << settings.iterations << " iterations rendered in "
+				<< std::chrono::duration<float, std::milli>(after - before).count() << " ms and saved to " << std::filesystem::absolute(file) << std::endl;
+		}
+		else
+		{
+			std::cerr << "Could not write " << file << std::endl;
+		}
+	}
+
+	/**
+	* Loads the scene and renders it on the CPU without any window or GL context, then saves the image. Returns the process exit code.
+	* The flat view is rendered at the window size, the quilt holds the Looking Glass views in quiltColumns and quiltRows like the interactive quilt.
+	* The window must be at least as large as the quilt grid
+	*/
+	int renderHeadless(const std::filesystem::path& out, unsigned int iterations, bool quilt)
+	{
+		const float aspect = quilt
+			? (float)((unsigned int)windowWidth / quiltColumns) / ((unsigned int)windowHeight / quiltRows)
+			: windowWidth / windowHeight;
+		person.Camera.SetProjectionMatrixPerspective(fov, aspect, nearPlane, farPlane);
+
+		auto before = std::chrono::system_clock::now();
+		captureSceneSettings();
+		try
+		{
+			loadScene();
+		}
+		catch (const std::runtime_error& e)
+		{
+			sceneErrors += e.what();
+		}
+		commitSceneSettings();
+		if (!sceneErrors.empty())
+		{
+			std::cerr << "Resource loading failed:\n" << sceneErrors << std::endl;
+			return 1;
+		}
+		// The materials still refer to the textures by index. Failed textures stay empty and sample as black
+		std::vector<CpuRenderer::Texture> cpuTextures(decodedTextures.size());
+		for (std::size_t i = 0; i < decodedTextures.size(); i++)
+		{
+			DecodedTexture& decoded = decodedTextures[i];
+			if (decoded.pixels != nullptr)
+			{
+				CpuRenderer::Texture& texture = cpuTextures[i];
+				texture.width = decoded.width;
+				texture.height = decoded.height;
+				// Like the internal formats in CreateTextures
+				texture.srgb = decoded.channels >= 3;
+				texture.pixels.assign(decoded.pixels, decoded.pixels + (std::size_t)decoded.width * decoded.height * 4);
+				stbi_image_free(decoded.pixels);
+			}
+		}
+		decodedTextures.clear();
+		auto loaded = std::chrono::system_clock::now();
+
+		CpuRenderer::Settings settings = cpuSettings(iterations);
+		CpuRenderer::Camera camera = cpuCamera();
+		auto image = quilt
+			? CpuRenderer::renderQuilt(cpuScene(materials, cpuTextures), camera, settings, quiltColumns, quiltRows)
+			: CpuRenderer::render(cpuScene(materials, cpuTextures), camera, settings);
+		auto after = std::chrono::system_clock::now();
+		if (!writeImage(out, image, settings.width, settings.height))
+		{
+			std::cerr << "Could not write " << out << std::endl;
+			return 1;
+		}
+		std::cout << "Scene loaded in " << std::chrono::duration<float, std::milli>(loaded - before).count() << " ms, "
+			<< (quilt ? "quilt" : "image") << " with " << iterations << " iterations rendered in "
+			<< std::chrono::duration<float, std::milli>(after - loaded).count() << " ms and saved to " << std::filesystem::absolute(out) << std::endl;
+		return 0;
+	}
+
+	// The scene as the shader sees it, with the materials referring to the textures by index
+	CpuRenderer::Scene cpuScene(std::span<const Material> cpuMaterials, std::span<const CpuRenderer::Texture> cpuTextures)
+	{
+		const BVHBuilder& builder = sceneTwoLevel ? twoLevelBuilder.bottomLevel : bvhBuilder;
+		auto attributes = vertexAttributeData();
+		CpuRenderer::Scene result;
+		result.bvh = packedBvh();
+		result.bvhWidth = builder.m_width;
+		result.quantizationBits = builder.m_quantizationBits;
+		result.traversalStackSize = traversalStackSize();
+		result.twoLevel = sceneTwoLevel;
+		result.topLevelRoot = twoLevelBuilder.m_topLevelRoot;
+		result.indexedPositions = sceneIndexed;
+		result.trianglesSecond = triangleData();
+		result.trianglesIndexed = indexedTriangles;
+		result.vertexPositions = vertexPositions;
+		result.vertexAttrs = std::span<const float>(reinterpret_cast<const float*>(attributes.data()), attributes.size() / sizeof(float));
+		result.objects = objects;
+		result.materials = cpuMaterials;
+		result.textures = cpuTextures;
+		result.lights = lights;
+		result.sceneNormalMatrix = sceneNormalMatrix;
+		return result;
+	}
+
+	CpuRenderer::Camera cpuCamera()
+	{
+		CpuRenderer::Camera camera;
+		camera.view = person.Camera.GetViewMatrix();
+		camera.proj = person.Camera.GetProjectionMatrix();
+		camera.lookingGlass = GlobalScreenType == ScreenType::LookingGlass;
+		camera.calibration = calibration.forShader();
+		camera.viewCone = glm::radians(viewCone);
+		camera.focusDistance = focusDistance;
+		return camera;
+	}
+
+	CpuRenderer::Settings cpuSettings(unsigned int iterations)
+	{
+		CpuRenderer::Settings settings;
+		settings.width = (unsigned int)windowWidth;
+		settings.height = (unsigned int)windowHeight;
+		settings.iterations = iterations;
+		settings.maxBounces = (unsigned int)maxBounces;
+		settings.rayOffset = rayOffset;
+		settings.backfaceCulling = backfaceCulling;
+		return settings;
+	}
+
+	// Radiance HDR with linear colors for .hdr files, gamma-corrected PNG otherwise. The image rows are from the bottom
+	static bool writeImage(const std::filesystem::path& file, std::span<const glm::vec3> image, unsigned int width, unsigned int height)
+	{
+		if (file.extension() == ".hdr")
+		{
+			std::vector<float> rows((std::size_t)width * height * 3);
+			for (unsigned int y = 0; y < height; y++)
+			{
+				std::memcpy(&rows[(std::size_t)(height - 1 - y) * width * 3], &image[(std::size_t)y * width], (std::size_t)width * sizeof(glm::vec3));
+			}
+			return stbi_write_hdr(file.string().c_str(), width, height, 3, rows.data());
+		}
+		auto pixels = CpuRenderer::toRgb8(image, width, height);
+		return stbi_write_png(file.string().c_str(), width, height, 3, pixels.data(), width * 3);
+	}
+
 	void updateCalibrationBuffer()
 	{
 		glBindBuffer(GL_UNIFORM_BUFFER, uCalibrationHandle);
@@ -573,12 +1268,14 @@ public:
 
 	void updateBuffers()
 	{
-		updateFlexibleBuffer(bufferHandles.vertex, vertexAttrs);
-		//Store only the second half of values inside triangle buffer. The first half is inside BVH
-		updateFlexibleBuffer(bufferHandles.triangles, trianglesSecond);
+		updateFlexibleBuffer(bufferHandles.vertex, vertexAttributeData());
+		updateFlexibleBuffer(bufferHandles.triangles, triangleBufferData());
+		updateFlexibleBuffer(bufferHandles.positions, vertexPositions);
 		updateFlexibleBuffer(bufferHandles.material, materials);
 		updateFlexibleBuffer(bufferHandles.lights, lights);
-		updateFlexibleBuffer(bufferHandles.bvh, bvhBuilder.m_packedNodes);
+		updateFlexibleBuffer(bufferHandles.bvh, packedBvh());
+		glUniform1ui(shaderInputs.uTopLevelRoot, twoLevelBuilder.m_topLevelRoot);
+		glUniformMatrix3fv(shaderInputs.uSceneNormalMatrix, 1, false, glm::value_ptr(sceneNormalMatrix));
 		updateCalibrationBuffer();
 		submitObjectBuffer();
 	}
@@ -592,7 +1289,61 @@ public:
 		materials.clear();
 		lights.clear();
 		sceneMaterialIndices.clear();
-		clearTextures();
+		submittedMeshes.clear();
+		bvhMeshes.clear();
+		instanceMeshes.clear();
+		instanceTransforms.clear();
+		bvhInstances.clear();
+		sceneTrianglesFirst.clear();
+		sceneTrianglesSecond.clear();
+		scenePositions.clear();
+		vertexPositions.clear();
+		indexedTriangles.clear();
+		sceneMeshes.clear();
+		sceneCacheFile.close();
+		mappedVertexAttrs = {};
+		mappedTriangles = {};
+		texturePaths.clear();
+		textureIndices.clear();
+	}
+
+	std::span<const char> vertexAttributeData()
+	{
+		return sceneCacheFile.isOpen() ? mappedVertexAttrs : vertexAttrs.bytes();
+	}
+
+	// Second halves of the triangles. The first halves are inside the BVH
+	std::span<const FastTriangleSecondHalf> triangleData()
+	{
+		return triangleData(sceneTwoLevel);
+	}
+
+	std::span<const FastTriangleSecondHalf> triangleData(bool twoLevel)
+	{
+		return sceneCacheFile.isOpen() && twoLevel ? mappedTriangles : std::span<const FastTriangleSecondHalf>(trianglesSecond);
+	}
+
+	// Contents of the triangle buffer. Store only the second half of values inside it, the first half is inside the BVH.
+	// Indexed triangles keep only the indices and the object
+	std::span<const std::byte> triangleBufferData()
+	{
+		if (sceneIndexed)
+		{
+			return std::as_bytes(std::span<const IndexedTriangle>(indexedTriangles));
+		}
+		return std::as_bytes(triangleData());
+	}
+
+	void packIndexedTriangles()
+	{
+		indexedTriangles.clear();
+		if (loadingScene.indexed)
+		{
+			for (const FastTriangleSecondHalf& triangle : triangleData(loadingScene.twoLevel))
+			{
+				indexedTriangles.push_back({ triangle.indices, triangle.objectIndex });
+			}
+		}
 	}
 
 	bool workOnEvent(SDL_Event event, float deltaTime) override
@@ -677,9 +1428,9 @@ public:
 		}
 		return false;
 	}
-	void swapShaders(GLuint before, GLuint after)
+	void swapShaders(GLuint after)
 	{
-		glDetachShader(program, before);
+		detachFragmentShaders();
 		glAttachShader(program, after);
 		GlHelpers::linkProgram(program);
 		bindShaderInputs();
@@ -753,7 +1504,7 @@ public:
 			throw std::runtime_error(fmt::format("Could not open scene file {}: \n{}", pFile.string(), importer.GetErrorString()));
 		}
 
-		gScene = importer.ReadFile(pFile.string(), aiProcessPreset_TargetRealtime_Quality | aiPostProcessSteps::aiProcess_FlipUVs | aiPostProcessSteps::aiProcess_FixInfacingNormals | aiPostProcessSteps::aiProcess_Triangulate);
+		gScene = importer.ReadFile(pFile.string(), ImportFlags);
 
 		// If the import failed, report it
 		if (!gScene)
@@ -768,10 +1519,9 @@ public:
 		// We're done. Everything will be cleaned up by the importer destructor
 	}
 
-	// Returns errors list
-	std::string LoadGLTextures(const aiScene* scene)
+	// Collects the texture paths of the materials. Returns errors list
+	std::string CollectTextures(const aiScene* scene)
 	{
-		std::stringstream ss;
 		if (scene->HasTextures())
 		{
 			return "Support for meshes with embedded textures is not implemented yet.\n";
@@ -818,9 +1568,7 @@ public:
 					std::cerr << "texture " << texIndex << " not loaded" << std::endl;
 					continue;
 				}
-				textureHandleMap.emplace(path.data, std::make_tuple(
-					std::reference_wrapper(invalidHandle), GLuint64(-1)
-				)); //fill map with texture paths, handles are still pseudo-NULL yet
+				addTexture(path.data);
 			}
 
 			texCount = material->GetTextureCount(aiTextureType_EMISSIVE);
@@ -832,93 +1580,346 @@ public:
 					std::cerr << "texture " << texIndex << " not loaded" << std::endl;
 					continue;
 				}
-				textureHandleMap.emplace(path.data, std::make_tuple(
-					std::reference_wrapper(invalidHandle), GLuint64(-1)
-				)); //fill map with texture paths, handles are still pseudo-NULL yet
+				addTexture(path.data);
 			}
 		}
+		return "";
+	}
+
+	void addTexture(const std::string& path)
+	{
+		if (textureIndices.emplace(path, (uint32_t)texturePaths.size()).second)
+		{
+			texturePaths.push_back(path);
+		}
+	}
 
-		const size_t numTextures = textureHandleMap.size();
+	// Decodes the images in texturePaths in parallel on the shared thread pool. Returns errors list
+	std::string DecodeTextures()
+	{
+		const size_t numTextures = texturePaths.size();
+		decodedTextures.resize(numTextures);
+		// Collected per texture so the list keeps the order of the textures
+		std::vector<std::string> errors(numTextures);
+		std::atomic<size_t> decoded = 0;
+
+		std::filesystem::path sceneDir = std::filesystem::absolute(loadingScene.scene.path).parent_path();
+		ThreadPool::shared().parallelFor(0, numTextures, 1, [&](size_t i)
+			{
+				std::filesystem::path fileloc = sceneDir / texturePaths[i];	/* Loading of image */
+				DecodedTexture& texture = decodedTextures[i];
+				texture.pixels = stbi_load(fileloc.string().c_str(), &texture.width, &texture.height, &texture.channels, STBI_rgb_alpha);
+				SceneAndViewSettings::loadingProgress = (float)++decoded / numTextures;
+
+				if (texture.pixels == nullptr)
+				{
+					errors[i] = fmt::format("Couldn't load Image: {}\n", fileloc.string());
+				}
+				else if (texture.channels < 1 || texture.channels > 4)
+				{
+					errors[i] = fmt::format("Texture {} has unsupported channel count of {}.\n", i, texture.channels);
+					stbi_image_free(texture.pixels);
+					texture.pixels = nullptr;
+				}
+			});
+
+		std::stringstream ss;
+		for (const std::string& error : errors)
+		{
+			if (!error.empty() && ss.rdbuf()->in_avail() == 0)
+			{
+				//is still empty
+				ss << "Encountered error(s) when loading texture(s):" << std::endl;
+			}
+			ss << error;
+		}
+		std::cerr << ss.str();
+		return ss.str();
+	}
+
+	/**
+	* Creates the GL textures for the decoded images on the render thread and makes them resident. The pixels are uploaded later by streamTextures().
+	* The textures are not compressed, because the driver would compress them synchronously on the upload
+	*/
+	void CreateTextures()
+	{
+		const size_t numTextures = decodedTextures.size();
 
 		///
 		/// Create and fill array with GL texture names
 		/// 
 		textureIds.resize(numTextures);
+		textureHandles.assign(numTextures, GLuint64(-1));
 		glCreateTextures(GL_TEXTURE_2D, static_cast<GLsizei>(numTextures), textureIds.data()); /* Texture name generation */
 
-		/* get iterator */
-		decltype(textureHandleMap)::iterator itr = textureHandleMap.begin();
-
-		std::filesystem::path sceneDir = std::filesystem::absolute(SceneAndViewSettings::scene.path).parent_path();
-		for (size_t i = 0; i < numTextures; i++, itr++)
+		std::size_t maxRowSize = 0;
+		for (size_t i = 0; i < numTextures; i++)
 		{
-			std::string filename = (*itr).first;		// get filename
-			std::get<0>((*itr).second) = textureIds[i]; // save texture id for filename in map
-
-			std::filesystem::path fileloc = sceneDir / filename;	/* Loading of image */
-			int w, h, channelsCount;
-			GLenum format = 0;
-			GLint internalFormat = 0;
-			unsigned char* data = stbi_load(fileloc.string().c_str(), &w, &h, &channelsCount, STBI_rgb_alpha);
-
-			switch (channelsCount)
+			DecodedTexture& texture = decodedTextures[i];
+			if (texture.pixels == nullptr)
+			{
+				continue;
+			}
+			GLenum internalFormat = 0;
+			switch (texture.channels)
 			{
 			case 4:
-				format = GL_RGBA;
-				internalFormat = GL_COMPRESSED_SRGB_ALPHA;
+				internalFormat = GL_SRGB8_ALPHA8;
 				break;
 			case 3:
-				format = GL_RGB;
-				internalFormat = GL_COMPRESSED_SRGB;
+				internalFormat = GL_SRGB8;
 				break;
 			case 2:
-				format = GL_RG;
-				internalFormat = GL_COMPRESSED_RG;
-				break;
-			case 1:
-				format = GL_RED;
-				internalFormat = GL_COMPRESSED_RED;
+				internalFormat = GL_RG8;
 				break;
 			default:
-				ss << "Texture " << i << " has unsupported channel count of " << channelsCount << ".\n";
+				internalFormat = GL_R8;
+				break;
+			}
+
+			auto& currentTex = textureIds[i];
+			const GLsizei levels = 1 + (GLsizei)std::log2(std::max(texture.width, texture.height));
+			glTextureStorage2D(currentTex, levels, internalFormat, texture.width, texture.height);
+			// Black until the texture arrives
+			for (GLint level = 0; level < levels; level++)
+			{
+				glClearTexImage(currentTex, level, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			}
+			// We will use linear interpolation for magnification filter
+			glTextureParameteri(currentTex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			// We will use linear interpolation for minifying filter
+			glTextureParameteri(currentTex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+			// The contents of a resident texture can still be changed
+			auto bindlessHandle = glGetTextureHandleARB(currentTex);
+			glMakeTextureHandleResidentARB(bindlessHandle);
+			textureHandles[i] = bindlessHandle;
+			maxRowSize = std::max(maxRowSize, (std::size_t)texture.width * 4);
+		}
+
+		// Every upload needs at least a whole row
+		const std::size_t bufferSize = std::max<std::size_t>(SceneAndViewSettings::textureUploadBudget * 1024, maxRowSize);
+		if (textureStream.buffers[0] == 0)
+		{
+			glCreateBuffers((GLsizei)textureStream.buffers.size(), textureStream.buffers.data());
+		}
+		if (bufferSize != textureStream.bufferSize)
+		{
+			for (GLuint buffer : textureStream.buffers)
+			{
+				glNamedBufferData(buffer, bufferSize, nullptr, GL_STREAM_DRAW);
+			}
+			textureStream.bufferSize = bufferSize;
+		}
+		textureStream.textures = std::move(decodedTextures);
+		decodedTextures.clear();
+		textureStream.start = std::chrono::system_clock::now();
+	}
+
+	/**
+	* Uploads the next part of the textures through the buffer ring, at most one buffer per frame.
+	* The mipmaps of a texture are generated once its last row arrives
+	*/
+	void streamTextures()
+	{
+		auto& stream = textureStream;
+		if (stream.nextTexture >= stream.textures.size())
+		{
+			return;
+		}
+		GLsync& fence = stream.fences[stream.current];
+		if (fence != nullptr)
+		{
+			// The GPU still reads the buffer, try again in the next frame
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			{
+				return;
+			}
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+
+		struct Upload
+		{
+			std::size_t texture;
+			int row;
+			int rowCount;
+			std::size_t offset;
+		};
+		std::vector<Upload> uploads;
+		GLuint buffer = stream.buffers[stream.current];
+		auto mapped = static_cast<unsigned char*>(glMapNamedBufferRange(buffer, 0, stream.bufferSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+		std::size_t used = 0;
+		while (stream.nextTexture < stream.textures.size())
+		{
+			const DecodedTexture& texture = stream.textures[stream.nextTexture];
+			const std::size_t rowSize = (std::size_t)texture.width * 4;
+			if (texture.pixels == nullptr || stream.nextRow >= texture.height)
+			{
+				stream.nextTexture++;
+				stream.nextRow = 0;
 				continue;
 			}
+			const int rowCount = (int)std::min<std::size_t>(texture.height - stream.nextRow, (stream.bufferSize - used) / rowSize);
+			if (rowCount == 0)
+			{
+				break;
+			}
+			std::memcpy(mapped + used, texture.pixels + stream.nextRow * rowSize, rowCount * rowSize);
+			uploads.push_back({ stream.nextTexture, stream.nextRow, rowCount, used });
+			used += rowCount * rowSize;
+			stream.nextRow += rowCount;
+		}
+		glUnmapNamedBuffer(buffer);
 
-			if (nullptr != data)
-			{
-				// Binding of texture name
-				auto& currentTex = textureIds[i];
-				// redefine standard texture values
-				// We will use linear interpolation for magnification filter
-				glTextureImage2DEXT(currentTex, GL_TEXTURE_2D, 0, internalFormat, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-				glTextureParameteri(currentTex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-				// We will use linear interpolation for minifying filter
-				glTextureParameteri(currentTex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-				// we also want to be able to deal with odd texture dimensions
-				glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-				glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-				glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-
-				glGenerateMipmap(GL_TEXTURE_2D);
-				auto bindlessHandle = glGetTextureHandleARB(currentTex);
-				glMakeTextureHandleResidentARB(bindlessHandle);
-				std::get<1>((*itr).second) = bindlessHandle;
-				stbi_image_free(data);
+		// Whole rows, so the default unpack state fits
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+		for (const Upload& upload : uploads)
+		{
+			DecodedTexture& texture = stream.textures[upload.texture];
+			glTextureSubImage2D(textureIds[upload.texture], 0, 0, upload.row, texture.width, upload.rowCount, GL_RGBA, GL_UNSIGNED_BYTE, (const void*)upload.offset);
+			if (upload.row + upload.rowCount == texture.height)
+			{
+				glGenerateTextureMipmap(textureIds[upload.texture]);
+				stbi_image_free(texture.pixels);
+				texture.pixels = nullptr;
+				// The accumulated image was traced with the texture missing
+				SceneAndViewSettings::rayIteration = 0;
 			}
-			else
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		stream.current = (stream.current + 1) % stream.buffers.size();
+
+		if (stream.nextTexture >= stream.textures.size())
+		{
+			std::cout << "Textures streamed in "
+				<< std::chrono::duration<float, std::milli>(std::chrono::system_clock::now() - stream.start).count() << " ms" << std::endl;
+			stream.textures.clear();
+			stream.nextTexture = 0;
+		}
+	}
+
+	// Materials refer to their textures by index until the textures are uploaded
+	void ResolveMaterialTextures()
+	{
+		for (Material& material : materials)
+		{
+			if (material.isTexture & 1u)
 			{
-				// Error occurred
-				if (ss.rdbuf()->in_avail() == 0)
-				{
-					//is still empty
-					ss << "Encountered error(s) when loading texture(s):" << std::endl;
-				}
-				ss << "Couldn't load Image: " << fileloc << std::endl;
+				material.colorOrHandle = Material::packHandle(textureHandles.at(Material::unpackHandle(material.colorOrHandle)));
+			}
+			if (material.isTexture & 2u)
+			{
+				material.emissive = Material::packHandle(textureHandles.at(Material::unpackHandle(material.emissive)));
 			}
 		}
-		std::cerr << ss.rdbuf();
-		return ss.str();
+	}
+
+	std::string sceneCacheKey()
+	{
+		std::error_code error;
+		const auto& loaded = loadingScene.scene;
+		auto path = std::filesystem::absolute(loaded.path, error);
+		auto modified = std::filesystem::last_write_time(loaded.path, error).time_since_epoch().count();
+		// The two-level BVH does not depend on the scene transform
+		std::string transform = loadingScene.twoLevel ? "" : fmt::format("{},{},{} {},{},{} {},{},{}",
+			loaded.scale.x, loaded.scale.y, loaded.scale.z,
+			loaded.position.x, loaded.position.y, loaded.position.z,
+			loaded.rotationDeg.x, loaded.rotationDeg.y, loaded.rotationDeg.z);
+		return fmt::format("{}|{}|{:x}|{}|{} {}|{} {} {} {} {} {} {} {} {} {} {} {}",
+			path.string(), modified, ImportFlags, transform, objectCountLimit, lightMultiplier,
+			loadingScene.twoLevel, loadingScene.indexed, bvhSAHthreshold, (int)bvhSplitMethod, bvhBinCount, (int)bvhLargeNodeSplit, bvhMaxLeafSize,
+			bvhSpatialSplits, bvhSpatialSplitBudget, (int)bvhLayout, (int)bvhQuantization, sizeof(ai_real));
+	}
+
+	/**
+	* Stores everything the scene reload produces before the scene transform is applied, with the built BVH.
+	* Runs before the textures are uploaded, so the materials still refer to the texture paths by index.
+	*/
+	bool saveSceneCache(const std::string& key)
+	{
+		SceneCache::Writer cache(key);
+		std::string joinedPaths;
+		for (const std::string& path : texturePaths)
+		{
+			joinedPaths.append(path).push_back('\0');
+		}
+		std::vector<unsigned int> submittedMeshIndices;
+		std::vector<SubmittedMesh> submittedMeshValues;
+		for (const auto& [meshIndex, mesh] : submittedMeshes)
+		{
+			submittedMeshIndices.push_back(meshIndex);
+			submittedMeshValues.push_back(mesh);
+		}
+
+		cache.add(std::span<const char>(joinedPaths));
+		cache.add(materials);
+		cache.add(objects);
+		cache.add(vertexAttrs.data);
+		cache.add(loadingScene.twoLevel ? trianglesFirst : sceneTrianglesFirst);
+		cache.add(loadingScene.twoLevel ? trianglesSecond : sceneTrianglesSecond);
+		cache.add(loadingScene.twoLevel ? vertexPositions : scenePositions);
+		cache.add(sceneMeshes);
+		cache.add(submittedMeshIndices);
+		cache.add(submittedMeshValues);
+		cache.add(bvhMeshes);
+		cache.add(instanceMeshes);
+		cache.add(instanceTransforms);
+		if (loadingScene.twoLevel)
+		{
+			twoLevelBuilder.save(cache);
+		}
+		else
+		{
+			bvhBuilder.save(cache);
+		}
+		return cache.save(SceneCache::fileFor(key));
+	}
+
+	/**
+	* Loads what saveSceneCache stored. The scene transform must be applied afterwards.
+	* The cache stays mapped while the scene is loaded. The vertex attributes and the triangles of the two-level BVH are not copied out of it
+	*/
+	bool loadSceneCache(const std::string& key)
+	{
+		SceneCache::Reader& cache = sceneCacheFile;
+		if (!cache.open(SceneCache::fileFor(key), key))
+		{
+			return false;
+		}
+		std::span<const char> joinedPaths;
+		std::span<const FastTriangleFirstHalf> mappedTrianglesFirst;
+		std::vector<unsigned int> submittedMeshIndices;
+		std::vector<SubmittedMesh> submittedMeshValues;
+		bool complete = cache.view(joinedPaths) && cache.read(materials) && cache.read(objects) && cache.view(mappedVertexAttrs)
+			&& (loadingScene.twoLevel
+				// The bottom levels hold the first halves and the triangles never move
+				? cache.view(mappedTrianglesFirst) && cache.view(mappedTriangles)
+				: cache.read(sceneTrianglesFirst) && cache.read(sceneTrianglesSecond))
+			&& cache.read(loadingScene.twoLevel ? vertexPositions : scenePositions)
+			&& cache.read(sceneMeshes) && cache.read(submittedMeshIndices) && cache.read(submittedMeshValues)
+			&& cache.read(bvhMeshes) && cache.read(instanceMeshes) && cache.read(instanceTransforms)
+			&& submittedMeshIndices.size() == submittedMeshValues.size()
+			&& (loadingScene.twoLevel ? twoLevelBuilder.load(cache) : bvhBuilder.load(cache));
+		if (!complete)
+		{
+			clearBuffers();
+			return false;
+		}
+
+		// The materials keep the texture indices, the handles are resolved after the upload
+		for (std::size_t begin = 0; begin < joinedPaths.size();)
+		{
+			auto end = std::find(joinedPaths.begin() + begin, joinedPaths.end(), '\0') - joinedPaths.begin();
+			addTexture(std::string(joinedPaths.data() + begin, end - begin));
+			begin = end + 1;
+		}
+		for (std::size_t i = 0; i < submittedMeshIndices.size(); i++)
+		{
+			submittedMeshes.emplace(submittedMeshIndices[i], submittedMeshValues[i]);
+		}
+		return true;
 	}
 
 	void SubmitMaterial(const aiMaterial* mtl)
@@ -938,10 +1939,8 @@ public:
 		Material newMat;
 		if (AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, texIndex, &texPath) && CheckTextureExistence(texPath, mtl))
 		{
-			auto& handleAndId = textureHandleMap.at(texPath.data);
-			auto& texHandle = std::get<1>(handleAndId);
-			// pass a handle to a bindless texture in the material
-			newMat = Material(texHandle);
+			// pass the texture index in the material, it is replaced by the bindless handle after the upload
+			newMat = Material((glm::uint64)textureIndices.at(texPath.data));
 		}
 		else if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
 		{
@@ -953,9 +1952,7 @@ public:
 		}
 		if (AI_SUCCESS == aiGetMaterialTexture(mtl, aiTextureType_EMISSIVE, texIndex, &texPath) && CheckTextureExistence(texPath, mtl))
 		{
-			auto& handleAndId = textureHandleMap.at(texPath.data);
-			auto& texHandle = std::get<1>(handleAndId);
-			newMat.setEmissive(texHandle);
+			newMat.setEmissive((glm::uint64)textureIndices.at(texPath.data));
 		}
 		else if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_EMISSIVE, &emission))
 		{
@@ -966,7 +1963,7 @@ public:
 
 	bool CheckTextureExistence(aiString& texPath, const aiMaterial* mtl)
 	{
-		if (!textureHandleMap.contains(texPath.data))
+		if (!textureIndices.contains(texPath.data))
 		{
 			std::cerr << "Material " << mtl->GetName().C_Str() << " needs texture " << texPath.C_Str() << " but it wasn't loaded properly." << std::endl;
 			return false;
@@ -981,166 +1978,398 @@ public:
 		return uvNum;
 	}
 
-	void pushAttributes(const aiMesh* mesh, std::size_t& index, const aiMatrix4x4& transMat, const aiMatrix3x3& normalTransMat)
+	// Floats per vertex in the attribute arena
+	std::size_t attributeStride(const aiMesh* mesh)
+	{
+		return (mesh->HasVertexColors(0) ? 4 : 0) + (mesh->mNormals != nullptr ? 3 : 0) + 2 * getUvNum(mesh);
+	}
+
+	// Fills the attributes of all the mesh vertices, one attribute at a time
+	void writeAttributes(const aiMesh* mesh, const aiMatrix3x3& normalTransMat, float* first)
 	{
-		auto uvNum = getUvNum(mesh);
-		if (mesh->HasVertexColors(0))// If the mesh has vertex colors
+		const bool colors = mesh->HasVertexColors(0);
+		const bool normals = mesh->mNormals != nullptr;
+		const auto uvNum = getUvNum(mesh);
+		const std::size_t stride = attributeStride(mesh);
+
+		float* attribute = first;
+		if (colors)
 		{
-			auto col = mesh->mColors[0][index];
-			vertexAttrs.push(GlHelpers::aiToGlm(col));
+			for (unsigned int v = 0; v < mesh->mNumVertices; v++)
+			{
+				const aiColor4D& col = mesh->mColors[0][v];
+				float* vertex = attribute + v * stride;
+				vertex[0] = (float)col.r;
+				vertex[1] = (float)col.g;
+				vertex[2] = (float)col.b;
+				vertex[3] = (float)col.a;
+			}
+			attribute += 4;
 		}
-		if (mesh->mNormals != nullptr)
+		if (normals)
 		{
-			auto norm = normalTransMat * mesh->mNormals[index];
-			vertexAttrs.push(GlHelpers::aiToGlm(norm));
+			GlHelpers::transformDirections(normalTransMat, mesh->mNormals, attribute, stride, mesh->mNumVertices);
+			attribute += 3;
 		}
 		for (unsigned int t = 0; t < uvNum; t++)
 		{
-			//for (auto t = (decltype(mesh->mNumUVComponents[0]))0;
-			//	t < mesh->mNumUVComponents[0]; t++)
+			for (unsigned int v = 0; v < mesh->mNumVertices; v++)
 			{
-				auto tCor = mesh->mTextureCoords[t][index];
-				vertexAttrs.push(float(tCor.x));
-				vertexAttrs.push(float(tCor.y));
+				const auto& tCor = mesh->mTextureCoords[t][v];
+				float* vertex = attribute + v * stride;
+				vertex[0] = (float)tCor.x;
+				vertex[1] = (float)tCor.y;
 			}
+			attribute += 2;
 		}
 	}
 
-	void SubmitScene(const struct aiScene* sc, const struct aiNode* nd = nullptr, aiMatrix4x4 transformationMatrix = aiMatrix4x4())
+	/**
+	* Submits the meshes of the node tree in two passes. The first one walks the tree and assigns the objects, the materials
+	* and the ranges of the mesh data. The second one transforms and packs the meshes into their ranges in parallel,
+	* so the output does not depend on the thread count.
+	*/
+	void SubmitScene(const struct aiScene* sc)
 	{
-		if (nd == nullptr)
+		std::vector<PendingMesh> pending;
+		MeshRanges ranges{ vertexAttrs.size(), trianglesFirst.size(), vertexPositions.size() };
+		PlaceMeshes(sc, sc->mRootNode, aiMatrix4x4(), pending, ranges);
+
+		vertexAttrs.allocate(ranges.attributeCount - vertexAttrs.size());
+		trianglesFirst.resize(ranges.triangleCount);
+		trianglesSecond.resize(ranges.triangleCount);
+		vertexPositions.resize(ranges.positionCount);
+		std::atomic<bool> nonTriangleFaces = false;
+		std::atomic<std::size_t> submitted = 0;
+		ThreadPool::shared().parallelFor(0, pending.size(), 1, [&](std::size_t i)
+			{
+				if (!SubmitMesh(pending[i]))
+				{
+					nonTriangleFaces = true;
+				}
+				SceneAndViewSettings::loadingProgress = (float)++submitted / pending.size();
+			});
+		if (nonTriangleFaces)
+		{
+			sceneErrors += "Only triangle meshes are supported yet.";
+		}
+
+		for (const PendingMesh& placed : pending)
 		{
-			nd = sc->mRootNode;
+			if (loadingScene.twoLevel)
+			{
+				submittedMeshes.at(placed.meshIndex) = placed.submitted;
+			}
+			else
+			{
+				sceneMeshes.push_back(placed.submitted);
+			}
 		}
+		std::cout << "Submitted " << pending.size() << " meshes with " << ranges.triangleCount << " triangles" << std::endl;
+	}
+
+	void PlaceMeshes(const struct aiScene* sc, const struct aiNode* nd, aiMatrix4x4 transformationMatrix,
+		std::vector<PendingMesh>& pending, MeshRanges& ranges)
+	{
 		transformationMatrix = transformationMatrix * nd->mTransformation;
 
 		// draw all meshes assigned to this node
 		for (auto n = (decltype(nd->mNumMeshes))0; n < nd->mNumMeshes; ++n)
 		{
-			std::cout << nd->mName.C_Str() << " has a mesh\n";
-			glm::vec3 aabbMax(-std::numeric_limits<float>::infinity());
-			glm::vec3 aabbMin(std::numeric_limits<float>::infinity());
-			glm::vec3 averageNormal = glm::vec3(0, -1, 0);
+			unsigned int meshIndex = nd->mMeshes[n];
+			if (loadingScene.twoLevel)
+			{
+				// Two-level BVH: every mesh is submitted once in its own space and the node only adds an instance of it
+				if (!submittedMeshes.contains(meshIndex))
+				{
+					if (!PlaceMesh(sc, meshIndex, aiMatrix4x4(), pending, ranges))
+					{
+						return;
+					}
+					PendingMesh& placed = pending.back();
+					placed.submitted.bvhMesh = (GLuint)bvhMeshes.size();
+					bvhMeshes.push_back({ (GLuint)placed.triangleOffset, placed.mesh->mNumFaces });
+					submittedMeshes.emplace(meshIndex, placed.submitted);
+				}
+				instanceMeshes.push_back(meshIndex);
+				instanceTransforms.push_back(transformationMatrix);
+				continue;
+			}
 
-			if (objects.size() >= objectCountLimit)
+			if (!PlaceMesh(sc, meshIndex, transformationMatrix, pending, ranges))
 			{
 				return;
 			}
-			const struct aiMesh* mesh = sc->mMeshes[nd->mMeshes[n]];
+		}
+
+		// draw all children
+		for (auto n = (decltype(nd->mNumChildren))0; n < nd->mNumChildren; ++n)
+		{
+			PlaceMeshes(sc, nd->mChildren[n], transformationMatrix, pending, ranges);
+		}
+	}
+
+	// Assigns the object, the material and the data ranges of a mesh. Returns false when no more objects can be submitted
+	bool PlaceMesh(const struct aiScene* sc, unsigned int meshIndex, const aiMatrix4x4& transformationMatrix,
+		std::vector<PendingMesh>& pending, MeshRanges& ranges)
+	{
+		const aiMesh* mesh = sc->mMeshes[meshIndex];
+		if (objects.size() >= objectCountLimit)
+		{
+			return false;
+		}
+		// Triangulation and sorting by primitive type leave points and lines in meshes of their own
+		if (mesh->mPrimitiveTypes & (aiPrimitiveType_POINT | aiPrimitiveType_LINE | aiPrimitiveType_POLYGON))
+		{
+			sceneErrors += "Only triangle meshes are supported yet.";
+			return false;
+		}
 
-			for (unsigned int t = 0; t < getUvNum(mesh); t++)
+		for (unsigned int t = 0; t < getUvNum(mesh); t++)
+		{
+			if (mesh->mNumUVComponents[t] != 2)
 			{
-				if (mesh->mNumUVComponents[t] != 2)
-				{
-					resourceError += "Only meshes with two-dimensional UVs are supported yet.";
-				}
+				sceneErrors += "Only meshes with two-dimensional UVs are supported yet.";
 			}
+		}
 
-			auto vboCursorPos = vertexAttrs.totalSize / sizeof(float);
-			auto triCursorPos = trianglesFirst.size();
-			auto materialCursorPos = materials.size();
-			auto lightCursorPos = lights.size();
+		uint32_t materialIndex;
+		if (sceneMaterialIndices.contains(mesh->mMaterialIndex))
+		{
+			materialIndex = sceneMaterialIndices[mesh->mMaterialIndex];
+		}
+		else
+		{
+			materialIndex = (uint32_t)materials.size();
+			SubmitMaterial(sc->mMaterials[mesh->mMaterialIndex]);
+			sceneMaterialIndices.emplace(mesh->mMaterialIndex, materialIndex);
+		}
+
+		PendingMesh& placed = pending.emplace_back();
+		placed.mesh = mesh;
+		placed.meshIndex = meshIndex;
+		placed.transform = transformationMatrix;
+		placed.attributeOffset = ranges.attributeCount;
+		placed.triangleOffset = ranges.triangleCount;
+		placed.positionOffset = ranges.positionCount;
+		placed.submitted.object = (uint32_t)objects.size();
+		objects.push_back(SceneObject(
+			materialIndex, ranges.attributeCount, ranges.triangleCount, mesh->mNumFaces,
+			mesh->HasVertexColors(0), mesh->HasNormals(), mesh->HasTextureCoords(0)
+		));
+		objects.back().positionPointer = (uint32_t)ranges.positionCount;
+		ranges.attributeCount += attributeStride(mesh) * mesh->mNumVertices;
+		ranges.triangleCount += mesh->mNumFaces;
+		if (loadingScene.indexed)
+		{
+			ranges.positionCount += mesh->mNumVertices;
+		}
+		return true;
+	}
+
+	glm::mat4 sceneTransform()
+	{
+		const auto& loaded = loadingScene.scene;
+		aiMatrix4x4 transform(loaded.scale, aiQuaternion(
+			glm::radians(loaded.rotationDeg.x), glm::radians(loaded.rotationDeg.y), glm::radians(loaded.rotationDeg.z)
+		), loaded.position);
+		// Assimp matrices are row-major
+		return glm::mat4(glm::transpose(glm::make_mat4(&transform.a1)));
+	}
 
-			std::size_t v = 0;
-			auto normalTransMat = aiMatrix3x3(transformationMatrix).Inverse().Transpose();
-			pushAttributes(mesh, v, transformationMatrix, normalTransMat);
-			if (mesh->mNormals != nullptr)
+	/**
+	* Places the instances of the two-level BVH or transforms the triangles of the single-level one by the scene transform.
+	* The lights of emissive meshes move with them. The BVH must be built or refitted afterwards.
+	*/
+	void applySceneTransform()
+	{
+		glm::mat4 sceneMatrix = sceneTransform();
+		lights.clear();
+		if (loadingScene.twoLevel)
+		{
+			bvhInstances.clear();
+			for (std::size_t i = 0; i < instanceMeshes.size(); i++)
 			{
-				averageNormal = GlHelpers::aiToGlm(normalTransMat * mesh->mNormals[v]);
+				const SubmittedMesh& mesh = submittedMeshes.at(instanceMeshes[i]);
+				glm::mat4 transform = sceneMatrix * glm::mat4(glm::transpose(glm::make_mat4(&instanceTransforms[i].a1)));
+				bvhInstances.push_back({ transform, mesh.bvhMesh });
+				submitLight(mesh, transform);
 			}
-			for (v = 1; v < mesh->mNumVertices; v++)
+		}
+		else
+		{
+			glm::mat3 linear(sceneMatrix);
+			glm::vec3 translation(sceneMatrix[3]);
+			trianglesFirst.resize(sceneTrianglesFirst.size());
+			trianglesSecond.resize(sceneTrianglesSecond.size());
+			ThreadPool::shared().parallelFor(0, trianglesFirst.size(), 4096, [&](std::size_t i)
+				{
+					trianglesFirst[i].v0 = translation + linear * sceneTrianglesFirst[i].v0;
+					trianglesFirst[i].edgeA = linear * sceneTrianglesFirst[i].edgeA;
+					trianglesSecond[i] = sceneTrianglesSecond[i];
+					trianglesSecond[i].edgeB = linear * sceneTrianglesSecond[i].edgeB;
+				});
+			vertexPositions.resize(scenePositions.size());
+			ThreadPool::shared().parallelFor(0, vertexPositions.size(), 4096, [&](std::size_t i)
+				{
+					vertexPositions[i] = translation + linear * scenePositions[i];
+				});
+			sceneNormalMatrix = glm::transpose(glm::inverse(linear));
+			for (const SubmittedMesh& mesh : sceneMeshes)
 			{
-				pushAttributes(mesh, v, transformationMatrix, normalTransMat);
-				float invVertNumber = 1.f / ((float)(v + 1.f));
-				averageNormal = glm::mix(GlHelpers::aiToGlm(normalTransMat * mesh->mNormals[v]), averageNormal, invVertNumber);
+				submitLight(mesh, sceneMatrix);
 			}
-			auto objectIndex = (uint32_t)objects.size();
+		}
+		submitSkyLight();
+	}
 
-			// Construct triangle lookup table
-			for (std::size_t f = 0; f < mesh->mNumFaces; f++)
+	// Writes the attributes and the triangles of a placed mesh into its ranges. Returns false when some faces are not triangles
+	bool SubmitMesh(PendingMesh& placed)
+	{
+		const aiMesh* mesh = placed.mesh;
+		const aiMatrix4x4& transformationMatrix = placed.transform;
+		glm::vec3 aabbMax(-std::numeric_limits<float>::infinity());
+		glm::vec3 aabbMin(std::numeric_limits<float>::infinity());
+		glm::vec3 averageNormal = glm::vec3(0, -1, 0);
+
+		auto normalTransMat = aiMatrix3x3(transformationMatrix).Inverse().Transpose();
+		float* attributes = vertexAttrs.data.data() + placed.attributeOffset;
+		writeAttributes(mesh, normalTransMat, attributes);
+		if (mesh->mNormals != nullptr && mesh->mNumVertices > 0)
+		{
+			// The normals are already transformed in the attributes
+			const std::size_t stride = attributeStride(mesh);
+			const float* normal = attributes + (mesh->HasVertexColors(0) ? 4 : 0);
+			averageNormal = glm::make_vec3(normal);
+			for (std::size_t v = 1; v < mesh->mNumVertices; v++)
 			{
-				const struct aiFace* face = &mesh->mFaces[f];
-				if (face->mNumIndices != 3)// Support triangles only
-				{
-					resourceError += "Only triangle meshes are supported yet.";
-					return;
-				}
-
-				// Apply transformation matrix and construct a trinagle
-				glm::uvec3 indices = { face->mIndices[0], face->mIndices[1], face->mIndices[2] };
-				glm::vec3 v0 = GlHelpers::aiToGlm(transformationMatrix * mesh->mVertices[indices.x]);
-				glm::vec3 v1 = GlHelpers::aiToGlm(transformationMatrix * mesh->mVertices[indices.y]);
-				glm::vec3 v2 = GlHelpers::aiToGlm(transformationMatrix * mesh->mVertices[indices.z]);
-
-				aabbMax = glm::max(aabbMax, v0);
-				aabbMax = glm::max(aabbMax, v1);
-				aabbMax = glm::max(aabbMax, v2);
-				aabbMin = glm::min(aabbMin, v0);
-				aabbMin = glm::min(aabbMin, v1);
-				aabbMin = glm::min(aabbMin, v2);
-
-				auto fastTri = toFast(v0, v1, v2, indices, objectIndex);
-				trianglesFirst.push_back(fastTri.firstHalf());
-				trianglesSecond.push_back(fastTri.secondHalf());
+				float invVertNumber = 1.f / ((float)(v + 1.f));
+				averageNormal = glm::mix(glm::make_vec3(normal + v * stride), averageNormal, invVertNumber);
 			}
+		}
 
-			uint32_t materialIndex;
-			if (sceneMaterialIndices.contains(mesh->mMaterialIndex))
-			{
-				materialIndex = sceneMaterialIndices[mesh->mMaterialIndex];
-			}
-			else
-			{
-				SubmitMaterial(sc->mMaterials[mesh->mMaterialIndex]);
-				sceneMaterialIndices.emplace(mesh->mMaterialIndex, materialCursorPos);
-				materialIndex = materialCursorPos;
-			}
+		// Every vertex is shared by several faces, so transform each one once.
+		// Indexed positions are kept for the shader, otherwise they are needed only to build the triangles
+		thread_local std::vector<glm::vec3> scratchPositions;
+		std::span<glm::vec3> positions;
+		if (loadingScene.indexed)
+		{
+			positions = std::span<glm::vec3>(vertexPositions).subspan(placed.positionOffset, mesh->mNumVertices);
+		}
+		else
+		{
+			scratchPositions.resize(mesh->mNumVertices);
+			positions = scratchPositions;
+		}
+		GlHelpers::transformPoints(transformationMatrix, mesh->mVertices, reinterpret_cast<float*>(positions.data()), 3, mesh->mNumVertices);
 
-			auto thisEmission = materials[materialIndex].emissive;
-			if (thisEmission != glm::vec3(0))
+		// Construct triangle lookup table
+		bool triangles = true;
+		for (std::size_t f = 0; f < mesh->mNumFaces; f++)
+		{
+			const struct aiFace* face = &mesh->mFaces[f];
+			if (face->mNumIndices != 3)// Support triangles only
 			{
-				auto areaSize = glm::distance(aabbMin, aabbMax);
-				if (materials[materialIndex].isTexture & 2)
-				{
-					lights.push_back({
-						glm::mix(aabbMin, aabbMax, 0.5f),
-						areaSize,
-						glm::normalize(averageNormal),
-						areaSize * areaSize,
-						lightMultiplier * glm::vec4(1),
-						objectIndex
-						});
-				}
-				else
-				{
-					// If this object is emissive, treat is as a light
-					Light currentLight = {
-						glm::mix(aabbMin, aabbMax, 0.5f),
-						areaSize,
-						glm::normalize(averageNormal),
-						areaSize * areaSize,
-						glm::vec4(thisEmission,1.f),
-						objectIndex
-					};
-					lights.push_back(currentLight);
-				}
+				triangles = false;
+				continue;
 			}
-			objects.push_back(SceneObject(
-				materialIndex, vboCursorPos, triCursorPos, mesh->mNumFaces,
-				mesh->HasVertexColors(0), mesh->HasNormals(), mesh->HasTextureCoords(0)
-			));
-			std::cout << "is obj number " << objects.size() - 1 << " begins at " << triCursorPos << " with material " << materialIndex << std::endl;
-			aiVector3D pos;
-			aiQuaternion rot;
-			transformationMatrix.DecomposeNoScaling(rot, pos);
-			aiVector3D sca = { transformationMatrix[0][0] ,transformationMatrix[1][1],transformationMatrix[2][2] };
-			std::cout << "pos " << GlHelpers::aiToGlm(pos) << " rot " << rot.x << "," << rot.y << "," << rot.z << "," << rot.w << " sca " << GlHelpers::aiToGlm(sca) << std::endl;
+
+			// Apply transformation matrix and construct a trinagle
+			glm::uvec3 indices = { face->mIndices[0], face->mIndices[1], face->mIndices[2] };
+			const glm::vec3& v0 = positions[indices.x];
+			const glm::vec3& v1 = positions[indices.y];
+			const glm::vec3& v2 = positions[indices.z];
+
+			aabbMax = glm::max(aabbMax, v0);
+			aabbMax = glm::max(aabbMax, v1);
+			aabbMax = glm::max(aabbMax, v2);
+			aabbMin = glm::min(aabbMin, v0);
+			aabbMin = glm::min(aabbMin, v1);
+			aabbMin = glm::min(aabbMin, v2);
+
+			auto fastTri = toFast(v0, v1, v2, indices, placed.submitted.object);
+			trianglesFirst[placed.triangleOffset + f] = fastTri.firstHalf();
+			trianglesSecond[placed.triangleOffset + f] = fastTri.secondHalf();
 		}
 
-		// draw all children
-		for (auto n = (decltype(nd->mNumChildren))0; n < nd->mNumChildren; ++n)
+		placed.submitted.aabbMin = aabbMin;
+		placed.submitted.aabbMax = aabbMax;
+		placed.submitted.averageNormal = averageNormal;
+		return triangles;
+	}
+
+	void submitLight(const SubmittedMesh& mesh, const glm::mat4& transform)
+	{
+		Box3 bounds;
+		bounds.expandInit();
+		for (int corner = 0; corner < 8; corner++)
+		{
+			glm::vec3 point(
+				corner & 1 ? mesh.aabbMax.x : mesh.aabbMin.x,
+				corner & 2 ? mesh.aabbMax.y : mesh.aabbMin.y,
+				corner & 4 ? mesh.aabbMax.z : mesh.aabbMin.z
+			);
+			bounds.expand(glm::vec3(transform * glm::vec4(point, 1.f)));
+		}
+		glm::vec3 normal = glm::transpose(glm::inverse(glm::mat3(transform))) * mesh.averageNormal;
+		submitLight(mesh.object, bounds.m_min, bounds.m_max, normal);
+	}
+
+	// If the object is emissive, treat is as a light
+	void submitLight(uint32_t objectIndex, glm::vec3 aabbMin, glm::vec3 aabbMax, glm::vec3 averageNormal)
+	{
+		const Material& material = materials[objects[objectIndex].material];
+		auto thisEmission = material.emissive;
+		if (thisEmission == glm::vec3(0))
 		{
-			SubmitScene(sc, nd->mChildren[n], transformationMatrix);
+			return;
+		}
+		auto areaSize = glm::distance(aabbMin, aabbMax);
+		if (material.isTexture & 2)
+		{
+			lights.push_back({
+				glm::mix(aabbMin, aabbMax, 0.5f),
+				areaSize,
+				glm::normalize(averageNormal),
+				areaSize * areaSize,
+				lightMultiplier * glm::vec4(1),
+				objectIndex
+				});
+		}
+		else
+		{
+			Light currentLight = {
+				glm::mix(aabbMin, aabbMax, 0.5f),
+				areaSize,
+				glm::normalize(averageNormal),
+				areaSize * areaSize,
+				glm::vec4(thisEmission,1.f),
+				objectIndex
+			};
+			lights.push_back(currentLight);
+		}
+	}
+
+	void submitSkyLight()
+	{
+		if (SceneAndViewSettings::skyLight)
+		{
+			if (lights.empty())
+			{
+				Light currentLight = {
+					glm::vec3(0,1000,0),
+					10000,
+					glm::vec3(0,-1,0),
+					10000 * 10000,
+					glm::vec4(1.f) * SceneAndViewSettings::lightMultiplier,
+					UINT32_MAX
+				};
+				lights.push_back(currentLight);
+			}
+			else
+			{
+				std::cerr << "Sky light cannot be used with other lights\n";
+			}
 		}
 	}
 };
\ No newline at end of file
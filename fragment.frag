@@ -6,7 +6,9 @@
 #define MAX_BOUNCES 3
 #endif
 
-#ifdef FLAT_SCREEN
+#if defined(QUILT)
+#define getRay getQuiltRay
+#elif defined(FLAT_SCREEN)
 #define getRay getFlatScreenRay
 #else
 #define getRay getLookingGlassRay
@@ -16,9 +18,15 @@
 #define STACK_SIZE 20
 #endif
 
-#ifndef MAX_OBJECT_BUFFER
-#define MAX_OBJECT_BUFFER 64
+// Children per BVH node. 2 is the stackless threaded layout, 4 and 8 are the wide layouts
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 2
 #endif
+// Bits per quantized child bound in the wide layouts (8 or 16). 0 for full precision
+#ifndef BVH_QUANTIZATION
+#define BVH_QUANTIZATION 0
+#endif
+
 
 #ifdef DEBUG_VISUALIZE_BVH
     #ifndef DEBUG_BVH_LEVEL0_COLOR
@@ -72,6 +80,8 @@ struct ObjectDefinition {
     uint vboStartIndex;
     uint vertexAttrs;
     uint totalAttrsSize;
+    // First vertex of the object in the position buffer with INDEXED_POSITIONS
+    uint positionStartIndex;
 };
 
 struct Light {
@@ -83,8 +93,8 @@ struct Light {
     uint object;
 };
 
-layout(shared, binding = 1) uniform ObjectBuffer {
-    ObjectDefinition[MAX_OBJECT_BUFFER] objectDefinitions;
+layout(std430, binding = 11) readonly buffer ObjectBuffer {
+    ObjectDefinition[] objectDefinitions;
 };
 
 layout(binding = 2, rgba8)
@@ -99,13 +109,15 @@ uniform float uTime = 0;
 uniform vec2 uWindowSize = vec2(500,500);
 uniform vec2 uWindowPos;
 uniform vec2 uMouse = vec2(0.5,0.5);
-uniform float uViewCone = radians(20); // 40 deg in rad
-uniform float uFocusDistance = 10;
 
 uniform float uInvRayCount = 1.;
 uniform uint uRayIndex = 0;
 uniform float uRayOffset = 1e-5;
 uniform uint uSubpI = 0;
+// Slot of the top-level BVH root with BVH_TWO_LEVEL
+uniform uint uTopLevelRoot = 0xFFFFFFFFu;
+// Without BVH_TWO_LEVEL the vertex attribute normals are stored before the scene transform
+uniform mat3 uSceneNormalMatrix = mat3(1.);
 uint subpI = uSubpI;
 
 layout(std430, binding = 5) readonly buffer AttributeBuffer {
@@ -146,9 +158,25 @@ struct BVHNode
 	vec4 bboxMax;
 };
 
+#ifdef INDEXED_POSITIONS
+struct IndexedTriangle {
+    uvec3 attributeIndices;
+    uint objectIndex;
+};
+
+layout(std430, binding = 6) readonly buffer TriangleBuffer {
+    IndexedTriangle[] trianglesIndexed;
+};
+
+// Vertices of all the objects, three floats each. The triangles refer to them by their attribute indices
+layout(std430, binding = 10) readonly buffer PositionBuffer {
+    float[] vertexPositions;
+};
+#else
 layout(std430, binding = 6) readonly buffer TriangleBuffer {
     TriangleSecondHalf[] trianglesSecond;
 };
+#endif
 
 layout(std430, binding = 7) readonly buffer MaterialBuffer {
     Material[] materials;
@@ -186,6 +214,10 @@ struct Hit {
     vec2 barycentric;
     uvec3 indices;
     vec3 normal;
+#ifdef BVH_TWO_LEVEL
+    // Transforms the normals of the hit mesh to the world space
+    mat3 normalMatrix;
+#endif
 };
 
 // https://www.shadertoy.com/view/4lfcDr
@@ -258,6 +290,16 @@ Ray createSecondaryRay(vec2 coord, vec3 pos, vec3 normal)
     return ray_next;
 }
 
+// Inverted matrices of the Looking Glass views, computed on the CPU when the camera changes.
+// Holds the tile views, the quilt tiles with QUILT or a single camera with FLAT_SCREEN
+struct ViewCamera {
+    mat4 inverseViewProj;
+    vec4 position;
+};
+layout(std430, binding = 12) readonly buffer ViewBuffer {
+    ViewCamera viewCameras[];
+};
+
 const int tile = 45;
 Ray generateChaRay(){
     vec2 texCoords = vNDCpos*.5f+.5f;
@@ -267,26 +309,12 @@ Ray generateChaRay(){
 	view = (1.0 - view);
 	vec2 vvPos = texCoords*2.f-1.f;
 
-    view = floor(view * tile);
-
-    mat4 newView = uView;
-    mat4 newProj = uProj;
-  
-    float aspect = uWindowSize.x/uWindowSize.y;
-    float ttt = view / (45.f - 1);
-    float S = 0.5f*uFocusDistance*tan(uViewCone);
-    float s = S-2*ttt*S;
-    float invTanFov = uProj[1][1];
-
-    newView[3][0] += s;
-    newProj[2][0] += s/(uFocusDistance*aspect*(1/invTanFov));
-
-    vec4 dir = inverse(newProj * newView)*vec4(vvPos,1,1);
+    ViewCamera viewCamera = viewCameras[clamp(int(view * tile), 0, tile - 1)];
+    vec4 dir = viewCamera.inverseViewProj*vec4(vvPos,1,1);
     dir.xyz/=dir.w;
-    vec3 pos = vec3(inverse(newView)*vec4(0,0,0,1));
 
     Ray ray;
-    ray.origin=pos;
+    ray.origin=viewCamera.position.xyz;
     ray.direction=normalize(dir.xyz);
     return ray;
 }
@@ -295,15 +323,25 @@ void getLookingGlassRay(vec2 pix, out Ray ray) {
     ray = generateChaRay();
 }
 
+// The matrix of the flat camera drops the w of the unprojected point, so it yields a direction
 void getFlatScreenRay(vec2 pix, out Ray ray){
-    mat4 invView = inverse(uView);
-    vec4 dir = inverse(uProj) * vec4(pix,1,1);
-    dir.w = 0;
-    dir = invView * dir;
-    vec3 pos = vec3(invView * vec4(0,0,0,1));
+    vec4 dir = viewCameras[0].inverseViewProj * vec4(pix,1,1);
+    ray = Ray(viewCameras[0].position.xyz, normalize(dir.xyz));
+}
+
+#ifdef QUILT
+// Every tile of the quilt is a pinhole camera of one view. The first view is in the bottom left corner
+uniform uvec2 uQuiltTiles = uvec2(5, 9);
 
-    ray = Ray(pos, normalize(dir.xyz));
+void getQuiltRay(vec2 pix, out Ray ray)
+{
+    vec2 tilePos = (pix * .5 + .5) * vec2(uQuiltTiles);
+    uvec2 tile = min(uvec2(tilePos), uQuiltTiles - 1u);
+    ViewCamera viewCamera = viewCameras[tile.x + tile.y * uQuiltTiles.x];
+    vec4 dir = viewCamera.inverseViewProj * vec4((tilePos - vec2(tile)) * 2. - 1., 1, 1);
+    ray = Ray(viewCamera.position.xyz, normalize(dir.xyz / dir.w));
 }
+#endif
 
 bool rayBoxIntersection(vec3 minPos, vec3 maxPos, vec3 rayOrigin, vec3 invDir, out float tmin, out float tmax)
 {
@@ -505,13 +543,319 @@ float xorTextureGradBox( in vec2 pos, in vec2 ddx, in vec2 ddy )
     return xor;
 }
 
-void findClosestHit(Ray ray, inout Hit closestHit)
+#ifdef DEBUG_VISUALIZE_BVH
+// Blends the color of the BVH level into debugColor. The edges of the box are highlighted
+void visualizeBox(vec3 bboxMin, vec3 bboxMax, Ray ray, float tmin, float tmax, uint iterationLevel)
+{
+    if((iterationLevel & DEBUG_BVH_LEVEL_MASK) != 0)
+    {
+        vec3 closestPointOnAABB = ray.origin + ray.direction * tmin;
+        vec3 farPointOnAABB = ray.origin + ray.direction * tmax;
+
+        vec3 distCMin = abs(closestPointOnAABB - bboxMin);
+        bvec3 isOnPlane = lessThan(distCMin, vec3(0.0001));
+        distCMin += vec3(isOnPlane) * 100;
+
+        vec3 distFMin = abs(farPointOnAABB - bboxMin);
+        isOnPlane = lessThan(distFMin, vec3(0.0001));
+        distFMin += vec3(isOnPlane) * 100;
+
+        vec3 distCMax = abs(closestPointOnAABB - bboxMax);
+        isOnPlane = lessThan(distCMax, vec3(0.0001));
+        distCMax += vec3(isOnPlane) * 100;
+
+        vec3 distFMax = abs(farPointOnAABB - bboxMax);
+        isOnPlane = lessThan(distFMax, vec3(0.0001));
+        distFMax += vec3(isOnPlane) * 100;
+
+
+        float edgeDistance = min(min(min(min(distCMin.x, distCMin.y), distCMin.z), distFMin.x), min(min(distFMin.y, distFMin.z), min(min(distCMax.x, distCMax.y), distCMax.z)));
+
+        vec4 thisDebugColor = vec4(DEBUG_BVH_COLOR_ARRAY[iterationLevel % DEBUG_BVH_COLOR_ARRAY.length()], 1.);
+        if(edgeDistance < DEBUG_BVH_EDGE_WIDTH)
+        {
+            debugColor = mix(thisDebugColor, debugColor, 0.5);
+        }
+        else
+        {
+            debugColor = mix(thisDebugColor, debugColor, .99);
+        }
+    }
+}
+#endif
+
+// Fills the hit when the triangle is closer
+bool intersectTriangle(Triangle tri, uint objectIndex, Ray ray, inout Hit hit)
+{
+    float outU, outV;
+    vec3 normal;
+    if(embreeIntersect(
+        tri,
+        ray,
+        hit.rayT, outU, outV, normal))
+    //if(rayTriangleIntersect(ray.origin, ray.direction, tri.v0, tri.v0 - tri.edgeA, tri.edgeB + tri.v0, outT, outV, outU))
+    {
+        ObjectDefinition obj = objectDefinitions[objectIndex];
+        hit.vboStartIndex = obj.vboStartIndex;
+        hit.attrs = obj.vertexAttrs;
+        hit.material = obj.material;
+        hit.totalAttrSize = obj.totalAttrsSize;
+        hit.barycentric = vec2(outV, outU);
+        hit.indices = tri.attributeIndices;
+        hit.normal = normalize(normal);
+        return true;
+    }
+    return false;
+}
+
+#ifdef INDEXED_POSITIONS
+vec3 vertexPosition(uint index)
+{
+    return vec3(vertexPositions[index * 3], vertexPositions[index * 3 + 1], vertexPositions[index * 3 + 2]);
+}
+
+// Gathers the vertices of the triangle from the position buffer
+bool intersectTriangle(uint primitiveIndex, Ray ray, inout Hit hit)
+{
+    IndexedTriangle indexed = trianglesIndexed[primitiveIndex];
+    uint firstVertex = objectDefinitions[indexed.objectIndex].positionStartIndex;
+    vec3 v0 = vertexPosition(firstVertex + indexed.attributeIndices.x);
+    vec3 v1 = vertexPosition(firstVertex + indexed.attributeIndices.y);
+    vec3 v2 = vertexPosition(firstVertex + indexed.attributeIndices.z);
+    return intersectTriangle(Triangle(v0, v0 - v1, v2 - v0, indexed.attributeIndices), indexed.objectIndex, ray, hit);
+}
+#else
+// Tests the triangle whose first half (v0 and edgeA) is stored in the BVH
+bool intersectTriangle(uint primitiveIndex, vec3 v0, vec3 edgeA, Ray ray, inout Hit hit)
+{
+    TriangleSecondHalf triSecond = trianglesSecond[primitiveIndex];
+    return intersectTriangle(Triangle(v0, edgeA, triSecond.edgeB, triSecond.attributeIndices), triSecond.objectIndex, ray, hit);
+}
+#endif
+
+// Leaves with more triangles store (v0, edgeA) of each triangle contiguously in the BVH buffer.
+// With INDEXED_POSITIONS they store only the triangle indices, four in a vec4
+#define BVH_LEAF_MASK 0x80000000u
+#define BVH_INVALID 0xFFFFFFFFu
+#define BVH_LEAF_COUNT_SHIFT 28u
+#define BVH_LEAF_OFFSET_MASK 0x0FFFFFFFu
+
+// Tests count triangles stored from the BVH vec4 index first. Returns when any one is hit if stopAtFirst is set
+bool intersectTriangles(uint first, uint count, bool stopAtFirst, Ray ray, inout Hit hit)
+{
+    bool found = false;
+    for(uint i = 0; i < count; i++)
+    {
+        #ifdef INDEXED_POSITIONS
+        found = intersectTriangle(floatBitsToUint(bvh[first + i / 4][i % 4]), ray, hit) || found;
+        #else
+        vec4 v0 = bvh[first + i * 2];
+        found = intersectTriangle(floatBitsToUint(v0.w), v0.xyz, bvh[first + i * 2 + 1].xyz, ray, hit) || found;
+        #endif
+        if(found && stopAtFirst)
+        {
+            break;
+        }
+    }
+    return found;
+}
+
+#if BVH_WIDTH > 2
+// Wide nodes consist of groups of 4 children. With full precision, each group is 7 vec4:
+// min x, max x, min y, max y, min z, max z of the children and the child references.
+// Quantized groups start with the origin and the packed scale exponents, followed by the quantized bounds and the references.
+// Leaf references point to the triangle records stored in the BVH buffer: v0 and edgeA, or only the indices with INDEXED_POSITIONS.
+// Bits above BVH_LEAF_COUNT_SHIFT hold the triangle count minus one
+#if BVH_QUANTIZATION == 8
+#define BVH_GROUP_SIZE 4u
+#elif BVH_QUANTIZATION == 16
+#define BVH_GROUP_SIZE 5u
+#else
+#define BVH_GROUP_SIZE 7u
+#endif
+
+// Bounds of the 4 children of a group in the order min x, max x, min y, max y, min z, max z
+void decodeChildBounds(uint group, out vec4 bounds[6])
+{
+#if BVH_QUANTIZATION == 0
+    for(uint i = 0; i < 6; i++)
+    {
+        bounds[i] = bvh[group + i];
+    }
+#else
+    vec4 header = bvh[group];
+    uint exponents = floatBitsToUint(header.w);
+    for(uint i = 0; i < 6; i++)
+    {
+        uint axis = i / 2;
+        // Power of two made directly from the exponent bits
+        float scale = uintBitsToFloat(((exponents >> (axis * 8)) & 0xFFu) << 23);
+    #if BVH_QUANTIZATION == 8
+        uint word = floatBitsToUint(bvh[group + 1 + i / 4][i % 4]);
+        uvec4 quantized = (uvec4(word) >> uvec4(0, 8, 16, 24)) & 0xFFu;
+    #else
+        uvec2 words = floatBitsToUint(vec2(bvh[group + 1 + i / 2][(i % 2) * 2], bvh[group + 1 + i / 2][(i % 2) * 2 + 1]));
+        uvec4 quantized = (words.xxyy >> uvec4(0, 16, 0, 16)) & 0xFFFFu;
+    #endif
+        bounds[i] = header[axis] + vec4(quantized) * scale;
+    }
+#endif
+}
+
+// Slab test of the 4 children of a group at once
+bvec4 intersectChildren(vec4 bounds[6], vec3 originDivDir, vec3 invDir, float maxT, out vec4 tEntry, out vec4 tExit)
+{
+    vec4 tx0 = bounds[0] * invDir.x - originDivDir.x;
+    vec4 tx1 = bounds[1] * invDir.x - originDivDir.x;
+    vec4 ty0 = bounds[2] * invDir.y - originDivDir.y;
+    vec4 ty1 = bounds[3] * invDir.y - originDivDir.y;
+    vec4 tz0 = bounds[4] * invDir.z - originDivDir.z;
+    vec4 tz1 = bounds[5] * invDir.z - originDivDir.z;
+
+    tEntry = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), vec4(0)));
+    tExit = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), vec4(maxT)));
+    return lessThanEqual(tEntry, tExit);
+}
+
+void traverseClosestHit(uint root, Ray ray, inout Hit closestHit)
+{
+    if(bvh.length() == 0)
+    {
+        return;
+    }
+    vec3 invDir = 1.0 / ray.direction;
+    vec3 originDivDir = ray.origin * invDir;
+    #ifdef DEBUG_VISUALIZE_BVH
+    uint iterationLevel = 0;
+    #endif
+
+    // Only internal nodes get to the stack. Leaves are intersected right away
+    uint stack[STACK_SIZE];
+    float stackT[STACK_SIZE];
+    uint stackSize = 1;
+    stack[0] = root;
+    stackT[0] = 0;
+    while(stackSize > 0)
+    {
+        --stackSize;
+        if(stackT[stackSize] > closestHit.rayT)
+        {
+            // A closer hit was found after the node had been pushed
+            continue;
+        }
+        uint node = stack[stackSize];
+
+        // Hit children sorted from the farthest so the nearest one is popped first
+        uint childNodes[BVH_WIDTH];
+        float childT[BVH_WIDTH];
+        uint childCount = 0;
+        for(uint group = node; group < node + BVH_WIDTH / 4 * BVH_GROUP_SIZE; group += BVH_GROUP_SIZE)
+        {
+            vec4 bounds[6];
+            decodeChildBounds(group, bounds);
+            vec4 tEntry, tExit;
+            bvec4 hits = intersectChildren(bounds, originDivDir, invDir, closestHit.rayT, tEntry, tExit);
+            uvec4 children = floatBitsToUint(bvh[group + BVH_GROUP_SIZE - 1]);
+            for(uint lane = 0; lane < 4; lane++)
+            {
+                if(children[lane] == BVH_INVALID)
+                {
+                    continue;
+                }
+                #ifdef DEBUG_VISUALIZE_BVH
+                if(hits[lane])
+                {
+                    visualizeBox(
+                        vec3(bounds[0][lane], bounds[2][lane], bounds[4][lane]),
+                        vec3(bounds[1][lane], bounds[3][lane], bounds[5][lane]),
+                        ray, tEntry[lane], tExit[lane], iterationLevel);
+                }
+                iterationLevel++;
+                #endif
+                if(!hits[lane])
+                {
+                    continue;
+                }
+                if((children[lane] & BVH_LEAF_MASK) != 0)
+                {
+                    uint count = ((children[lane] & ~BVH_LEAF_MASK) >> BVH_LEAF_COUNT_SHIFT) + 1;
+                    intersectTriangles(children[lane] & BVH_LEAF_OFFSET_MASK, count, false, ray, closestHit);
+                }
+                else
+                {
+                    uint i = childCount++;
+                    for(; i > 0 && childT[i - 1] < tEntry[lane]; i--)
+                    {
+                        childNodes[i] = childNodes[i - 1];
+                        childT[i] = childT[i - 1];
+                    }
+                    childNodes[i] = children[lane];
+                    childT[i] = tEntry[lane];
+                }
+            }
+        }
+        for(uint i = 0; i < childCount; i++, stackSize++)
+        {
+            stack[stackSize] = childNodes[i];
+            stackT[stackSize] = childT[i];
+        }
+    }
+}
+
+// For shadows. Returns true when anything is hit
+bool traverseAnyHit(uint root, Ray ray, inout Hit anyHit)
+{
+    if(bvh.length() == 0)
+    {
+        return false;
+    }
+    vec3 invDir = 1.0 / ray.direction;
+    vec3 originDivDir = ray.origin * invDir;
+
+    uint stack[STACK_SIZE];
+    uint stackSize = 1;
+    stack[0] = root;
+    while(stackSize > 0)
+    {
+        uint node = stack[--stackSize];
+        for(uint group = node; group < node + BVH_WIDTH / 4 * BVH_GROUP_SIZE; group += BVH_GROUP_SIZE)
+        {
+            vec4 bounds[6];
+            decodeChildBounds(group, bounds);
+            vec4 tEntry, tExit;
+            bvec4 hits = intersectChildren(bounds, originDivDir, invDir, anyHit.rayT, tEntry, tExit);
+            uvec4 children = floatBitsToUint(bvh[group + BVH_GROUP_SIZE - 1]);
+            for(uint lane = 0; lane < 4; lane++)
+            {
+                if(!hits[lane] || children[lane] == BVH_INVALID)
+                {
+                    continue;
+                }
+                if((children[lane] & BVH_LEAF_MASK) != 0)
+                {
+                    uint count = ((children[lane] & ~BVH_LEAF_MASK) >> BVH_LEAF_COUNT_SHIFT) + 1;
+                    if(intersectTriangles(children[lane] & BVH_LEAF_OFFSET_MASK, count, true, ray, anyHit))
+                    {
+                        return true;
+                    }
+                }
+                else
+                {
+                    stack[stackSize++] = children[lane];
+                }
+            }
+        }
+    }
+    return false;
+}
+#else
+void traverseClosestHit(uint root, Ray ray, inout Hit closestHit)
 {
     // Traverse BVH
     // Adapted from:
     // https://github.com/kayru/RayTracedShadows/blob/master/Source/Shaders/RayTracedShadows.comp
     // https://pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
-    uint nodeIndex = 0;
+    uint nodeIndex = root;
 
     uint lastNode = bvh.length();
     #ifdef DEBUG_VISUALIZE_BVH
@@ -530,65 +874,26 @@ void findClosestHit(Ray ray, inout Hit closestHit)
         bool isLeaf = primitiveIndex != 0xFFFFFFFF;
         float tmin, tmax;
         vec3 invDir = 1.0 / ray.direction;
-        if(isLeaf)
+        if(isLeaf && (primitiveIndex & BVH_LEAF_MASK) != 0)
         {
-            TriangleSecondHalf triSecond = trianglesSecond[primitiveIndex];
-            Triangle tri = Triangle(node.bboxMin.xyz,node.bboxMax.xyz, triSecond.edgeB, triSecond.attributeIndices);
-            float outT, outU, outV;
-            vec3 normal;
-            if(embreeIntersect(
-                tri,
-                ray,
-                closestHit.rayT, outU, outV, normal))
-            //if(rayTriangleIntersect(ray.origin, ray.direction, tri.v0, tri.v0 - tri.edgeA, tri.edgeB + tri.v0, outT, outV, outU))
+            // Multi-triangle leaf. Its bounds are followed by the triangles
+            if(rayBoxIntersection(node.bboxMin.xyz, node.bboxMax.xyz, ray.origin, invDir, tmin, tmax))
             {
-                ObjectDefinition obj = objectDefinitions[triSecond.objectIndex];
-                closestHit.vboStartIndex = obj.vboStartIndex;
-                closestHit.attrs = obj.vertexAttrs;
-                closestHit.material = obj.material;
-                closestHit.totalAttrSize = obj.totalAttrsSize;
-                closestHit.barycentric = vec2(outV, outU);
-                closestHit.indices = tri.attributeIndices;
-                closestHit.normal = normalize(normal);
+                intersectTriangles((nodeIndex + 1) * 2, primitiveIndex & ~BVH_LEAF_MASK, false, ray, closestHit);
             }
         }
+        else if(isLeaf)
+        {
+            #ifdef INDEXED_POSITIONS
+            intersectTriangle(primitiveIndex, ray, closestHit);
+            #else
+            intersectTriangle(primitiveIndex, node.bboxMin.xyz, node.bboxMax.xyz, ray, closestHit);
+            #endif
+        }
         else if (rayBoxIntersection(node.bboxMin.xyz, node.bboxMax.xyz, ray.origin, invDir, tmin, tmax))
 		{
             #ifdef DEBUG_VISUALIZE_BVH
-            if((iterationLevel & DEBUG_BVH_LEVEL_MASK) != 0)
-            {
-			    vec3 closestPointOnAABB = ray.origin + ray.direction * tmin;
-                vec3 farPointOnAABB = ray.origin + ray.direction * tmax;
-
-                vec3 distCMin = abs(closestPointOnAABB - node.bboxMin.xyz);
-                bvec3 isOnPlane = lessThan(distCMin, vec3(0.0001));
-                distCMin += vec3(isOnPlane) * 100;
-
-                vec3 distFMin = abs(farPointOnAABB - node.bboxMin.xyz);
-                isOnPlane = lessThan(distFMin, vec3(0.0001));
-                distFMin += vec3(isOnPlane) * 100;
-
-                vec3 distCMax = abs(closestPointOnAABB - node.bboxMax.xyz);
-                isOnPlane = lessThan(distCMax, vec3(0.0001));
-                distCMax += vec3(isOnPlane) * 100;
-
-                vec3 distFMax = abs(farPointOnAABB - node.bboxMax.xyz);
-                isOnPlane = lessThan(distFMax, vec3(0.0001));
-                distFMax += vec3(isOnPlane) * 100;
-
-
-                float edgeDistance = min(min(min(min(distCMin.x, distCMin.y), distCMin.z), distFMin.x), min(min(distFMin.y, distFMin.z), min(min(distCMax.x, distCMax.y), distCMax.z)));
-
-                vec4 thisDebugColor = vec4(DEBUG_BVH_COLOR_ARRAY[iterationLevel % DEBUG_BVH_COLOR_ARRAY.length()], 1.);
-                if(edgeDistance < DEBUG_BVH_EDGE_WIDTH)
-                {
-                    debugColor = mix(thisDebugColor, debugColor, 0.5);
-			    }
-                else
-                {
-                    debugColor = mix(thisDebugColor, debugColor, .99);
-                }
-            }
+            visualizeBox(node.bboxMin.xyz, node.bboxMax.xyz, ray, tmin, tmax, iterationLevel);
             iterationLevel++;
             #endif
 			// If the ray intersects the bounding volume box, go to the next level
@@ -606,10 +911,10 @@ void findClosestHit(Ray ray, inout Hit closestHit)
 }
 
 
-// For shadows
-void findAnyHit(Ray ray, inout Hit anyHit)
+// For shadows. Returns true when anything is hit
+bool traverseAnyHit(uint root, Ray ray, inout Hit anyHit)
 {
-    uint nodeIndex = 0;
+    uint nodeIndex = root;
 
     uint lastNode = bvh.length();
      
@@ -622,27 +927,23 @@ void findAnyHit(Ray ray, inout Hit anyHit)
         uint primitiveIndex = floatBitsToUint(node.bboxMin.w);
 
         bool isLeaf = primitiveIndex != 0xFFFFFFFF;
-        if(isLeaf)
+        if(isLeaf && (primitiveIndex & BVH_LEAF_MASK) != 0)
         {
-            TriangleSecondHalf triSecond = trianglesSecond[primitiveIndex];
-            Triangle tri = Triangle(node.bboxMin.xyz,node.bboxMax.xyz, triSecond.edgeB, triSecond.attributeIndices);
-            float outT, outU, outV;
-            vec3 normal;
-            if(embreeIntersect(
-                tri,
-                ray,
-                anyHit.rayT, outU, outV, normal))
-            //if(rayTriangleIntersect(ray.origin, ray.direction, tri.v0, tri.v0 - tri.edgeA, tri.edgeB + tri.v0, outT, outV, outU))
+            if(rayBoxIntersection(node.bboxMin.xyz, node.bboxMax.xyz, ray)
+                && intersectTriangles((nodeIndex + 1) * 2, primitiveIndex & ~BVH_LEAF_MASK, true, ray, anyHit))
             {
-                ObjectDefinition obj = objectDefinitions[triSecond.objectIndex];
-                anyHit.vboStartIndex = obj.vboStartIndex;
-                anyHit.attrs = obj.vertexAttrs;
-                anyHit.material = obj.material;
-                anyHit.totalAttrSize = obj.totalAttrsSize;
-                anyHit.barycentric = vec2(outV, outU);
-                anyHit.indices = tri.attributeIndices;
-                anyHit.normal = normalize(normal);
-                return;
+                return true;
+            }
+        }
+        else if(isLeaf)
+        {
+            #ifdef INDEXED_POSITIONS
+            if(intersectTriangle(primitiveIndex, ray, anyHit))
+            #else
+            if(intersectTriangle(primitiveIndex, node.bboxMin.xyz, node.bboxMax.xyz, ray, anyHit))
+            #endif
+            {
+                return true;
             }
         }
         else if (rayBoxIntersection(node.bboxMin.xyz, node.bboxMax.xyz, ray))
@@ -653,8 +954,96 @@ void findAnyHit(Ray ray, inout Hit anyHit)
         }
         nodeIndex = floatBitsToUint(node.bboxMax.w);
     }
+    return false;
+}
+#endif
+
+#ifdef BVH_TWO_LEVEL
+// The top level is a stackless binary BVH over the instances. Its leaves point to instance records:
+// three rows of the world-to-mesh matrix and the root of the mesh BVH
+
+// The direction is not normalized, so the ray parameter is the same in both spaces
+Ray toMeshSpace(uint instance, Ray ray)
+{
+    vec4 row0 = bvh[instance];
+    vec4 row1 = bvh[instance + 1];
+    vec4 row2 = bvh[instance + 2];
+    vec4 origin = vec4(ray.origin, 1.);
+    return Ray(
+        vec3(dot(row0, origin), dot(row1, origin), dot(row2, origin)),
+        vec3(dot(row0.xyz, ray.direction), dot(row1.xyz, ray.direction), dot(row2.xyz, ray.direction))
+    );
+}
+
+void findClosestHit(Ray ray, inout Hit closestHit)
+{
+    uint nodeIndex = uTopLevelRoot;
+    uint lastNode = bvh.length();
+    vec3 invDir = 1.0 / ray.direction;
+    while(nodeIndex < lastNode)
+    {
+        vec4 bboxMin = bvh[nodeIndex * 2];
+        vec4 bboxMax = bvh[nodeIndex * 2 + 1];
+        uint instance = floatBitsToUint(bboxMin.w);
+        float tmin, tmax;
+        if(rayBoxIntersection(bboxMin.xyz, bboxMax.xyz, ray.origin, invDir, tmin, tmax) && tmin <= closestHit.rayT)
+        {
+            if(instance == BVH_INVALID)
+            {
+                ++nodeIndex;
+                continue;
+            }
+            float previousT = closestHit.rayT;
+            traverseClosestHit(floatBitsToUint(bvh[instance + 3].x), toMeshSpace(instance, ray), closestHit);
+            if(closestHit.rayT < previousT)
+            {
+                // Transposed inverse of the mesh-to-world matrix
+                closestHit.normalMatrix = mat3(bvh[instance].xyz, bvh[instance + 1].xyz, bvh[instance + 2].xyz);
+                closestHit.normal = closestHit.normalMatrix * closestHit.normal;
+            }
+        }
+        nodeIndex = floatBitsToUint(bboxMax.w);
+    }
 }
 
+void findAnyHit(Ray ray, inout Hit anyHit)
+{
+    uint nodeIndex = uTopLevelRoot;
+    uint lastNode = bvh.length();
+    while(nodeIndex < lastNode)
+    {
+        vec4 bboxMin = bvh[nodeIndex * 2];
+        vec4 bboxMax = bvh[nodeIndex * 2 + 1];
+        uint instance = floatBitsToUint(bboxMin.w);
+        if(rayBoxIntersection(bboxMin.xyz, bboxMax.xyz, ray))
+        {
+            if(instance == BVH_INVALID)
+            {
+                ++nodeIndex;
+                continue;
+            }
+            if(traverseAnyHit(floatBitsToUint(bvh[instance + 3].x), toMeshSpace(instance, ray), anyHit))
+            {
+                return;
+            }
+        }
+        nodeIndex = floatBitsToUint(bboxMax.w);
+    }
+}
+#else
+void findClosestHit(Ray ray, inout Hit closestHit)
+{
+    traverseClosestHit(0, ray, closestHit);
+}
+
+// For shadows
+void findAnyHit(Ray ray, inout Hit anyHit)
+{
+    traverseAnyHit(0, ray, anyHit);
+}
+
+#endif
+
 bool resolveRay(Ray ray, float far, out vec3 albedo, out vec3 normal, out vec3 emission, out float depth)
 {
     Hit closestHit;
@@ -677,7 +1066,13 @@ bool resolveRay(Ray ray, float far, out vec3 albedo, out vec3 normal, out vec3 e
         if ((closestHit.attrs & 2u) != 0)
         {
             // Has normals
-            surfaceNormal = normalize(interpolate3(closestHit.vboStartIndex, closestHit.barycentric, closestHit.totalAttrSize, currentAttrOffset, closestHit.indices));
+            surfaceNormal = interpolate3(closestHit.vboStartIndex, closestHit.barycentric, closestHit.totalAttrSize, currentAttrOffset, closestHit.indices);
+            #ifdef BVH_TWO_LEVEL
+            surfaceNormal = closestHit.normalMatrix * surfaceNormal;
+            #else
+            surfaceNormal = uSceneNormalMatrix * surfaceNormal;
+            #endif
+            surfaceNormal = normalize(surfaceNormal);
             currentAttrOffset += 3;
         }
         if ((closestHit.attrs & 4u) != 0)
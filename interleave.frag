@@ -0,0 +1,41 @@
+//!#version 430
+// Lenticular interleaving of a quilt rendered by fragment.frag with QUILT defined.
+// Every subpixel samples the view it shows from the quilt, the same way generateChaRay chooses its view.
+
+out vec4 OutColor;
+in vec2 vNDCpos;
+
+layout(shared, binding = 0)
+uniform CalibrationBuffer {
+    float pitch;
+    float tilt;
+    float center;
+    float subp;
+    vec2 resolution;
+} uCalibration;
+
+layout(binding = 0)
+uniform sampler2D uQuilt;
+// Columns and rows of views. The first view is in the bottom left corner
+uniform uvec2 uQuiltTiles = uvec2(5, 9);
+
+void main() {
+    vec2 texCoords = vNDCpos * .5 + .5;
+    uint viewCount = uQuiltTiles.x * uQuiltTiles.y;
+    // Keeps the bilinear filter inside the tile of the view
+    vec2 halfTexel = 0.5 / vec2(textureSize(uQuilt, 0));
+    vec3 col;
+    for(uint subpI = 0; subpI < 3; subpI++)
+    {
+        float view = (texCoords.x + uCalibration.subp * subpI + texCoords.y * uCalibration.tilt) * uCalibration.pitch - uCalibration.center;
+        view = 1.0 - fract(view);
+        uint viewIndex = min(uint(view * viewCount), viewCount - 1u);
+        vec2 tile = vec2(viewIndex % uQuiltTiles.x, viewIndex / uQuiltTiles.x);
+        vec2 tileMin = tile / vec2(uQuiltTiles);
+        vec2 tileMax = (tile + 1.) / vec2(uQuiltTiles);
+        vec2 quiltCoords = clamp(mix(tileMin, tileMax, texCoords), tileMin + halfTexel, tileMax - halfTexel);
+        col[subpI] = texture(uQuilt, quiltCoords)[subpI];
+    }
+    // The quilt is already gamma corrected
+    OutColor = vec4(col, 1.0);
+}